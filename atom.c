@@ -43,6 +43,7 @@ int used_atoms;
 void
 initAtoms()
 {
+    initHashSeed();
     atomHashTable = calloc((1 << LOG2_ATOM_HASH_TABLE_SIZE),
                            sizeof(AtomPtr));
 
@@ -0,0 +1,76 @@
+/*
+Copyright (c) 2026 by the Polipo contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "polipo.h"
+#include "bench.h"
+
+AtomPtr configFile = NULL;
+AtomPtr pidFile = NULL;
+int daemonise = 0;
+int workerProcesses = 0;
+
+/* Wall-clock time in seconds. */
+double
+benchTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* A fixed pseudo-random sequence, so that runs can be compared. */
+unsigned int
+benchRandom()
+{
+    static unsigned int state = 12345;
+    state = state * 1103515245 + 12345;
+    return state >> 1;
+}
+
+/* Read a whole file into a NUL-terminated buffer. */
+char *
+benchReadFile(const char *name, int *length_return)
+{
+    FILE *f;
+    char *buf;
+    long n;
+
+    f = fopen(name, "rb");
+    if(f == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't open %s", name);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(n + 1);
+    if(buf == NULL || fread(buf, 1, n, f) != n) {
+        do_log(L_ERROR, "Couldn't read %s.\n", name);
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    buf[n] = '\0';
+    *length_return = n;
+    return buf;
+}
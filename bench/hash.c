@@ -0,0 +1,205 @@
+/*
+Copyright (c) 2026 by the Polipo contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Compare hash with the function it replaced: throughput, and how
+   evenly a list of URLs is spread over hash tables of various sizes.
+   Usage: hash file...
+   Each file holds one URL per line; lines starting with # are ignored.
+   The third field of an access log line is used if there is one, so
+   that a Polipo access log can be used directly. */
+
+#include "polipo.h"
+#include "bench.h"
+
+/* The hash function from before the keyed hash. */
+static unsigned int
+oldHash(unsigned int seed, const void *restrict key, int key_size,
+        unsigned int hash_size)
+{
+    int i;
+    unsigned int h;
+
+    h = seed;
+    for(i = 0; i < key_size; i++)
+        h = (h << 5) + (h >> (hash_size - 5)) +
+            ((unsigned char*)key)[i];
+    return h & ((1 << hash_size) - 1);
+}
+
+typedef unsigned int (*HashFunction)(unsigned int, const void *restrict,
+                                     int, unsigned int);
+
+static char **keys;
+static int *lengths;
+static int numKeys = 0, keysSize = 0;
+static long totalLength = 0;
+
+static void
+addKey(char *key, int n)
+{
+    if(numKeys >= keysSize) {
+        keysSize = keysSize ? 2 * keysSize : 1024;
+        keys = realloc(keys, keysSize * sizeof(char*));
+        lengths = realloc(lengths, keysSize * sizeof(int));
+        if(keys == NULL || lengths == NULL) {
+            do_log(L_ERROR, "Couldn't allocate keys.\n");
+            exit(1);
+        }
+    }
+    keys[numKeys] = key;
+    lengths[numKeys] = n;
+    numKeys++;
+    totalLength += n;
+}
+
+static void
+readKeys(char *buf)
+{
+    char *line, *end, *field, *p;
+    int i;
+
+    line = buf;
+    while(*line) {
+        end = strchr(line, '\n');
+        if(end == NULL)
+            end = line + strlen(line);
+        if(end > line && end[-1] == '\r')
+            end[-1] = '\0';
+        if(*end)
+            *end++ = '\0';
+        if(*line != '#' && *line != '\0') {
+            /* time method URL ... */
+            field = line;
+            p = line;
+            for(i = 0; i < 2 && p; i++) {
+                p = strchr(p, ' ');
+                if(p)
+                    p++;
+            }
+            if(p) {
+                field = p;
+                p = strchr(p, ' ');
+                if(p)
+                    *p = '\0';
+            }
+            addKey(field, strlen(field));
+        }
+        line = end;
+    }
+}
+
+static void
+throughput(const char *name, HashFunction f, unsigned int hash_size)
+{
+    unsigned int sum = 0;
+    double t, elapsed;
+    int i, rounds = 0;
+
+    t = benchTime();
+    do {
+        for(i = 0; i < numKeys; i++)
+            sum += f(rounds, keys[i], lengths[i], hash_size);
+        rounds++;
+        elapsed = benchTime() - t;
+    } while(elapsed < 0.5);
+
+    printf("%-8s %8.1f ns/key %8.1f MB/s   (%x)\n", name,
+           elapsed * 1e9 / ((double)rounds * numKeys),
+           (double)rounds * totalLength / elapsed / 1e6, sum & 0xF);
+}
+
+/* Spread the keys over 2^bits buckets, and compare with what a
+   uniformly random function would give. */
+static void
+occupancy(const char *name, HashFunction f, int bits)
+{
+    int m = 1 << bits, i, used = 0, longest = 0;
+    int *buckets;
+    double probes = 0, empty = 1, expectedUsed, expectedProbes;
+
+    buckets = calloc(m, sizeof(int));
+    if(buckets == NULL)
+        exit(1);
+    for(i = 0; i < numKeys; i++)
+        buckets[f(0, keys[i], lengths[i], bits)]++;
+    for(i = 0; i < m; i++) {
+        if(buckets[i] > 0)
+            used++;
+        if(buckets[i] > longest)
+            longest = buckets[i];
+        probes += buckets[i] * (buckets[i] + 1) / 2.0;
+    }
+    free(buckets);
+
+    for(i = 0; i < numKeys; i++)
+        empty *= 1 - 1.0 / m;
+    expectedUsed = m * (1 - empty);
+    expectedProbes = 1 + (numKeys - 1) / (2.0 * m);
+    printf("%-8s %2d bits: %7d used (uniform %7.0f), "
+           "longest %4d, probes %6.2f (uniform %5.2f)\n",
+           name, bits, used, expectedUsed, longest,
+           probes / numKeys, expectedProbes);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, n, bits;
+    char *buf;
+
+    if(argc < 2) {
+        fprintf(stderr, "Usage: %s file...\n", argv[0]);
+        return 1;
+    }
+
+    initAtoms();
+    initHashSeed();
+
+    for(i = 1; i < argc; i++) {
+        buf = benchReadFile(argv[i], &n);
+        if(buf == NULL)
+            return 1;
+        readKeys(buf);
+    }
+    if(numKeys == 0) {
+        fprintf(stderr, "No keys.\n");
+        return 1;
+    }
+
+    printf("%d keys, %.1f bytes on average\n",
+           numKeys, (double)totalLength / numKeys);
+
+    throughput("old", oldHash, 16);
+    throughput("new", hash, 16);
+
+    /* A table about as large as the object table would grow to, one
+       at the size of the atom table, and a crowded one. */
+    for(bits = 1; (1 << bits) < numKeys; bits++)
+        ;
+    occupancy("old", oldHash, bits);
+    occupancy("new", hash, bits);
+    occupancy("old", oldHash, LOG2_ATOM_HASH_TABLE_SIZE);
+    occupancy("new", hash, LOG2_ATOM_HASH_TABLE_SIZE);
+    occupancy("old", oldHash, MAX(6, bits - 4));
+    occupancy("new", hash, MAX(6, bits - 4));
+    return 0;
+}
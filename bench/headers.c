@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2026 by the Polipo contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Compare the header scanner with the one it replaced, on captured
+   request and reply header blocks.  Each block is fed whole, and then
+   a few bytes at a time as it would arrive from a slow peer: the old
+   scanner rescans the buffer from the start after every read, as the
+   client and server code used to, while the new one resumes where it
+   gave up.
+   Usage: headers file...
+   Each file holds one message as it went over the wire. */
+
+#include "polipo.h"
+#include "bench.h"
+
+/* findEndOfHeaders from before the memchr scan. */
+static int
+oldFindEndOfHeaders(const char *restrict buf, int from, int to,
+                    int *body_return)
+{
+    int i = from;
+    int eol = 0;
+    while(i < to) {
+        if(buf[i] == '\n') {
+            if(eol) {
+                *body_return = i + 1;
+                return eol;
+            }
+            eol = i;
+            i++;
+        } else if(buf[i] == '\r') {
+            if(i < to - 1 && buf[i + 1] == '\n') {
+                if(eol) {
+                    *body_return = eol;
+                    return i + 2;
+                }
+                eol = i;
+                i += 2;
+            } else {
+                eol = 0;
+                i++;
+            }
+        } else {
+            eol = 0;
+            i++;
+        }
+    }
+    return -1;
+}
+
+typedef int (*Feeder)(const char *, int, int, int *);
+
+/* Feed len bytes of buf step bytes at a time; 0 means all at once. */
+
+static int
+oldFeed(const char *buf, int len, int step, int *body_return)
+{
+    int to, rc;
+
+    if(step <= 0)
+        step = len;
+    to = 0;
+    do {
+        to = MIN(to + step, len);
+        rc = oldFindEndOfHeaders(buf, 0, to, body_return);
+    } while(rc < 0 && to < len);
+    return rc;
+}
+
+static int
+newFeed(const char *buf, int len, int step, int *body_return)
+{
+    int to, rc, scanned = 0;
+
+    if(step <= 0)
+        step = len;
+    to = 0;
+    do {
+        to = MIN(to + step, len);
+        rc = findEndOfHeadersResume(buf, &scanned, to, body_return);
+    } while(rc < 0 && to < len);
+    return rc;
+}
+
+static int
+same(Feeder f, Feeder g, const char *buf, int len, int step)
+{
+    int rc1, rc2, body1 = -1, body2 = -1;
+
+    rc1 = f(buf, len, step, &body1);
+    rc2 = g(buf, len, step, &body2);
+    return rc1 == rc2 && (rc1 < 0 || body1 == body2);
+}
+
+/* Random buffers made mostly of line ends, to exercise terminators
+   that straddle a read boundary. */
+static int
+randomCheck(int count)
+{
+    static const char alphabet[] = "a:\r\n\r\n\n";
+    char buf[64];
+    int i, j, len, step;
+
+    for(i = 0; i < count; i++) {
+        len = 1 + benchRandom() % sizeof(buf);
+        for(j = 0; j < len; j++)
+            buf[j] = alphabet[benchRandom() % (sizeof(alphabet) - 1)];
+        step = benchRandom() % 8;
+        if(!same(oldFeed, newFeed, buf, len, 0) ||
+           !same(oldFeed, newFeed, buf, len, step)) {
+            fprintf(stderr, "Scanners disagree on a random buffer "
+                    "(length %d, step %d).\n", len, step);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static char **blocks;
+static int *lengths;
+static int numBlocks = 0;
+static long totalLength = 0;
+
+static double
+timeFeed(Feeder f, int step)
+{
+    double t, elapsed;
+    int i, body, rounds = 0, sum = 0;
+
+    t = benchTime();
+    do {
+        for(i = 0; i < numBlocks; i++)
+            sum += f(blocks[i], lengths[i], step, &body);
+        rounds++;
+        elapsed = benchTime() - t;
+    } while(elapsed < 0.3);
+    if(sum == 0)
+        printf("(no headers?)\n");
+    return elapsed * 1e9 / ((double)rounds * numBlocks);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int steps[] = {0, 64, 16, 1};
+    int i, j, rc, body;
+    double old, new;
+
+    if(argc < 2) {
+        fprintf(stderr, "Usage: %s file...\n", argv[0]);
+        return 1;
+    }
+
+    numBlocks = argc - 1;
+    blocks = malloc(numBlocks * sizeof(char*));
+    lengths = malloc(numBlocks * sizeof(int));
+    if(blocks == NULL || lengths == NULL)
+        return 1;
+
+    for(i = 0; i < numBlocks; i++) {
+        blocks[i] = benchReadFile(argv[i + 1], &lengths[i]);
+        if(blocks[i] == NULL)
+            return 1;
+        rc = oldFindEndOfHeaders(blocks[i], 0, lengths[i], &body);
+        if(rc < 0) {
+            fprintf(stderr, "No end of headers in %s.\n", argv[i + 1]);
+            return 1;
+        }
+        /* Only the headers are scanned in the common case. */
+        totalLength += body;
+        for(j = 0; j < sizeof(steps) / sizeof(steps[0]); j++) {
+            if(!same(oldFeed, newFeed, blocks[i], lengths[i], steps[j])) {
+                fprintf(stderr, "Scanners disagree on %s (step %d).\n",
+                        argv[i + 1], steps[j]);
+                return 1;
+            }
+        }
+    }
+
+    if(randomCheck(200000) < 0)
+        return 1;
+
+    printf("%d header blocks, %.1f bytes on average\n",
+           numBlocks, (double)totalLength / numBlocks);
+    for(j = 0; j < sizeof(steps) / sizeof(steps[0]); j++) {
+        old = timeFeed(oldFeed, steps[j]);
+        new = timeFeed(newFeed, steps[j]);
+        if(steps[j] == 0)
+            printf("whole    ");
+        else
+            printf("%3d-byte ", steps[j]);
+        printf("old %9.1f ns/block   new %9.1f ns/block   (%.1fx)\n",
+               old, new, old / new);
+    }
+    return 0;
+}
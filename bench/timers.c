@@ -0,0 +1,131 @@
+/*
+Copyright (c) 2026 by the Polipo contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Schedule, cancel, re-arm and fire a large number of time events, to
+   check that the timing wheel in event.c keeps these operations cheap.
+   Usage: timers [count] */
+
+#include "polipo.h"
+#include "bench.h"
+
+#define MONTH (30 * 24 * 3600)
+
+static int fired = 0, early = 0, disordered = 0;
+static struct timeval lastFired = {0, 0};
+
+static int
+timerHandler(TimeEventHandlerPtr event)
+{
+    if(event->time.tv_sec > current_time.tv_sec ||
+       (event->time.tv_sec == current_time.tv_sec &&
+        event->time.tv_usec > current_time.tv_usec))
+        early++;
+    if(event->time.tv_sec < lastFired.tv_sec ||
+       (event->time.tv_sec == lastFired.tv_sec &&
+        event->time.tv_usec < lastFired.tv_usec))
+        disordered++;
+    lastFired = event->time;
+    fired++;
+    return 1;
+}
+
+static void
+report(const char *what, int n, double t)
+{
+    printf("%-28s %9.2f ms %8.1f ns each\n",
+           what, t * 1000.0, n > 0 ? t * 1e9 / n : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+    TimeEventHandlerPtr *events;
+    struct timeval when;
+    int n = 100000, i, wakeups = 0;
+    double t;
+
+    if(argc > 1)
+        n = atoi(argv[1]);
+    if(n <= 0) {
+        fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+        return 1;
+    }
+
+    initAtoms();
+    initEvents();
+    gettimeofday(&current_time, NULL);
+
+    events = malloc(n * sizeof(TimeEventHandlerPtr));
+    if(events == NULL)
+        return 1;
+
+    printf("%d time events spread over 30 days\n", n);
+
+    t = benchTime();
+    for(i = 0; i < n; i++) {
+        events[i] = scheduleTimeEvent(1 + benchRandom() % MONTH,
+                                      timerHandler, 0, NULL);
+        if(events[i] == NULL)
+            return 1;
+    }
+    report("schedule", n, benchTime() - t);
+
+    t = benchTime();
+    for(i = 1; i < n; i += 2)
+        cancelTimeEvent(events[i]);
+    report("cancel half", n / 2, benchTime() - t);
+
+    /* What httpSetTimeout does on every read and write. */
+    t = benchTime();
+    for(i = 0; i < n; i += 2) {
+        cancelTimeEvent(events[i]);
+        events[i] = scheduleTimeEvent(1 + benchRandom() % MONTH,
+                                      timerHandler, 0, NULL);
+        if(events[i] == NULL)
+            return 1;
+    }
+    report("re-arm the rest", (n + 1) / 2, benchTime() - t);
+
+    /* Run the time event queue the way eventLoop does, jumping
+       straight to the next deadline. */
+    t = benchTime();
+    while(1) {
+        timeToSleep(&when);
+        if(when.tv_sec == -1)
+            break;
+        if(when.tv_sec > current_time.tv_sec ||
+           (when.tv_sec == current_time.tv_sec &&
+            when.tv_usec > current_time.tv_usec))
+            current_time = when;
+        runTimeEventQueue();
+        wakeups++;
+    }
+    report("fire all", fired, benchTime() - t);
+    printf("%d fired, %d wakeups\n", fired, wakeups);
+
+    if(fired != (n + 1) / 2 || early > 0 || disordered > 0) {
+        fprintf(stderr, "Timers misbehaved: %d fired, %d early, "
+                "%d out of order.\n", fired, early, disordered);
+        return 1;
+    }
+    return 0;
+}
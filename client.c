@@ -43,7 +43,6 @@ httpAcceptAgain(TimeEventHandlerPtr event)
 int
 httpAccept(int fd, FdEventHandlerPtr event, AcceptRequestPtr request)
 {
-    int rc;
     HTTPConnectionPtr connection;
     TimeEventHandlerPtr timeout;
 
@@ -82,15 +81,12 @@ httpAccept(int fd, FdEventHandlerPtr event, AcceptRequestPtr request)
         }
     }
 
-    rc = setNonblocking(fd, 1);
-    if(rc < 0) {
-        do_log_error(L_WARN, errno, "Couldn't set non blocking mode");
-        CLOSE(fd);
-        return 0;
-    }
-    rc = setNodelay(fd, 1);
-    if(rc < 0) 
+    /* do_scheduled_accept has put the socket in non-blocking mode, and
+       under Linux it inherits TCP_NODELAY from the listening socket. */
+#ifndef __linux__
+    if(setNodelay(fd, 1) < 0)
         do_log_error(L_WARN, errno, "Couldn't disable Nagle's algorithm");
+#endif
 
     connection = httpMakeConnection();
 
@@ -109,6 +105,7 @@ httpAccept(int fd, FdEventHandlerPtr event, AcceptRequestPtr request)
            (unsigned long)connection);
 
     connection->flags = CONN_READER;
+    connection->scanned = 0;
 
     do_stream_buf(IO_READ | IO_NOTNOW, connection->fd, 0,
                   &connection->reqbuf, CHUNK_SIZE,
@@ -137,6 +134,74 @@ httpClientAbort(HTTPConnectionPtr connection, int closed)
     }
 }
 
+static int
+accessLogInterval(char *buf, int n, int len,
+                  struct timeval *t0, struct timeval *t)
+{
+    double d;
+
+    if(t0->tv_sec == null_time.tv_sec || t->tv_sec == null_time.tv_sec)
+        return snnprintf(buf, n, len, " -");
+    d = (t->tv_sec - t0->tv_sec) * 1000.0 +
+        (t->tv_usec - t0->tv_usec) / 1000.0;
+    /* A connection set up before the request arrived cost it nothing. */
+    if(d < 0)
+        return snnprintf(buf, n, len, " -");
+    return snnprintf(buf, n, len, " %.3f", d);
+}
+
+/* Write one access log record for a request that has been answered.
+   Times are in milliseconds since the request was received. */
+static void
+httpClientLogAccess(HTTPConnectionPtr connection, HTTPRequestPtr request)
+{
+    char buf[1536];
+    int n;
+    const char *method, *outcome;
+    ObjectPtr object = request->object;
+
+    if(request->code == 0)
+        return;
+
+    switch(request->method) {
+    case METHOD_GET: case METHOD_CONDITIONAL_GET: method = "GET"; break;
+    case METHOD_HEAD: method = "HEAD"; break;
+    case METHOD_POST: method = "POST"; break;
+    case METHOD_PUT: method = "PUT"; break;
+    default: method = "-"; break;
+    }
+
+    if(object == NULL || (object->flags & OBJECT_LOCAL))
+        outcome = "-";
+    else if(request->flags & REQUEST_REVALIDATED)
+        outcome = "REVAL";
+    else if(request->flags & REQUEST_FETCHED)
+        outcome = "MISS";
+    else if(request->flags & REQUEST_FROM_DISK)
+        outcome = "DISK";
+    else
+        outcome = "HIT";
+
+    n = snnprintf(buf, 0, sizeof(buf), "%ld.%03d %s %.1024s %d %d %s",
+                  (long)current_time.tv_sec,
+                  (int)(current_time.tv_usec / 1000),
+                  method, object ? scrub(object->key) : "-",
+                  request->code,
+                  MAX(connection->offset - request->from, 0),
+                  outcome);
+    n = accessLogInterval(buf, n, sizeof(buf),
+                          &request->time0, &request->time_dns);
+    n = accessLogInterval(buf, n, sizeof(buf),
+                          &request->time0, &request->time_connect);
+    n = accessLogInterval(buf, n, sizeof(buf),
+                          &request->time0, &request->time1);
+    n = accessLogInterval(buf, n, sizeof(buf),
+                          &request->time0, &current_time);
+    n = snnprintf(buf, n, sizeof(buf), "\n");
+    if(n > 0)
+        logAccess(buf, n);
+}
+
 /* s != 0 specifies that the connection must be shut down.  It is 1 in
    order to linger the connection, 2 to close it straight away. */
 void
@@ -188,6 +253,9 @@ httpClientFinish(HTTPConnectionPtr connection, int s)
             abortConditionHandler(request->chandler);
             request->chandler = NULL;
         }
+
+        if(accessLogging())
+            httpClientLogAccess(connection, request);
             
         if(request->object) {
             if(request->object->requestor == request)
@@ -216,6 +284,7 @@ httpClientFinish(HTTPConnectionPtr connection, int s)
                     connection->reqlen < CHUNK_SIZE)
                 httpConnectionUnbigifyReqbuf(connection);
             connection->flags |= CONN_READER;
+            connection->scanned = 0;
             httpSetTimeout(connection, clientTimeout);
             do_stream_buf(IO_READ | IO_NOTNOW |
                           (connection->reqlen ? IO_IMMEDIATE : 0),
@@ -384,7 +453,8 @@ httpClientHandler(int status,
         return 1;
     }
 
-    i = findEndOfHeaders(connection->reqbuf, 0, request->offset, &body);
+    i = findEndOfHeadersResume(connection->reqbuf, &connection->scanned,
+                               request->offset, &body);
     connection->reqlen = request->offset;
 
     if(i >= 0) {
@@ -441,6 +511,8 @@ httpClientRawErrorHeaders(HTTPConnectionPtr connection,
         else
             close = 1;
     }
+    if(connection->request)
+        connection->request->code = code;
     if(connection->request && connection->request->object) {
         url = connection->request->object->key;
         url_len = connection->request->object->key_size;
@@ -554,6 +626,7 @@ httpClientNewError(HTTPConnectionPtr connection, int method, int persist,
         request->flags &= ~REQUEST_PERSISTENT;
     request->error_code = code;
     request->error_message = message;
+    request->time0 = current_time;
 
     httpQueueRequest(connection, request);
     httpClientNoticeRequest(request, 0);
@@ -660,6 +733,7 @@ httpClientHandlerHeaders(FdEventHandlerPtr event, StreamRequestPtr srequest,
     connection->version = version;
     request->flags = REQUEST_PERSISTENT;
     request->method = method;
+    request->time0 = current_time;
     request->cache_control = no_cache_control;
     httpQueueRequest(connection, request);
     connection->reqbegin = rc;
@@ -905,9 +979,12 @@ httpClientRequestContinue(int forbidden_code, AtomPtr url,
             object->flags |= OBJECT_LINEAR;
     } else {
         object = findObject(OBJECT_HTTP, url->string, url->length);
-        if(!object)
+        if(!object) {
             object = makeObject(OBJECT_HTTP, url->string, url->length, 1, 1,
                                 requestfn, NULL);
+            if(object && !(object->flags & OBJECT_INITIAL))
+                request->flags |= REQUEST_FROM_DISK;
+        }
     }
     releaseAtom(url);
     url = NULL;
@@ -1025,6 +1102,8 @@ httpClientDelayed(TimeEventHandlerPtr event)
 {
      HTTPConnectionPtr connection = *(HTTPConnectionPtr*)event->data;
 
+     connection->scanned = 0;
+
      /* IO_NOTNOW is unfortunate, but needed to avoid starvation if a
         client is pipelining a lot of requests. */
      if(connection->reqlen > 0) {
@@ -1070,6 +1149,27 @@ httpClientDiscardHandler(int status,
     return 1;
 }
 
+/* Fill from the disk cache on behalf of a client request, remembering
+   whether anything had to be read for the access log. */
+static int
+httpClientFillFromDisk(HTTPRequestPtr request, int offset, int chunks,
+                       int async)
+{
+    ObjectPtr object = request->object;
+    int i = offset / CHUNK_SIZE;
+    int size = i < object->numchunks ? object->chunks[i].size : 0;
+    int rc;
+
+    if(async)
+        rc = objectFillFromDiskAsync(object, offset, chunks);
+    else
+        rc = objectFillFromDisk(object, offset, chunks);
+    if(rc == 2 ||
+       (rc > 0 && i < object->numchunks && object->chunks[i].size != size))
+        request->flags |= REQUEST_FROM_DISK;
+    return rc;
+}
+
 int
 httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
 {
@@ -1130,8 +1230,8 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     }
 
     local = urlIsLocal(object->key, object->key_size);
-    objectFillFromDisk(object, request->from,
-                       request->method == METHOD_HEAD ? 0 : 1);
+    httpClientFillFromDisk(request, request->from,
+                           request->method == METHOD_HEAD ? 0 : 1, 0);
 
     /* The spec doesn't strictly forbid 206 for non-200 instances, but doing
        that breaks some client software. */
@@ -1626,9 +1726,9 @@ httpServeObject(HTTPConnectionPtr connection)
                                   internAtom("Not modified"), 0);
     }
 
-    objectFillFromDisk(object, request->from,
-                       (request->method == METHOD_HEAD ||
-                        condition_result != CONDITION_MATCH) ? 0 : 1);
+    httpClientFillFromDisk(request, request->from,
+                           (request->method == METHOD_HEAD ||
+                            condition_result != CONDITION_MATCH) ? 0 : 1, 0);
 
     if(((object->flags & OBJECT_LINEAR) &&
         (object->requestor != connection->request)) ||
@@ -1696,6 +1796,7 @@ httpServeObject(HTTPConnectionPtr connection)
 
     if((request->from <= 0 && request->to < 0) || 
        request->method == METHOD_HEAD) {
+        request->code = object->code;
         n = snnprintf(connection->buf, 0, bufsize,
                       "HTTP/1.1 %d %s",
                       object->code, atomString(object->message));
@@ -1708,6 +1809,7 @@ httpServeObject(HTTPConnectionPtr connection)
                                                  "not satisfiable"),
                                       0);
         } else {
+            request->code = 206;
             n = snnprintf(connection->buf, 0, bufsize,
                           "HTTP/1.1 206 Partial content");
         }
@@ -1868,6 +1970,97 @@ httpServeObjectFinishHandler(int status,
     return 1;
 }
 
+#ifdef HAVE_SENDFILE
+static int
+httpServeSendfileHandler(int status,
+                         FdEventHandlerPtr event,
+                         SendfileRequestPtr srequest)
+{
+    HTTPConnectionPtr connection = srequest->data;
+    ObjectPtr object = connection->request->object;
+
+    if(status == 0 && srequest->sent < srequest->len) {
+        httpSetTimeout(connection, clientTimeout);
+        return 0;
+    }
+
+    httpSetTimeout(connection, -1);
+    close(srequest->from);
+    connection->offset += srequest->sent;
+
+    if(status) {
+        if(status < 0) {
+            do_log_error(status == -ECONNRESET ? D_IO : L_ERROR,
+                         -status, "Couldn't sendfile to client");
+            if(status == -EIO || status == -ESHUTDOWN)
+                httpClientFinish(connection, 2);
+            else
+                httpClientFinish(connection, 1);
+        } else {
+            do_log(D_IO, "Couldn't sendfile to client: short write.\n");
+            httpClientFinish(connection, 2);
+        }
+        return 1;
+    }
+
+    httpClientFinish(connection,
+                     !(object->length >= 0 &&
+                       connection->offset >= object->length));
+    return 1;
+}
+
+/* Whether the data from offset to to should be sent straight from
+   the disk cache file rather than read into chunks. */
+static int
+httpSendfileCandidate(HTTPConnectionPtr connection, int offset, int to)
+{
+    HTTPRequestPtr request = connection->request;
+    ObjectPtr object = request->object;
+
+    return diskCacheSendfileSize >= 0 && to >= 0 &&
+        to - offset >= diskCacheSendfileSize &&
+        connection->te == TE_IDENTITY && request->method != METHOD_HEAD &&
+        !(object->flags & OBJECT_LOCAL) && diskEntryComplete(object);
+}
+
+/* Serve the rest of a large object that is complete on disk straight
+   from the disk cache file, without copying it into chunks.  This
+   must be called with the current chunk locked; returns 1 if it took
+   over the connection. */
+static int
+httpServeSendfile(HTTPConnectionPtr connection, int to)
+{
+    HTTPRequestPtr request = connection->request;
+    ObjectPtr object = request->object;
+    off_t body_offset;
+    int fd;
+
+    if(!httpSendfileCandidate(connection, connection->offset, to))
+        return 0;
+
+    fd = diskEntryFd(object, &body_offset);
+    if(fd < 0)
+        return 0;
+
+    if(request->chandler) {
+        unregisterConditionHandler(request->chandler);
+        request->chandler = NULL;
+    }
+    unlockChunk(object, connection->offset / CHUNK_SIZE);
+    request->flags |= REQUEST_FROM_DISK;
+
+    do_log(D_CLIENT_DATA,
+           "Serving on 0x%lx for 0x%lx: offset %d len %d from disk\n",
+           (unsigned long)connection, (unsigned long)object,
+           connection->offset, to - connection->offset);
+    httpSetTimeout(connection, clientTimeout);
+    do_sendfile(connection->fd, fd, body_offset + connection->offset,
+                to - connection->offset, httpServeSendfileHandler,
+                connection);
+    return 1;
+}
+#endif
+
 int
 httpServeChunk(HTTPConnectionPtr connection)
 {
@@ -1876,6 +2069,7 @@ httpServeChunk(HTTPConnectionPtr connection)
     int i = connection->offset / CHUNK_SIZE;
     int j = connection->offset - (i * CHUNK_SIZE);
     int to, len, len2, end;
+    int use_sendfile = 0;
     int rc;
 
     /* This must be called with chunk i locked. */
@@ -1897,9 +2091,14 @@ httpServeChunk(HTTPConnectionPtr connection)
     if(i < object->numchunks)
         len = object->chunks[i].size - j;
 
+#ifdef HAVE_SENDFILE
+    if(len <= 0 && httpServeSendfile(connection, to))
+        return 1;
+#endif
+
     if(request->method != METHOD_HEAD && 
        len < CHUNK_SIZE && connection->offset + len < to) {
-        objectFillFromDisk(object, connection->offset + len, 2);
+        httpClientFillFromDisk(request, connection->offset + len, 2, 1);
         len = object->chunks[i].size - j;
     }
 
@@ -1935,6 +2134,9 @@ httpServeChunk(HTTPConnectionPtr connection)
                     goto fail;
                 }
             }
+            /* A disk read in flight will notify the object. */
+            if(object->flags & OBJECT_DISK_IO)
+                return 1;
             if(!(object->flags & OBJECT_INPROGRESS)) {
                 if(object->flags & OBJECT_SUPERSEDED) {
                     goto fail;
@@ -1949,8 +2151,12 @@ httpServeChunk(HTTPConnectionPtr connection)
         }
     } else {
         /* len > 0 */
-        if(request->method != METHOD_HEAD)
-            objectFillFromDisk(object, (i + 1) * CHUNK_SIZE, 1);
+#ifdef HAVE_SENDFILE
+        use_sendfile =
+            httpSendfileCandidate(connection, (i + 1) * CHUNK_SIZE, to);
+#endif
+        if(request->method != METHOD_HEAD && !use_sendfile)
+            httpClientFillFromDisk(request, (i + 1) * CHUNK_SIZE, 1, 1);
         if(request->chandler) {
             unregisterConditionHandler(request->chandler);
             request->chandler = NULL;
@@ -1970,7 +2176,8 @@ httpServeChunk(HTTPConnectionPtr connection)
         else
             end = 0;
         /* Prefetch */
-        if(!(object->flags & OBJECT_INPROGRESS) && !REQUEST_SIDE(request)) {
+        if(!(object->flags & (OBJECT_INPROGRESS | OBJECT_DISK_IO)) &&
+           !use_sendfile && !REQUEST_SIDE(request)) {
             if(object->chunks[i].size < CHUNK_SIZE &&
                to >= 0 && connection->offset + len + 1 < to)
                 object->request(object, request->method,
@@ -26,6 +26,10 @@ THE SOFTWARE.
 
 #include "md5import.h"
 
+#ifdef HAVE_DISK_THREADS
+#include <pthread.h>
+#endif
+
 int maxDiskEntries = 32;
 
 /* Because the functions in this file can be called during object
@@ -47,9 +51,17 @@ int diskCacheTruncateTime = 4 * 24 * 60 * 60 + 12 * 60 * 60;
 int diskCacheTruncateSize =  1024 * 1024;
 int preciseExpiry = 0;
 
+int diskCacheSegments = 0;
+int diskCacheSegmentSize = 64 * 1024 * 1024;
+int diskCacheSegmentObjectSize = 32 * 1024;
+#ifdef HAVE_DISK_THREADS
+int diskCacheThreads = 4;
+#endif
+int diskCacheSendfileSize = 64 * 1024;
+
 static DiskCacheEntryRec negativeEntry = {
     NULL, NULL,
-    -1, -1, -1, -1, 0, 0, NULL, NULL
+    -1, -1, -1, -1, 0, 0, 0, 0, NULL, NULL
 };
 
 #ifndef LOCAL_ROOT
@@ -62,7 +74,8 @@ static DiskCacheEntryRec negativeEntry = {
 
 static int maxDiskEntriesSetter(ConfigVariablePtr, void*);
 static int atomSetterFlush(ConfigVariablePtr, void*);
-static int reallyWriteoutToDisk(ObjectPtr object, int upto, int max);
+static int reallyWriteoutToDisk(ObjectPtr object, int upto, int max,
+                                int async);
 
 void 
 preinitDiskcache()
@@ -96,6 +109,23 @@ preinitDiskcache()
     CONFIG_VARIABLE_SETTABLE(maxDiskCacheEntrySize, CONFIG_INT,
                              configIntSetter,
                              "Maximum size of objects cached on disk.");
+    CONFIG_VARIABLE(diskCacheSegments, CONFIG_BOOLEAN,
+                    "Store small objects in shared segment files.");
+    CONFIG_VARIABLE_SETTABLE(diskCacheSegmentSize, CONFIG_INT,
+                             configIntSetter,
+                             "Size at which a new segment is started.");
+    CONFIG_VARIABLE_SETTABLE(diskCacheSegmentObjectSize, CONFIG_INT,
+                             configIntSetter,
+                             "Largest object stored in a segment.");
+#ifdef HAVE_DISK_THREADS
+    CONFIG_VARIABLE(diskCacheThreads, CONFIG_INT,
+                    "Number of threads used for disk I/O.");
+#endif
+#ifdef HAVE_SENDFILE
+    CONFIG_VARIABLE_SETTABLE(diskCacheSendfileSize, CONFIG_INT,
+                             configIntSetter,
+                             "Smallest amount of data served with sendfile.");
+#endif
 }
 
 static int
@@ -216,9 +246,9 @@ check_entry(DiskCacheEntryPtr entry)
         if(entry->offset >= 0) {
             off_t offset;
             offset = lseek(entry->fd, 0, SEEK_CUR);
-            assert(offset == entry->offset);
+            assert(offset == entry->base + entry->offset);
         }
-        if(entry->size >= 0) {
+        if(entry->size >= 0 && !entry->segment) {
             int rc;
             struct stat ss;
             rc = fstat(entry->fd, &ss);
@@ -278,7 +308,7 @@ entrySeek(DiskCacheEntryPtr entry, off_t offset)
         if(entry->size + entry->body_offset < offset)
             return -1;
     }
-    rc = lseek(entry->fd, offset, SEEK_SET);
+    rc = lseek(entry->fd, entry->base + offset, SEEK_SET);
     if(rc < 0) {
         do_log_error(L_ERROR, errno, "Couldn't seek");
         entry->offset = -1;
@@ -841,11 +871,12 @@ validateLocalEntry(ObjectPtr object, int fd,
     return 0;
 }
 
-/* Assumes fd is at offset 0.
+/* Assumes fd is at the start of the entry.  If limit is not negative,
+   the entry is only limit bytes long.
    Returns -1 if not valid, 1 if metadata should be written out, 0
    otherwise. */
 int
-validateEntry(ObjectPtr object, int fd, 
+validateEntry(ObjectPtr object, int fd, int limit,
               int *body_offset_return, off_t *offset_return)
 {
     char *buf;
@@ -887,7 +918,7 @@ validateEntry(ObjectPtr object, int fd,
     }
 
  again:
-    rc = read(fd, buf, bufsize);
+    rc = read(fd, buf, limit >= 0 ? MIN(bufsize, limit) : bufsize);
     if(rc < 0) {
         if(errno == EINTR)
             goto again;
@@ -914,7 +945,9 @@ validateEntry(ObjectPtr object, int fd,
                 free(oldbuf);
             buf_is_chunk = 0;
         again2:
-            rc = read(fd, buf + offset, bufsize - offset);
+            rc = read(fd, buf + offset,
+                      limit >= 0 ?
+                      MIN(bufsize, limit) - offset : bufsize - offset);
             if(rc < 0) {
                 if(errno == EINTR)
                     goto again2;
@@ -1054,82 +1087,1270 @@ validateEntry(ObjectPtr object, int fd,
         if(etag)
             free(etag);
     }
-    releaseAtom(message);
+    releaseAtom(message);
+
+    if(object->flags & OBJECT_INITIAL) object->via = via;
+    object->flags &= ~OBJECT_INITIAL;
+    if(offset > body_offset) {
+        /* We need to make sure we don't invoke object expiry recursively */
+        objectSetChunks(object, 1);
+        if(object->numchunks >= 1) {
+            if(object->chunks[0].data == NULL)
+                object->chunks[0].data = maybe_get_chunk();
+            if(object->chunks[0].data)
+                objectAddData(object, buf + body_offset,
+                              0, MIN(offset - body_offset, CHUNK_SIZE));
+        }
+    }
+
+    httpTweakCachability(object);
+
+    if(buf_is_chunk)
+        dispose_chunk(buf);
+    else
+        free(buf);
+    if(body_offset_return) *body_offset_return = body_offset;
+    if(offset_return) *offset_return = offset;
+    return dirty;
+
+ invalid:
+    releaseAtom(message);
+    if(etag) free(etag);
+    if(location) free(location);
+    if(via) releaseAtom(via);
+    /* fall through */
+
+ fail:
+    if(buf_is_chunk)
+        dispose_chunk(buf);
+    else
+        free(buf);
+    return -1;
+}
+
+void
+dirtyDiskEntry(ObjectPtr object)
+{
+    DiskCacheEntryPtr entry = object->disk_entry;
+    if(entry && entry != &negativeEntry) entry->metadataDirty = 1;
+}
+
+int
+revalidateDiskEntry(ObjectPtr object)
+{
+    DiskCacheEntryPtr entry = object->disk_entry;
+    int rc;
+    int body_offset;
+
+    if(!entry || entry == &negativeEntry)
+        return 1;
+
+    CHECK_ENTRY(entry);
+    rc = entrySeek(entry, 0);
+    if(rc < 0) return 0;
+
+    rc = validateEntry(object, entry->fd,
+                       entry->segment ? entry->body_offset + entry->size : -1,
+                       &body_offset, &entry->offset);
+    if(rc < 0) {
+        destroyDiskEntry(object, 0);
+        return 0;
+    }
+    if(body_offset != entry->body_offset) {
+        do_log(L_WARN, "Inconsistent body offset (%d != %d).\n",
+               body_offset, entry->body_offset);
+        destroyDiskEntry(object, 0);
+        return 0;
+    }
+
+    entry->metadataDirty |= !!rc;
+    CHECK_ENTRY(entry);
+    return 1;
+}
+
+/* Asynchronous disk I/O.  Reads and writes of object bodies may be
+   handed to a small pool of threads, which use pread and pwrite on a
+   duplicate of the entry's file descriptor and post completed jobs
+   back to the event loop through a pipe.  While a job is in flight,
+   its chunk is locked, the object is retained and marked with
+   OBJECT_DISK_IO; at most one job is in flight for a given object.
+   Any synchronous access to the object's disk entry first waits for
+   that job to complete.  When the event loop uses io_uring, jobs are
+   submitted to the ring instead of the threads. */
+
+#define DISK_IO_READ 1
+#define DISK_IO_WRITE 2
+#define DISK_IO_MAX_CHUNKS 16
+
+#ifdef HAVE_DISK_THREADS
+
+typedef struct _DiskIoJob {
+    int op;
+    int fd;
+    ObjectPtr object;
+    int chunk;                  /* first chunk */
+    int nchunks;
+    int position;               /* offset within the body */
+    struct iovec iov[DISK_IO_MAX_CHUNKS];
+    int len;
+    off_t offset;               /* offset within the file */
+    int result;
+    int error;
+    struct _DiskIoJob *next;
+} DiskIoJobRec, *DiskIoJobPtr;
+
+static pthread_mutex_t diskIoLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diskIoWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t diskIoDone = PTHREAD_COND_INITIALIZER;
+static DiskIoJobPtr diskIoQueue = NULL, diskIoQueueLast = NULL;
+static DiskIoJobPtr diskIoCompleted = NULL;
+static int diskIoPipe[2] = {-1, -1};
+/* 0 = not started, 1 = threads running, 2 = io_uring, -1 = off */
+static int diskIoState = 0;
+
+static int diskIoReads = 0, diskIoWrites = 0, diskIoWaits = 0;
+
+static void *
+diskIoThread(void *dummy)
+{
+    DiskIoJobPtr job;
+    int rc, wake;
+    char c = 0;
+
+    while(1) {
+        pthread_mutex_lock(&diskIoLock);
+        while(diskIoQueue == NULL)
+            pthread_cond_wait(&diskIoWork, &diskIoLock);
+        job = diskIoQueue;
+        diskIoQueue = job->next;
+        if(diskIoQueue == NULL)
+            diskIoQueueLast = NULL;
+        pthread_mutex_unlock(&diskIoLock);
+
+        do {
+            if(job->op == DISK_IO_READ)
+                rc = preadv(job->fd, job->iov, job->nchunks, job->offset);
+            else
+                rc = pwritev(job->fd, job->iov, job->nchunks, job->offset);
+        } while(rc < 0 && errno == EINTR);
+        job->result = rc;
+        job->error = rc < 0 ? errno : 0;
+        close(job->fd);
+
+        pthread_mutex_lock(&diskIoLock);
+        wake = (diskIoCompleted == NULL);
+        job->next = diskIoCompleted;
+        diskIoCompleted = job;
+        pthread_cond_broadcast(&diskIoDone);
+        pthread_mutex_unlock(&diskIoLock);
+
+        if(wake) {
+            do {
+                rc = write(diskIoPipe[1], &c, 1);
+            } while(rc < 0 && errno == EINTR);
+        }
+    }
+    return NULL;
+}
+
+static int
+diskIoNotifyHandler(TimeEventHandlerPtr event)
+{
+    ObjectPtr object = *(ObjectPtr*)event->data;
+    notifyObject(object);
+    releaseObject(object);
+    return 1;
+}
+
+static void
+finishDiskIoJob(DiskIoJobPtr job, int notify)
+{
+    ObjectPtr object = job->object;
+    DiskCacheEntryPtr entry = object->disk_entry;
+    int end = job->position + (job->result > 0 ? job->result : 0);
+    int i;
+
+    assert(object->flags & OBJECT_DISK_IO);
+    object->flags &= ~OBJECT_DISK_IO;
+    if(entry == &negativeEntry)
+        entry = NULL;
+
+    if(job->result < 0)
+        do_log_error(L_ERROR, job->error,
+                     job->op == DISK_IO_READ ?
+                     "Couldn't read disk entry" :
+                     "Couldn't write disk entry");
+
+    if(job->op == DISK_IO_READ) {
+        assert(job->nchunks == 1);
+        if(job->result > 0 && job->chunk < object->numchunks &&
+           object->chunks[job->chunk].size ==
+           job->position - job->chunk * CHUNK_SIZE) {
+            object->chunks[job->chunk].size += job->result;
+            if(object->size < end)
+                object->size = end;
+        }
+        if(entry && entry->size < 0 && job->result >= 0 &&
+           (job->result == 0 ||
+            (object->length >= 0 && object->length == end)))
+            entry->size = end;
+    } else {
+        if(entry && job->result > 0 && entry->size == job->position)
+            entry->size = end;
+    }
+
+    for(i = 0; i < job->nchunks; i++)
+        unlockChunk(object, job->chunk + i);
+    if(notify) {
+        notifyObject(object);
+    } else {
+        /* We may be running within a condition handler. */
+        if(scheduleTimeEvent(-1, diskIoNotifyHandler,
+                             sizeof(object), &object))
+            retainObject(object);
+    }
+    releaseObject(object);
+    free(job);
+}
+
+static void
+finishDiskIoJobs(DiskIoJobPtr jobs, int notify)
+{
+    DiskIoJobPtr next;
+    while(jobs) {
+        next = jobs->next;
+        finishDiskIoJob(jobs, notify);
+        jobs = next;
+    }
+}
+
+static int
+diskIoHandler(int status, FdEventHandlerPtr event)
+{
+    char buf[64];
+    DiskIoJobPtr jobs;
+    int rc;
+
+    do {
+        rc = read(diskIoPipe[0], buf, 64);
+    } while(rc > 0 || (rc < 0 && errno == EINTR));
+
+    pthread_mutex_lock(&diskIoLock);
+    jobs = diskIoCompleted;
+    diskIoCompleted = NULL;
+    pthread_mutex_unlock(&diskIoLock);
+
+    finishDiskIoJobs(jobs, 1);
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+static void
+diskIoRingHandler(int res, void *data)
+{
+    DiskIoJobPtr job = data;
+    job->result = res < 0 ? -1 : res;
+    job->error = res < 0 ? -res : 0;
+    close(job->fd);
+    finishDiskIoJob(job, 0);
+}
+#endif
+
+/* Block until the job in flight for object, if any, has completed. */
+static void
+waitForDiskIo(ObjectPtr object)
+{
+    DiskIoJobPtr jobs;
+
+    if(object->flags & OBJECT_DISK_IO)
+        diskIoWaits++;
+    while(object->flags & OBJECT_DISK_IO) {
+#ifdef HAVE_IO_URING
+        if(diskIoState == 2) {
+            waitRingIo();
+            continue;
+        }
+#endif
+        pthread_mutex_lock(&diskIoLock);
+        while(diskIoCompleted == NULL)
+            pthread_cond_wait(&diskIoDone, &diskIoLock);
+        jobs = diskIoCompleted;
+        diskIoCompleted = NULL;
+        pthread_mutex_unlock(&diskIoLock);
+        finishDiskIoJobs(jobs, 0);
+    }
+}
+
+static int
+diskIoReady()
+{
+    pthread_t thread;
+    sigset_t ss, old;
+    int i, rc, n = 0;
+
+    if(diskIoState != 0)
+        return diskIoState > 0;
+
+    diskIoState = -1;
+    if(diskCacheThreads <= 0)
+        return 0;
+
+#ifdef HAVE_IO_URING
+    if(ringActive()) {
+        diskIoState = 2;
+        return 1;
+    }
+#endif
+
+    rc = pipe(diskIoPipe);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't create disk I/O pipe");
+        return 0;
+    }
+    setNonblocking(diskIoPipe[0], 1);
+    setNonblocking(diskIoPipe[1], 1);
+    if(registerFdEvent(diskIoPipe[0], POLLIN, diskIoHandler, 0, NULL) == NULL)
+        goto fail;
+
+    /* Signals are for the main thread. */
+    sigfillset(&ss);
+    pthread_sigmask(SIG_BLOCK, &ss, &old);
+    for(i = 0; i < diskCacheThreads; i++) {
+        rc = pthread_create(&thread, NULL, diskIoThread, NULL);
+        if(rc != 0) {
+            do_log_error(L_ERROR, rc, "Couldn't create disk I/O thread");
+            break;
+        }
+        pthread_detach(thread);
+        n++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(n == 0)
+        goto fail;
+
+    diskIoState = 1;
+    return 1;
+
+ fail:
+    /* The event handler, if any, stays registered but never fires. */
+    return 0;
+}
+
+/* Submit a job for len bytes of the body starting at position, which
+   may span several chunks.  Reads are limited to a single chunk. */
+static int
+submitDiskIo(int op, ObjectPtr object, DiskCacheEntryPtr entry,
+             int position, int len)
+{
+    DiskIoJobPtr job;
+    int i = position / CHUNK_SIZE, j = position % CHUNK_SIZE, n;
+
+    assert(!(object->flags & OBJECT_DISK_IO));
+    assert(len > 0);
+    assert(op == DISK_IO_WRITE || j + len <= CHUNK_SIZE);
+
+    job = malloc(sizeof(DiskIoJobRec));
+    if(job == NULL)
+        return -1;
+
+    job->nchunks = 0;
+    n = 0;
+    while(n < len && job->nchunks < DISK_IO_MAX_CHUNKS) {
+        int k = i + job->nchunks;
+        int l = MIN(CHUNK_SIZE - j, len - n);
+        assert(k < object->numchunks && object->chunks[k].data);
+        job->iov[job->nchunks].iov_base = object->chunks[k].data + j;
+        job->iov[job->nchunks].iov_len = l;
+        job->nchunks++;
+        n += l;
+        j = 0;
+    }
+
+    job->fd = dup(entry->fd);
+    if(job->fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't duplicate disk entry");
+        free(job);
+        return -1;
+    }
+    job->op = op;
+    job->object = retainObject(object);
+    job->chunk = i;
+    job->position = position;
+    job->len = n;
+    job->offset = entry->base + entry->body_offset + position;
+    job->result = 0;
+    job->error = 0;
+    job->next = NULL;
+
+#ifdef HAVE_IO_URING
+    if(diskIoState == 2) {
+        /* The completion cannot be handled before we return. */
+        if(submitRingIo(op == DISK_IO_WRITE, job->fd, job->iov, job->nchunks,
+                        job->offset, diskIoRingHandler, job) < 0) {
+            close(job->fd);
+            free(job);
+            return -1;
+        }
+    }
+#endif
+
+    for(j = 0; j < job->nchunks; j++)
+        lockChunk(object, i + j);
+    object->flags |= OBJECT_DISK_IO;
+    if(op == DISK_IO_READ)
+        diskIoReads++;
+    else
+        diskIoWrites++;
+
+#ifdef HAVE_IO_URING
+    if(diskIoState == 2)
+        return n;
+#endif
+
+    pthread_mutex_lock(&diskIoLock);
+    if(diskIoQueueLast)
+        diskIoQueueLast->next = job;
+    else
+        diskIoQueue = job;
+    diskIoQueueLast = job;
+    pthread_cond_signal(&diskIoWork);
+    pthread_mutex_unlock(&diskIoLock);
+    return n;
+}
+
+#else
+
+#define waitForDiskIo(object) do {} while(0)
+#define diskIoReady() 0
+#define submitDiskIo(op, object, entry, position, len) (-1)
+
+#endif
+
+void
+diskCachePrintStatistics(ObjectPtr object)
+{
+#ifdef HAVE_DISK_THREADS
+    if(diskIoState > 0)
+        objectPrintf(object, object->size,
+                     "<p>Disk I/O %s: %d reads, %d writes, "
+                     "%d synchronous waits.</p>\n",
+                     diskIoState == 2 ? "ring" : "threads",
+                     diskIoReads, diskIoWrites, diskIoWaits);
+#endif
+}
+
+/* The segment store.  Small objects that are complete in memory are
+   appended as records to large segment files rather than being
+   given a file of their own.  Each record consists of a fixed-size
+   header followed by exactly what would be in a standalone cache file;
+   deleting an object appends a header-only tombstone.  The index,
+   which maps the MD5 of a URL to the latest record, is rebuilt by
+   reading the record headers when the store is first used, and
+   segments are compacted oldest first by copying the records that are
+   still live and young enough to the end of the newest segment.
+
+   Only one process may use the segment store at a time; this is
+   enforced with a lock on a file in the segment directory. */
+
+#define SEGMENT_DIR "%segments"
+#define SEGMENT_HEADER_SIZE 32
+#define SEGMENT_RECORD 'R'
+#define SEGMENT_TOMBSTONE 'T'
+
+typedef struct _SegmentIndexEntry {
+    unsigned char md5[16];
+    int segment;
+    off_t offset;
+    int length;
+    time_t atime;
+    struct _SegmentIndexEntry *next;
+} SegmentIndexEntryRec, *SegmentIndexEntryPtr;
+
+typedef struct _Segment {
+    int number;
+    off_t size;
+    off_t live;
+    time_t oldest;
+} SegmentRec, *SegmentPtr;
+
+static int segmentsState = 0;   /* 0 = not loaded, 1 = in use, -1 = off */
+static int segmentLockFd = -1;
+static int segmentFd = -1;      /* the newest segment, open for writing */
+static SegmentPtr segments = NULL;
+static int numSegments = 0, segmentsSize = 0;
+
+static SegmentIndexEntryPtr *segmentIndex = NULL;
+static int log2SegmentIndexSize = 0;
+static int segmentIndexCount = 0;
+
+static int segmentsExpiring = 0;  /* running from expireDiskObjects */
+static int compactingSegment = -1;
+static off_t compactionOffset = 0;
+
+static int segmentCompactionHandler(TimeEventHandlerPtr event);
+
+static int
+segmentFilename(char *buf, int n, int number)
+{
+    if(number >= 0)
+        return snnprintf(buf, 0, n, "%s%s/%08d",
+                         diskCacheRoot->string, SEGMENT_DIR, number);
+    else
+        return snnprintf(buf, 0, n, "%s%s", diskCacheRoot->string,
+                         SEGMENT_DIR);
+}
+
+static void
+putBE32(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static unsigned int
+getBE32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+        ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void
+formatSegmentHeader(unsigned char *buf, int type, int length,
+                    time_t atime, const unsigned char *md5buf)
+{
+    memcpy(buf, "PSG1", 4);
+    buf[4] = type;
+    buf[5] = buf[6] = buf[7] = 0;
+    putBE32(buf + 8, length);
+    putBE32(buf + 12, (unsigned int)atime);
+    memcpy(buf + 16, md5buf, 16);
+}
+
+static int
+parseSegmentHeader(const unsigned char *buf, int *type_return,
+                   int *length_return, time_t *atime_return)
+{
+    if(memcmp(buf, "PSG1", 4) != 0)
+        return -1;
+    if(buf[4] != SEGMENT_RECORD && buf[4] != SEGMENT_TOMBSTONE)
+        return -1;
+    *type_return = buf[4];
+    *length_return = getBE32(buf + 8);
+    *atime_return = (time_t)getBE32(buf + 12);
+    if(*length_return < 0 ||
+       (*type_return == SEGMENT_TOMBSTONE && *length_return != 0))
+        return -1;
+    return 1;
+}
+
+static SegmentPtr
+findSegment(int number)
+{
+    int lo = 0, hi = numSegments - 1;
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if(segments[mid].number == number)
+            return &segments[mid];
+        else if(segments[mid].number < number)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+static SegmentPtr
+addSegment(int number)
+{
+    SegmentPtr segment;
+
+    if(numSegments >= segmentsSize) {
+        int n = segmentsSize ? 2 * segmentsSize : 16;
+        SegmentPtr new_segments = realloc(segments, n * sizeof(SegmentRec));
+        if(new_segments == NULL) {
+            do_log(L_ERROR, "Couldn't allocate segment table.\n");
+            return NULL;
+        }
+        segments = new_segments;
+        segmentsSize = n;
+    }
+    assert(numSegments == 0 || segments[numSegments - 1].number < number);
+    segment = &segments[numSegments++];
+    segment->number = number;
+    segment->size = 0;
+    segment->live = 0;
+    segment->oldest = -1;
+    return segment;
+}
+
+static void
+removeFirstSegment()
+{
+    assert(numSegments > 1);
+    memmove(segments, segments + 1, (numSegments - 1) * sizeof(SegmentRec));
+    numSegments--;
+}
+
+static SegmentIndexEntryPtr *
+segmentIndexBucket(const unsigned char *md5buf)
+{
+    unsigned int h;
+    memcpy(&h, md5buf, sizeof(h));
+    return &segmentIndex[h & ((1 << log2SegmentIndexSize) - 1)];
+}
+
+static SegmentIndexEntryPtr
+findSegmentIndexEntry(const unsigned char *md5buf)
+{
+    SegmentIndexEntryPtr entry = *segmentIndexBucket(md5buf);
+    while(entry && memcmp(entry->md5, md5buf, 16) != 0)
+        entry = entry->next;
+    return entry;
+}
+
+static void
+growSegmentIndex()
+{
+    SegmentIndexEntryPtr *old = segmentIndex, entry, next;
+    int i, old_size = 1 << log2SegmentIndexSize;
+
+    segmentIndex = calloc(2 * old_size, sizeof(SegmentIndexEntryPtr));
+    if(segmentIndex == NULL) {
+        segmentIndex = old;
+        return;
+    }
+    log2SegmentIndexSize++;
+    for(i = 0; i < old_size; i++) {
+        for(entry = old[i]; entry; entry = next) {
+            SegmentIndexEntryPtr *bucket = segmentIndexBucket(entry->md5);
+            next = entry->next;
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+    free(old);
+}
+
+static void
+dropSegmentIndexEntry(SegmentIndexEntryPtr entry)
+{
+    SegmentIndexEntryPtr *p = segmentIndexBucket(entry->md5);
+    SegmentPtr segment = findSegment(entry->segment);
+
+    if(segment)
+        segment->live -= SEGMENT_HEADER_SIZE + entry->length;
+    while(*p != entry)
+        p = &(*p)->next;
+    *p = entry->next;
+    free(entry);
+    segmentIndexCount--;
+}
+
+/* Record that the latest version of md5 lives at the given place. */
+static int
+setSegmentIndexEntry(const unsigned char *md5buf, int number, off_t offset,
+                     int length, time_t atime)
+{
+    SegmentIndexEntryPtr entry = findSegmentIndexEntry(md5buf);
+    SegmentPtr segment;
+
+    if(entry) {
+        segment = findSegment(entry->segment);
+        if(segment)
+            segment->live -= SEGMENT_HEADER_SIZE + entry->length;
+    } else {
+        if(segmentIndexCount >= (1 << log2SegmentIndexSize))
+            growSegmentIndex();
+        entry = malloc(sizeof(SegmentIndexEntryRec));
+        if(entry == NULL) {
+            do_log(L_ERROR, "Couldn't allocate segment index entry.\n");
+            return -1;
+        }
+        memcpy(entry->md5, md5buf, 16);
+        entry->next = *segmentIndexBucket(md5buf);
+        *segmentIndexBucket(md5buf) = entry;
+        segmentIndexCount++;
+    }
+    entry->segment = number;
+    entry->offset = offset;
+    entry->length = length;
+    entry->atime = atime;
+    segment = findSegment(number);
+    if(segment) {
+        segment->live += SEGMENT_HEADER_SIZE + length;
+        if(segment->oldest < 0 || atime < segment->oldest)
+            segment->oldest = atime;
+    }
+    return 1;
+}
+
+/* Read the record headers of a segment into the index.  Returns the
+   length of the valid prefix of the segment. */
+static off_t
+scanSegment(int fd, SegmentPtr segment)
+{
+    unsigned char *buf;
+    int bufsize = 64 * 1024, len = 0, rc, type, length;
+    off_t start = 0, offset = 0;
+    time_t atime;
+    struct stat ss;
+
+    rc = fstat(fd, &ss);
+    if(rc < 0)
+        return -1;
+
+    buf = malloc(bufsize);
+    if(buf == NULL)
+        return -1;
+
+    while(1) {
+        if(offset < start || offset + SEGMENT_HEADER_SIZE > start + len) {
+            rc = lseek(fd, offset, SEEK_SET);
+            if(rc < 0)
+                break;
+            start = offset;
+            len = 0;
+            while(len < bufsize) {
+                rc = read(fd, buf + len, bufsize - len);
+                if(rc < 0 && errno == EINTR)
+                    continue;
+                if(rc <= 0)
+                    break;
+                len += rc;
+            }
+            if(len < SEGMENT_HEADER_SIZE)
+                break;
+        }
+        rc = parseSegmentHeader(buf + (offset - start),
+                                &type, &length, &atime);
+        if(rc < 0 || offset + SEGMENT_HEADER_SIZE + length > ss.st_size)
+            break;
+        if(type == SEGMENT_RECORD) {
+            setSegmentIndexEntry(buf + (offset - start) + 16,
+                                 segment->number, offset, length, atime);
+        } else {
+            SegmentIndexEntryPtr entry =
+                findSegmentIndexEntry(buf + (offset - start) + 16);
+            if(entry)
+                dropSegmentIndexEntry(entry);
+        }
+        offset += SEGMENT_HEADER_SIZE + length;
+    }
+
+    free(buf);
+    return offset;
+}
+
+static int
+compareInts(const void *a, const void *b)
+{
+    int ia = *(const int*)a, ib = *(const int*)b;
+    return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+static int
+openNewestSegment()
+{
+    char buf[1024];
+    SegmentPtr segment = &segments[numSegments - 1];
+    int rc;
+
+    if(segmentFd >= 0)
+        close(segmentFd);
+    segmentFilename(buf, 1024, segment->number);
+    segmentFd = open(buf, O_RDWR | O_CREAT | O_BINARY,
+                     diskCacheFilePermissions);
+    if(segmentFd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't open segment %s", buf);
+        return -1;
+    }
+    /* Drop any partially written record. */
+    rc = ftruncate(segmentFd, segment->size);
+    if(rc < 0)
+        do_log_error(L_WARN, errno, "Couldn't truncate segment %s", buf);
+    return 1;
+}
+
+static int
+loadSegments()
+{
+    char buf[1024];
+    int n, rc, fd, i;
+    int *numbers = NULL, numNumbers = 0, numbersSize = 0;
+    DIR *dir;
+    struct dirent *dirent;
+    struct flock lock;
+    SegmentPtr segment;
+
+    n = segmentFilename(buf, 1024, -1);
+    if(n < 0 || n >= 1000)
+        return -1;
+    rc = mkdir(buf, diskCacheDirectoryPermissions);
+    if(rc < 0 && errno != EEXIST) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", buf);
+        return -1;
+    }
+
+    strcpy(buf + n, "/lock");
+    segmentLockFd = open(buf, O_RDWR | O_CREAT | O_BINARY,
+                         diskCacheFilePermissions);
+    if(segmentLockFd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't open %s", buf);
+        return -1;
+    }
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    rc = fcntl(segmentLockFd, F_SETLK, &lock);
+    if(rc < 0) {
+        do_log(L_WARN, "Segment store in use by another process -- "
+               "storing small objects in separate files.\n");
+        close(segmentLockFd);
+        segmentLockFd = -1;
+        return -1;
+    }
+
+    log2SegmentIndexSize = 10;
+    segmentIndex = calloc(1 << log2SegmentIndexSize,
+                          sizeof(SegmentIndexEntryPtr));
+    if(segmentIndex == NULL)
+        return -1;
+
+    buf[n] = '\0';
+    dir = opendir(buf);
+    if(dir == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't open %s", buf);
+        return -1;
+    }
+    while((dirent = readdir(dir))) {
+        char *end;
+        long number = strtol(dirent->d_name, &end, 10);
+        if(end == dirent->d_name || *end != '\0' ||
+           number < 0 || number > INT_MAX)
+            continue;
+        if(numNumbers >= numbersSize) {
+            int *new_numbers;
+            numbersSize = numbersSize ? 2 * numbersSize : 64;
+            new_numbers = realloc(numbers, numbersSize * sizeof(int));
+            if(new_numbers == NULL)
+                break;
+            numbers = new_numbers;
+        }
+        numbers[numNumbers++] = number;
+    }
+    closedir(dir);
+    if(numNumbers > 0)
+        qsort(numbers, numNumbers, sizeof(int), compareInts);
+
+    for(i = 0; i < numNumbers; i++) {
+        segment = addSegment(numbers[i]);
+        if(segment == NULL)
+            break;
+        segmentFilename(buf, 1024, numbers[i]);
+        fd = open(buf, O_RDONLY | O_BINARY);
+        if(fd < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't open segment %s", buf);
+            numSegments--;
+            continue;
+        }
+        segment->size = scanSegment(fd, segment);
+        close(fd);
+        if(segment->size < 0) {
+            numSegments--;
+            continue;
+        }
+    }
+    free(numbers);
+
+    if(numSegments == 0 &&
+       addSegment(1) == NULL)
+        return -1;
+
+    rc = openNewestSegment();
+    if(rc < 0)
+        return -1;
+
+    do_log(L_INFO, "Loaded %d objects from %d disk cache segments.\n",
+           segmentIndexCount, numSegments);
+
+    if(!segmentsExpiring &&
+       !scheduleTimeEvent(60, segmentCompactionHandler, 0, NULL))
+        do_log(L_ERROR, "Couldn't schedule segment compaction.\n");
+    return 1;
+}
+
+static int
+segmentsReady()
+{
+    if(segmentsState == 0) {
+        if(!diskCacheSegments ||
+           diskCacheRoot == NULL || diskCacheRoot->length <= 0)
+            segmentsState = -1;
+        else
+            segmentsState = loadSegments() < 0 ? -1 : 1;
+    }
+    return segmentsState > 0;
+}
+
+/* Whether an object belongs in the segment store, and whether it is
+   entirely in memory so that it can be appended in one go. */
+static int
+segmentObject(ObjectPtr object)
+{
+    return object->length >= 0 &&
+        object->length <= diskCacheSegmentObjectSize &&
+        !(object->flags & OBJECT_LOCAL);
+}
+
+static int
+segmentObjectComplete(ObjectPtr object)
+{
+    int i;
+
+    if(object->size < object->length ||
+       object->numchunks * CHUNK_SIZE < object->length)
+        return 0;
+    for(i = 0; i * CHUNK_SIZE < object->length; i++) {
+        if(object->chunks[i].size <
+           MIN(CHUNK_SIZE, object->length - i * CHUNK_SIZE))
+            return 0;
+    }
+    return 1;
+}
+
+static int
+writeAll(int fd, const void *buf, int len)
+{
+    int rc, done = 0;
+    while(done < len) {
+        rc = write(fd, (const char*)buf + done, len - done);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+        done += rc;
+    }
+    return done;
+}
+
+static int
+readAll(int fd, void *buf, int len)
+{
+    int rc, done = 0;
+    while(done < len) {
+        rc = read(fd, (char*)buf + done, len - done);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+        done += rc;
+    }
+    return done;
+}
+
+/* Append a record or tombstone to the newest segment, starting a new
+   segment if it is full.  If object is not NULL, the record contents
+   are its headers and body; otherwise, they are taken from data. */
+static int
+appendSegmentRecord(const unsigned char *md5buf, int type, time_t atime,
+                    ObjectPtr object, const char *data, int length,
+                    int *body_offset_return)
+{
+    SegmentPtr segment = &segments[numSegments - 1];
+    unsigned char header[SEGMENT_HEADER_SIZE];
+    off_t offset;
+    int rc, i, body_offset = -1;
+
+    if(segment->size >= diskCacheSegmentSize) {
+        segment = addSegment(segment->number + 1);
+        if(segment == NULL)
+            return -1;
+        if(openNewestSegment() < 0) {
+            numSegments--;
+            openNewestSegment();
+            return -1;
+        }
+        segment = &segments[numSegments - 1];
+    }
+
+    offset = segment->size;
+    rc = lseek(segmentFd, offset + SEGMENT_HEADER_SIZE, SEEK_SET);
+    if(rc < 0)
+        goto fail;
+
+    if(type == SEGMENT_TOMBSTONE) {
+        length = 0;
+    } else if(object) {
+        rc = writeHeaders(segmentFd, &body_offset, object,
+                          object->numchunks > 0 ? object->chunks[0].data :
+                          NULL,
+                          object->numchunks > 0 ? object->chunks[0].size : 0);
+        if(rc < 0)
+            goto fail;
+        for(i = 1; i * CHUNK_SIZE < object->length; i++) {
+            rc = writeAll(segmentFd, object->chunks[i].data,
+                          object->chunks[i].size);
+            if(rc < 0)
+                goto fail;
+        }
+        length = body_offset + object->length;
+    } else {
+        rc = writeAll(segmentFd, data, length);
+        if(rc < 0)
+            goto fail;
+    }
 
-    if(object->flags & OBJECT_INITIAL) object->via = via;
-    object->flags &= ~OBJECT_INITIAL;
-    if(offset > body_offset) {
-        /* We need to make sure we don't invoke object expiry recursively */
-        objectSetChunks(object, 1);
-        if(object->numchunks >= 1) {
-            if(object->chunks[0].data == NULL)
-                object->chunks[0].data = maybe_get_chunk();
-            if(object->chunks[0].data)
-                objectAddData(object, buf + body_offset,
-                              0, MIN(offset - body_offset, CHUNK_SIZE));
-        }
+    /* The header goes last, so that a partial record is never valid. */
+    formatSegmentHeader(header, type, length, atime, md5buf);
+    rc = lseek(segmentFd, offset, SEEK_SET);
+    if(rc < 0)
+        goto fail;
+    rc = writeAll(segmentFd, header, SEGMENT_HEADER_SIZE);
+    if(rc < 0)
+        goto fail;
+
+    segment->size = offset + SEGMENT_HEADER_SIZE + length;
+    if(type == SEGMENT_RECORD) {
+        setSegmentIndexEntry(md5buf, segment->number, offset, length, atime);
+    } else {
+        SegmentIndexEntryPtr entry = findSegmentIndexEntry(md5buf);
+        if(entry)
+            dropSegmentIndexEntry(entry);
     }
+    if(body_offset_return)
+        *body_offset_return = body_offset;
+    return 1;
 
-    httpTweakCachability(object);
+ fail:
+    do_log_error(L_ERROR, errno, "Couldn't write disk cache segment");
+    rc = ftruncate(segmentFd, offset);
+    return -1;
+}
 
-    if(buf_is_chunk)
-        dispose_chunk(buf);
-    else
-        free(buf);
-    if(body_offset_return) *body_offset_return = body_offset;
-    if(offset_return) *offset_return = offset;
-    return dirty;
+/* Open the record for an object.  Returns a file descriptor, or -1. */
+static int
+openSegmentRecord(ObjectPtr object, const unsigned char *md5buf,
+                  int *body_offset_return, off_t *base_return,
+                  int *size_return, int *dirty_return)
+{
+    char buf[1024];
+    SegmentIndexEntryPtr entry = findSegmentIndexEntry(md5buf);
+    int fd, rc, body_offset;
+    off_t offset;
 
- invalid:
-    releaseAtom(message);
-    if(etag) free(etag);
-    if(location) free(location);
-    if(via) releaseAtom(via);
-    /* fall through */
+    if(entry == NULL)
+        return -1;
+
+    segmentFilename(buf, 1024, entry->segment);
+    fd = open(buf, O_RDONLY | O_BINARY);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't open segment %s", buf);
+        return -1;
+    }
+    rc = lseek(fd, entry->offset + SEGMENT_HEADER_SIZE, SEEK_SET);
+    if(rc < 0)
+        goto fail;
+    rc = validateEntry(object, fd, entry->length, &body_offset, &offset);
+    if(rc < 0) {
+        close(fd);
+        /* Stale or corrupt -- forget about it. */
+        appendSegmentRecord(md5buf, SEGMENT_TOMBSTONE, current_time.tv_sec,
+                            NULL, NULL, 0, NULL);
+        return -1;
+    }
+    entry->atime = current_time.tv_sec;
+    *dirty_return = rc;
+    *body_offset_return = body_offset;
+    *base_return = entry->offset + SEGMENT_HEADER_SIZE;
+    *size_return = entry->length - body_offset;
+    return fd;
 
  fail:
-    if(buf_is_chunk)
-        dispose_chunk(buf);
-    else
-        free(buf);
+    close(fd);
     return -1;
 }
 
-void
-dirtyDiskEntry(ObjectPtr object)
+static int
+appendSegmentObject(ObjectPtr object, const unsigned char *md5buf,
+                    int *body_offset_return, off_t *base_return,
+                    int *size_return)
 {
-    DiskCacheEntryPtr entry = object->disk_entry;
-    if(entry && entry != &negativeEntry) entry->metadataDirty = 1;
+    char buf[1024];
+    SegmentIndexEntryPtr entry;
+    int fd, rc;
+
+    rc = appendSegmentRecord(md5buf, SEGMENT_RECORD, current_time.tv_sec,
+                             object, NULL, 0, body_offset_return);
+    if(rc < 0)
+        return -1;
+    entry = findSegmentIndexEntry(md5buf);
+    assert(entry);
+
+    segmentFilename(buf, 1024, entry->segment);
+    fd = open(buf, O_RDONLY | O_BINARY);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't open segment %s", buf);
+        return -1;
+    }
+    *base_return = entry->offset + SEGMENT_HEADER_SIZE;
+    *size_return = object->length;
+    object->flags |= OBJECT_DISK_ENTRY_COMPLETE;
+    return fd;
 }
 
-int
-revalidateDiskEntry(ObjectPtr object)
+static void
+removeSegmentObject(ObjectPtr object)
 {
-    DiskCacheEntryPtr entry = object->disk_entry;
-    int rc;
-    int body_offset;
+    unsigned char md5buf[16];
 
-    if(!entry || entry == &negativeEntry)
-        return 1;
+    if(segmentsState <= 0)
+        return;
+    md5((unsigned char*)object->key, object->key_size, md5buf);
+    if(findSegmentIndexEntry(md5buf))
+        appendSegmentRecord(md5buf, SEGMENT_TOMBSTONE, current_time.tv_sec,
+                            NULL, NULL, 0, NULL);
+}
 
-    CHECK_ENTRY(entry);
-    rc = entrySeek(entry, 0);
-    if(rc < 0) return 0;
+/* Rewriting the metadata of a record means writing a new record.
+   We only do that if the whole object is in memory. */
+static int
+rewriteSegmentObject(ObjectPtr object)
+{
+    DiskCacheEntryPtr entry = object->disk_entry;
+    unsigned char md5buf[16];
+    int fd, body_offset, size;
+    off_t base;
 
-    rc = validateEntry(object, entry->fd, &body_offset, &entry->offset);
-    if(rc < 0) {
-        destroyDiskEntry(object, 0);
+    entry->metadataDirty = 0;
+    if(!segmentObjectComplete(object))
         return 0;
-    }
-    if(body_offset != entry->body_offset) {
-        do_log(L_WARN, "Inconsistent body offset (%d != %d).\n",
-               body_offset, entry->body_offset);
-        destroyDiskEntry(object, 0);
+    md5((unsigned char*)object->key, object->key_size, md5buf);
+    fd = appendSegmentObject(object, md5buf, &body_offset, &base, &size);
+    if(fd < 0)
+        return 0;
+    close(entry->fd);
+    entry->fd = fd;
+    entry->base = base;
+    entry->body_offset = body_offset;
+    entry->size = size;
+    entry->offset = -1;
+    return 1;
+}
+
+/* Copy or drop the records of the oldest segment, spending at most
+   budget bytes.  Returns 1 if there is more work to do. */
+static int
+compactSegments(int budget)
+{
+    char buf[1024];
+    unsigned char header[SEGMENT_HEADER_SIZE];
+    SegmentPtr segment;
+    SegmentIndexEntryPtr entry;
+    char *data;
+    int fd, rc, type, length, done = 0;
+    time_t atime;
+
+    if(segmentsState <= 0)
         return 0;
+
+    if(compactingSegment < 0) {
+        segment = &segments[0];
+        if(segment->size == 0)
+            return 0;
+        if(segment->live * 2 >= segment->size &&
+           (segment->oldest < 0 ||
+            segment->oldest >= current_time.tv_sec - diskCacheUnlinkTime))
+            return 0;
+        if(numSegments == 1) {
+            /* Never compact the segment we are appending to. */
+            if(addSegment(segment->number + 1) == NULL)
+                return 0;
+            if(openNewestSegment() < 0) {
+                numSegments--;
+                openNewestSegment();
+                return 0;
+            }
+        }
+        compactingSegment = segments[0].number;
+        compactionOffset = 0;
     }
 
-    entry->metadataDirty |= !!rc;
-    CHECK_ENTRY(entry);
+    segment = &segments[0];
+    assert(segment->number == compactingSegment);
+    segmentFilename(buf, 1024, segment->number);
+    fd = open(buf, O_RDONLY | O_BINARY);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't open segment %s", buf);
+        compactionOffset = segment->size;
+    }
+
+    while(fd >= 0 && compactionOffset < segment->size && done < budget) {
+        rc = lseek(fd, compactionOffset, SEEK_SET);
+        if(rc >= 0)
+            rc = readAll(fd, header, SEGMENT_HEADER_SIZE);
+        if(rc >= 0)
+            rc = parseSegmentHeader(header, &type, &length, &atime);
+        if(rc < 0)
+            break;
+        entry = findSegmentIndexEntry(header + 16);
+        if(type == SEGMENT_RECORD && entry &&
+           entry->segment == segment->number &&
+           entry->offset == compactionOffset) {
+            if(entry->atime < current_time.tv_sec - diskCacheUnlinkTime) {
+                dropSegmentIndexEntry(entry);
+            } else {
+                data = malloc(length > 0 ? length : 1);
+                if(data == NULL)
+                    break;
+                rc = readAll(fd, data, length);
+                if(rc >= 0 || length == 0)
+                    appendSegmentRecord(header + 16, SEGMENT_RECORD,
+                                        entry->atime, NULL, data, length,
+                                        NULL);
+                free(data);
+                /* appendSegmentRecord may have grown the segment table. */
+                segment = &segments[0];
+                done += length;
+            }
+        }
+        compactionOffset += SEGMENT_HEADER_SIZE + length;
+        done += SEGMENT_HEADER_SIZE;
+    }
+    if(fd >= 0)
+        close(fd);
+
+    if(fd >= 0 && compactionOffset < segment->size && done >= budget)
+        return 1;
+
+    /* Whatever is left (normally nothing) is lost. */
+    if(segment->live > 0) {
+        int i, n = 1 << log2SegmentIndexSize;
+        SegmentIndexEntryPtr next;
+        for(i = 0; i < n; i++) {
+            for(entry = segmentIndex[i]; entry; entry = next) {
+                next = entry->next;
+                if(entry->segment == segment->number)
+                    dropSegmentIndexEntry(entry);
+            }
+        }
+    }
+    rc = unlink(buf);
+    if(rc < 0)
+        do_log_error(L_WARN, errno, "Couldn't unlink segment %s", buf);
+    removeFirstSegment();
+    compactingSegment = -1;
+    return numSegments > 1;
+}
+
+static int
+segmentCompactionHandler(TimeEventHandlerPtr event)
+{
+    int more = compactSegments(1024 * 1024);
+    if(!scheduleTimeEvent(more ? -1 : 60, segmentCompactionHandler, 0, NULL))
+        do_log(L_ERROR, "Couldn't schedule segment compaction.\n");
     return 1;
 }
 
@@ -1146,10 +2367,14 @@ makeDiskEntry(ObjectPtr object, int create)
     int rc;
     int local = (object->flags & OBJECT_LOCAL) != 0;
     int dirty = 0;
+    int segment = 0;
+    off_t base = 0;
 
    if(local && create)
        return NULL;
 
+    waitForDiskIo(object);
+
     if(!local && !(object->flags & OBJECT_PUBLIC))
         return NULL;
 
@@ -1197,12 +2422,33 @@ makeDiskEntry(ObjectPtr object, int create)
     if(!local) {
         if(diskCacheRoot == NULL || diskCacheRoot->length <= 0)
             return NULL;
+        if(segmentsReady()) {
+            unsigned char md5buf[16];
+            md5((unsigned char*)object->key, object->key_size, md5buf);
+            if(!negative)
+                fd = openSegmentRecord(object, md5buf, &body_offset, &base,
+                                       &size, &dirty);
+            if(fd < 0 && create && segmentObject(object) &&
+               !(object->flags & OBJECT_INITIAL)) {
+                /* Wait until the whole object is in memory. */
+                if(!segmentObjectComplete(object))
+                    return NULL;
+                fd = appendSegmentObject(object, md5buf, &body_offset,
+                                         &base, &size);
+                dirty = 0;
+            }
+            if(fd >= 0)
+                segment = 1;
+        }
+    }
+
+    if(!local && !segment) {
         name_len = urlFilename(buf, 1024, object->key, object->key_size);
         if(name_len < 0) return NULL;
         if(!negative)
             fd = open(buf, O_RDWR | O_BINARY);
         if(fd >= 0) {
-            rc = validateEntry(object, fd, &body_offset, &offset);
+            rc = validateEntry(object, fd, -1, &body_offset, &offset);
             if(rc >= 0) {
                 dirty = rc;
             } else {
@@ -1248,7 +2494,7 @@ makeDiskEntry(ObjectPtr object, int create)
                 dirty = 0;
             }
         }
-    } else {
+    } else if(local) {
         /* local */
         if(localDocumentRoot == NULL || localDocumentRoot->length == 0)
             return NULL;
@@ -1259,7 +2505,7 @@ makeDiskEntry(ObjectPtr object, int create)
             return NULL;
         fd = open(buf, O_RDONLY | O_BINARY);
         if(fd >= 0) {
-            if(validateEntry(object, fd, &body_offset, NULL) < 0) {
+            if(validateEntry(object, fd, -1, &body_offset, NULL) < 0) {
                 close(fd);
                 fd = -1;
             }
@@ -1273,12 +2519,14 @@ makeDiskEntry(ObjectPtr object, int create)
     }
     assert(body_offset >= 0);
 
-    name = strdup_n(buf, name_len);
-    if(name == NULL) {
-        do_log(L_ERROR, "Couldn't allocate name.\n");
-        close(fd);
-        fd = -1;
-        return NULL;
+    if(!segment) {
+        name = strdup_n(buf, name_len);
+        if(name == NULL) {
+            do_log(L_ERROR, "Couldn't allocate name.\n");
+            close(fd);
+            fd = -1;
+            return NULL;
+        }
     }
 
     entry = malloc(sizeof(DiskCacheEntryRec));
@@ -1297,6 +2545,8 @@ makeDiskEntry(ObjectPtr object, int create)
     entry->offset = offset;
     entry->size = size;
     entry->metadataDirty = dirty;
+    entry->segment = segment;
+    entry->base = base;
 
     entry->next = diskEntries;
     if(diskEntries)
@@ -1425,6 +2675,8 @@ destroyDiskEntry(ObjectPtr object, int d)
 
     if(d) {
         entry->object->flags &= ~OBJECT_DISK_ENTRY_COMPLETE;
+        if(entry->segment)
+            removeSegmentObject(object);
         if(entry->filename) {
             urc = unlink(entry->filename);
             if(urc < 0)
@@ -1440,7 +2692,7 @@ destroyDiskEntry(ObjectPtr object, int d)
         if(entry == NULL || entry == &negativeEntry)
             return 0;
         if(diskCacheWriteoutOnClose > 0) {
-            reallyWriteoutToDisk(object, -1, diskCacheWriteoutOnClose);
+            reallyWriteoutToDisk(object, -1, diskCacheWriteoutOnClose, 0);
             entry = object->disk_entry;
             if(entry == NULL || entry == &negativeEntry)
                 return 0;
@@ -1477,6 +2729,41 @@ destroyDiskEntry(ObjectPtr object, int d)
         return 1;
 }
 
+/* Whether the object's open disk entry holds all of its data. */
+int
+diskEntryComplete(ObjectPtr object)
+{
+    DiskCacheEntryPtr entry = object->disk_entry;
+
+    if(!entry || entry == &negativeEntry || object->length < 0)
+        return 0;
+    return diskEntrySize(object) >= object->length;
+}
+
+/* Returns a new descriptor for the on-disk copy of a complete object,
+   and the offset in that file at which the body starts. */
+int
+diskEntryFd(ObjectPtr object, off_t *body_offset_return)
+{
+    DiskCacheEntryPtr entry;
+    int fd;
+
+    if(object->length < 0)
+        return -1;
+
+    entry = makeDiskEntry(object, 0);
+    if(!entry || diskEntrySize(object) < object->length)
+        return -1;
+
+    fd = dup(entry->fd);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't duplicate disk entry");
+        return -1;
+    }
+    *body_offset_return = entry->base + entry->body_offset;
+    return fd;
+}
+
 ObjectPtr 
 objectGetFromDisk(ObjectPtr object)
 {
@@ -1486,8 +2773,8 @@ objectGetFromDisk(ObjectPtr object)
 }
 
 
-int 
-objectFillFromDisk(ObjectPtr object, int offset, int chunks)
+static int
+fillFromDisk(ObjectPtr object, int offset, int chunks, int async)
 {
     DiskCacheEntryPtr entry;
     int rc, result;
@@ -1530,12 +2817,38 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     if(complete)
         return 1;
 
+    if(async && (object->flags & OBJECT_DISK_IO))
+        return 2;
+
     /* This has the side-effect of revalidating the entry, which is
        what makes HEAD requests work. */
     entry = makeDiskEntry(object, 0);
     if(!entry)
         return 0;
-                
+
+    if(async) {
+        for(k = 0; k < chunks; k++) {
+            int o, len;
+            i = offset / CHUNK_SIZE + k;
+            j = object->chunks[i].size;
+            o = i * CHUNK_SIZE + j;
+            if(j == CHUNK_SIZE)
+                continue;
+            if(entry->size >= 0 && entry->size <= o)
+                return 0;
+            len = CHUNK_SIZE - j;
+            if(entry->size >= 0)
+                len = MIN(len, entry->size - o);
+            if(!object->chunks[i].data)
+                object->chunks[i].data = get_chunk();
+            if(!object->chunks[i].data)
+                return 0;
+            rc = submitDiskIo(DISK_IO_READ, object, entry, o, len);
+            return rc < 0 ? 0 : 2;
+        }
+        return 0;
+    }
+
     for(k = 0; k < chunks; k++) {
         i = offset / CHUNK_SIZE + k;
         if(!object->chunks[i].data)
@@ -1571,7 +2884,9 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
 
         CHECK_ENTRY(entry);
         again:
-        rc = read(entry->fd, object->chunks[i].data + j, CHUNK_SIZE - j);
+        rc = read(entry->fd, object->chunks[i].data + j,
+                  entry->segment ?
+                  MIN(CHUNK_SIZE - j, entry->size - o) : CHUNK_SIZE - j);
         if(rc < 0) {
             if(errno == EINTR)
                 goto again;
@@ -1631,8 +2946,23 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     }
 }
 
-int 
-writeoutToDisk(ObjectPtr object, int upto, int max)
+int
+objectFillFromDisk(ObjectPtr object, int offset, int chunks)
+{
+    return fillFromDisk(object, offset, chunks, 0);
+}
+
+/* Like objectFillFromDisk, but may return 2, in which case the data
+   is being read by a disk I/O thread and the object will be notified
+   when it is available. */
+int
+objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks)
+{
+    return fillFromDisk(object, offset, chunks, diskIoReady());
+}
+
+static int
+writeoutToDiskI(ObjectPtr object, int upto, int max, int async)
 {
     if(maxDiskCacheEntrySize >= 0 && object->size > maxDiskCacheEntrySize) {
         /* An object was created with an unknown length, and then grew
@@ -1641,11 +2971,27 @@ writeoutToDisk(ObjectPtr object, int upto, int max)
         return 0;
     }
 
-    return reallyWriteoutToDisk(object, upto, max);
+    return reallyWriteoutToDisk(object, upto, max, async);
+}
+
+int 
+writeoutToDisk(ObjectPtr object, int upto, int max)
+{
+    return writeoutToDiskI(object, upto, max, 0);
+}
+
+/* Like writeoutToDisk, but hands the data to a disk I/O thread if
+   possible.  Objects with a disk operation in flight are skipped. */
+int
+writeoutToDiskAsync(ObjectPtr object, int upto, int max)
+{
+    if(object->flags & OBJECT_DISK_IO)
+        return 0;
+    return writeoutToDiskI(object, upto, max, diskIoReady());
 }
         
 static int 
-reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
+reallyWriteoutToDisk(ObjectPtr object, int upto, int max, int async)
 {
     DiskCacheEntryPtr entry;
     int rc;
@@ -1675,7 +3021,8 @@ reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
     if(entry->size < 0)
         return 0;
 
-    if(object->length >= 0 && entry->size >= object->length) {
+    if(entry->segment ||
+       (object->length >= 0 && entry->size >= object->length)) {
         object->flags |= OBJECT_DISK_ENTRY_COMPLETE;
         goto done;
     }
@@ -1694,6 +3041,28 @@ reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
             return 0;
     }
 
+    if(async) {
+        /* Find the contiguous data available from offset. */
+        i = offset / CHUNK_SIZE;
+        j = offset % CHUNK_SIZE;
+        while(i < object->numchunks && object->chunks[i].size > j &&
+              (max < 0 || bytes < max)) {
+            bytes += object->chunks[i].size - j;
+            if(object->chunks[i].size < CHUNK_SIZE)
+                break;
+            i++;
+            j = 0;
+        }
+        bytes = MIN(bytes, upto - offset);
+        if(max >= 0)
+            bytes = MIN(bytes, max);
+        if(bytes <= 0)
+            goto done;
+        rc = submitDiskIo(DISK_IO_WRITE, object, entry, offset, bytes);
+        /* The metadata, if dirty, will be written out next time. */
+        return rc < 0 ? 0 : rc;
+    }
+
     rc = entrySeek(entry, offset + entry->body_offset);
     if(rc < 0) return 0;
 
@@ -1748,6 +3117,9 @@ writeoutMetadata(ObjectPtr object)
 
     assert(!entry->local);
 
+    if(entry->segment)
+        return rewriteSegmentObject(object);
+
     rc = entrySeek(entry, 0);
     if(rc < 0) goto fail;
 
@@ -2483,6 +3855,10 @@ expireDiskObjects()
                 continue;
             }
 
+            /* Segments are expired by compaction below. */
+            if(strstr(fe->fts_path, "/" SEGMENT_DIR "/"))
+                continue;
+
             files++;
             left += expireFile(fe->fts_accpath, fe->fts_statp,
                                &considered, &unlinked, &truncated);
@@ -2496,11 +3872,22 @@ expireDiskObjects()
            "(%ldkB -> %ldkB).\n",
            files, considered, unlinked, truncated, total/1024, left/1024);
     printf("%d directories, %d removed.\n", dirs, rmdirs);
+
+    segmentsExpiring = 1;
+    if(segmentsReady()) {
+        int n = numSegments;
+        while(compactSegments(INT_MAX))
+            ;
+        printf("%d segments, %d removed, %d objects left.\n",
+               n, n - numSegments, segmentIndexCount);
+    }
     return;
 }
 
 #else
 
+int diskCacheSendfileSize = -1;
+
 void
 preinitDiskcache()
 {
@@ -2537,6 +3924,36 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     return 0;
 }
 
+int
+objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks)
+{
+    return 0;
+}
+
+int
+writeoutToDiskAsync(ObjectPtr object, int upto, int max)
+{
+    return 0;
+}
+
+void
+diskCachePrintStatistics(ObjectPtr object)
+{
+    return;
+}
+
+int
+diskEntryComplete(ObjectPtr object)
+{
+    return 0;
+}
+
+int
+diskEntryFd(ObjectPtr object, off_t *body_offset_return)
+{
+    return -1;
+}
+
 int
 revalidateDiskEntry(ObjectPtr object)
 {
@@ -34,6 +34,8 @@ typedef struct _DiskCacheEntry {
     int body_offset;
     short local;
     short metadataDirty;
+    short segment;
+    off_t base;
     struct _DiskCacheEntry *next;
     struct _DiskCacheEntry *previous;
 } *DiskCacheEntryPtr, DiskCacheEntryRec;
@@ -55,17 +57,24 @@ typedef struct _DiskObject {
 struct stat;
 
 extern int maxDiskCacheEntrySize;
+extern int diskCacheSegments;
+extern int diskCacheSendfileSize;
 
 void preinitDiskcache(void);
 void initDiskcache(void);
 int destroyDiskEntry(ObjectPtr object, int);
 int diskEntrySize(ObjectPtr object);
+int diskEntryComplete(ObjectPtr object);
+int diskEntryFd(ObjectPtr object, off_t *body_offset_return);
 ObjectPtr objectGetFromDisk(ObjectPtr);
 int objectFillFromDisk(ObjectPtr object, int offset, int chunks);
+int objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks);
 int writeoutMetadata(ObjectPtr object);
 int writeoutToDisk(ObjectPtr object, int upto, int max);
+int writeoutToDiskAsync(ObjectPtr object, int upto, int max);
 void dirtyDiskEntry(ObjectPtr object);
 int revalidateDiskEntry(ObjectPtr object);
 DiskObjectPtr readDiskObject(char *filename, struct stat *sb);
 void indexDiskObjects(FILE *out, const char *root, int r);
 void expireDiskObjects(void);
+void diskCachePrintStatistics(ObjectPtr object);
@@ -37,7 +37,7 @@ const int dnsUseGethostbyname = 0;
 #endif
 
 #ifndef NO_FANCY_RESOLVER
-AtomPtr dnsNameServer = NULL;
+AtomListPtr dnsNameServer = NULL;
 int dnsMaxTimeout = 60;
 #endif
 
@@ -46,6 +46,39 @@ int dnsGethostbynameTtl = 1200;
 #endif
 
 int dnsNegativeTtl = 120;
+int dnsResolutionDelay = 50;
+int dnsCacheSize = 1024;
+int dnsRefreshHits = 2;
+
+/* Resolved names are kept in a small cache of their own, rather than
+   in the object table, so that they are not evicted along with
+   instances.  An entry that is still being used shortly before it
+   expires is refreshed in the background. */
+
+typedef struct _DnsCacheEntry {
+    AtomPtr name;
+    AtomPtr addr;               /* NULL for a negative entry */
+    AtomPtr message;
+    time_t expires;
+    int ttl;
+    unsigned short hits;
+    unsigned short refreshing;
+    struct _DnsCacheEntry *hash_next;
+    struct _DnsCacheEntry *previous, *next;
+} DnsCacheEntryRec, *DnsCacheEntryPtr;
+
+typedef struct _DnsCacheRequest {
+    AtomPtr name;
+    ObjectPtr object;
+} DnsCacheRequestRec, *DnsCacheRequestPtr;
+
+static DnsCacheEntryPtr *dnsCacheTable = NULL;
+static int log2DnsCacheTableSize = 0;
+static DnsCacheEntryPtr dnsCacheMru = NULL, dnsCacheLru = NULL;
+static int dnsCacheCount = 0;
+static unsigned int dnsCacheHits = 0, dnsCacheMisses = 0;
+static unsigned int dnsCacheRefreshes = 0, dnsCacheRefreshFailures = 0;
+static unsigned int dnsCacheEvictions = 0;
 
 #ifdef HAVE_IPv6
 int dnsQueryIPv6 = 2;
@@ -62,21 +95,36 @@ typedef struct _DnsQuery {
     time_t time;
     int timeout;
     TimeEventHandlerPtr timeout_handler;
+    int server;
+    int attempts;
+    struct timeval sent;
     struct _DnsQuery *next;
 } DnsQueryRec, *DnsQueryPtr;
 
-union {
-    struct sockaddr sa;
-    struct sockaddr_in sin;
-#ifdef HAVE_IPv6
-    struct sockaddr_in6 sin6;
-#endif
-} nameserverAddress_storage;
-
 #ifndef NO_FANCY_RESOLVER
 static AtomPtr atomLocalhost, atomLocalhostDot;
 
-#define nameserverAddress nameserverAddress_storage.sa
+/* We keep a smoothed round-trip time for each name server, and send
+   queries to the fastest one.  A server that doesn't reply in time is
+   penalised, and the query is resent to the next one. */
+
+typedef struct _DnsServer {
+    AtomPtr name;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in sin;
+#ifdef HAVE_IPv6
+        struct sockaddr_in6 sin6;
+#endif
+    } addr;
+    int fd;
+    FdEventHandlerPtr handler;
+    int srtt, rttvar;           /* msecs, srtt < 0 if unknown */
+    unsigned int queries, replies, timeouts;
+} DnsServerRec, *DnsServerPtr;
+
+static DnsServerPtr dnsServers = NULL;
+static int numDnsServers = 0;
 
 static DnsQueryPtr inFlightDnsQueries;
 static DnsQueryPtr inFlightDnsQueriesLast;
@@ -100,6 +148,9 @@ static int dnsDecodeReply(char *buf, int offset, int n,
 static int dnsHandler(int status, ConditionHandlerPtr chandler);
 static int dnsGethostbynameFallback(int id, AtomPtr message);
 static int sendQuery(DnsQueryPtr query);
+static int dnsTimeoutHandler(TimeEventHandlerPtr event);
+static void dnsQueryDone(DnsQueryPtr query, AtomPtr cname, unsigned ttl,
+                         AtomPtr message);
 
 static int idSeed;
 #endif
@@ -112,7 +163,7 @@ parseResolvConf(char *filename)
     char buf[512];
     char *p, *q;
     int n;
-    AtomPtr nameserver = NULL;
+    AtomListPtr nameservers;
 
     f = fopen(filename, "r");
     if(f == NULL) {
@@ -120,6 +171,12 @@ parseResolvConf(char *filename)
         return 0;
     }
 
+    nameservers = makeAtomList(NULL, 0);
+    if(nameservers == NULL) {
+        fclose(f);
+        return 0;
+    }
+
     while(1) {
         p = fgets(buf, 512, f);
         if(p == NULL)
@@ -154,15 +211,15 @@ parseResolvConf(char *filename)
                    filename);
             continue;
         }
-        nameserver = internAtomLowerN(p, q - p);
-        break;
+        atomListCons(internAtomLowerN(p, q - p), nameservers);
     }
 
     fclose(f);
-    if(nameserver) {
-        dnsNameServer = nameserver;
+    if(nameservers->length > 0) {
+        dnsNameServer = nameservers;
         return 1;
     } else {
+        destroyAtomList(nameservers);
         return 0;
     }
 }
@@ -202,14 +259,18 @@ preinitDns()
 #ifndef WIN32
     parseResolvConf("/etc/resolv.conf");
 #endif
-    if(dnsNameServer == NULL || dnsNameServer->string[0] == '\0')
-        dnsNameServer = internAtom("127.0.0.1");
+    if(dnsNameServer == NULL || dnsNameServer->length == 0) {
+        AtomPtr localhost = internAtom("127.0.0.1");
+        dnsNameServer = makeAtomList(&localhost, 1);
+    }
     CONFIG_VARIABLE(dnsMaxTimeout, CONFIG_TIME,
                     "Max timeout for DNS queries.");
     CONFIG_VARIABLE(dnsNegativeTtl, CONFIG_TIME,
                     "TTL for negative DNS replies with no TTL.");
-    CONFIG_VARIABLE(dnsNameServer, CONFIG_ATOM_LOWER,
-                    "The name server to use.");
+    CONFIG_VARIABLE(dnsResolutionDelay, CONFIG_INT,
+                    "Msecs to wait for the second address family.");
+    CONFIG_VARIABLE(dnsNameServer, CONFIG_ATOM_LIST_LOWER,
+                    "The name servers to use.");
 #ifndef NO_STANDARD_RESOLVER
     CONFIG_VARIABLE(dnsUseGethostbyname, CONFIG_TETRASTATE,
                     "Use the system resolver.");
@@ -220,18 +281,19 @@ preinitDns()
     CONFIG_VARIABLE(dnsQueryIPv6, CONFIG_TETRASTATE,
                     "Query for IPv6 addresses.");
 #endif
+    CONFIG_VARIABLE(dnsCacheSize, CONFIG_INT,
+                    "Max number of names in the DNS cache.");
+    CONFIG_VARIABLE(dnsRefreshHits, CONFIG_INT,
+                    "Lookups needed before a name is refreshed early.");
 }
 
 void
 initDns()
 {
 #ifndef NO_FANCY_RESOLVER
-    int rc;
+    int i, rc;
     struct timeval t;
-    struct sockaddr_in *sin = (struct sockaddr_in*)&nameserverAddress;
-#ifdef HAVE_IPv6
-    struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&nameserverAddress;
-#endif
+    DnsServerPtr server;
 
     atomLocalhost = internAtom("localhost");
     atomLocalhostDot = internAtom("localhost.");
@@ -240,21 +302,455 @@ initDns()
 
     gettimeofday(&t, NULL);
     idSeed = t.tv_usec & 0xFFFF;
-    sin->sin_family = AF_INET;
-    sin->sin_port = htons(53);
-    rc = inet_aton(dnsNameServer->string, &sin->sin_addr);
+
+    if(dnsNameServer == NULL || dnsNameServer->length == 0) {
+        do_log(L_WARN, "DNS: no name server configured.\n");
+    } else {
+        dnsServers = calloc(dnsNameServer->length, sizeof(DnsServerRec));
+        if(dnsServers == NULL) {
+            do_log(L_ERROR, "DNS: couldn't allocate name servers.\n");
+            exit(1);
+        }
+        for(i = 0; i < dnsNameServer->length; i++) {
+            server = &dnsServers[i];
+            server->name = dnsNameServer->list[i];
+            server->addr.sin.sin_family = AF_INET;
+            server->addr.sin.sin_port = htons(53);
+            rc = inet_aton(server->name->string,
+                           &server->addr.sin.sin_addr);
 #ifdef HAVE_IPv6
-    if(rc != 1) {
-        sin6->sin6_family = AF_INET6;
-        sin6->sin6_port = htons(53);
-        rc = inet_pton(AF_INET6, dnsNameServer->string, &sin6->sin6_addr);
+            if(rc != 1) {
+                server->addr.sin6.sin6_family = AF_INET6;
+                server->addr.sin6.sin6_port = htons(53);
+                rc = inet_pton(AF_INET6, server->name->string,
+                               &server->addr.sin6.sin6_addr);
+            }
+#endif
+            if(rc != 1) {
+                do_log(L_ERROR, "DNS: couldn't parse name server %s.\n",
+                       server->name->string);
+                exit(1);
+            }
+            server->fd = -1;
+            server->handler = NULL;
+            server->srtt = -1;
+            server->rttvar = 0;
+        }
+        numDnsServers = dnsNameServer->length;
     }
 #endif
-    if(rc != 1) {
-        do_log(L_ERROR, "DNS: couldn't parse name server %s.\n",
-               dnsNameServer->string);
-        exit(1);
+
+    if(dnsCacheSize > 0) {
+        while((1 << log2DnsCacheTableSize) < dnsCacheSize &&
+              log2DnsCacheTableSize < 20)
+            log2DnsCacheTableSize++;
+        dnsCacheTable = calloc(1 << log2DnsCacheTableSize,
+                               sizeof(DnsCacheEntryPtr));
+        if(dnsCacheTable == NULL) {
+            do_log(L_ERROR, "Couldn't allocate DNS cache.\n");
+            dnsCacheSize = 0;
+        }
     }
+}
+
+static DnsCacheEntryPtr *
+dnsCacheBucket(AtomPtr name)
+{
+    return &dnsCacheTable[hash(0, name->string, name->length,
+                               log2DnsCacheTableSize)];
+}
+
+static void
+dnsCacheUnlink(DnsCacheEntryPtr entry)
+{
+    if(entry->previous)
+        entry->previous->next = entry->next;
+    else
+        dnsCacheMru = entry->next;
+    if(entry->next)
+        entry->next->previous = entry->previous;
+    else
+        dnsCacheLru = entry->previous;
+}
+
+static void
+dnsCacheLink(DnsCacheEntryPtr entry)
+{
+    entry->previous = NULL;
+    entry->next = dnsCacheMru;
+    if(dnsCacheMru)
+        dnsCacheMru->previous = entry;
+    else
+        dnsCacheLru = entry;
+    dnsCacheMru = entry;
+}
+
+static void
+dnsCacheRemove(DnsCacheEntryPtr entry)
+{
+    DnsCacheEntryPtr *p = dnsCacheBucket(entry->name);
+
+    while(*p != entry) {
+        assert(*p != NULL);
+        p = &(*p)->hash_next;
+    }
+    *p = entry->hash_next;
+    dnsCacheUnlink(entry);
+    dnsCacheCount--;
+
+    releaseAtom(entry->name);
+    releaseAtom(entry->addr);
+    releaseAtom(entry->message);
+    free(entry);
+}
+
+static DnsCacheEntryPtr
+dnsCacheFind(AtomPtr name)
+{
+    DnsCacheEntryPtr entry;
+
+    if(dnsCacheTable == NULL)
+        return NULL;
+
+    entry = *dnsCacheBucket(name);
+    while(entry) {
+        if(entry->name == name)
+            break;
+        entry = entry->hash_next;
+    }
+    if(entry == NULL)
+        return NULL;
+
+    if(entry->expires <= current_time.tv_sec) {
+        dnsCacheRemove(entry);
+        return NULL;
+    }
+
+    dnsCacheUnlink(entry);
+    dnsCacheLink(entry);
+    return entry;
+}
+
+/* Make a new, empty entry for name, evicting the least recently used
+   one if the cache is full. */
+
+static DnsCacheEntryPtr
+dnsCacheInsert(AtomPtr name)
+{
+    DnsCacheEntryPtr entry;
+    DnsCacheEntryPtr *bucket;
+
+    if(dnsCacheCount >= dnsCacheSize) {
+        dnsCacheEvictions++;
+        dnsCacheRemove(dnsCacheLru);
+    }
+    entry = malloc(sizeof(DnsCacheEntryRec));
+    if(entry == NULL) {
+        do_log(L_ERROR, "Couldn't allocate DNS cache entry.\n");
+        return NULL;
+    }
+    entry->name = retainAtom(name);
+    entry->addr = NULL;
+    entry->message = NULL;
+    entry->expires = 0;
+    entry->ttl = 0;
+    entry->hits = 0;
+    entry->refreshing = 0;
+    bucket = dnsCacheBucket(name);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    dnsCacheLink(entry);
+    dnsCacheCount++;
+    return entry;
+}
+
+/* Record the outcome of a finished lookup.  Like the object table
+   did before, we keep positive answers and authoritative negative
+   ones, but not timeouts or local errors. */
+
+static void
+dnsCacheStore(AtomPtr name, ObjectPtr object)
+{
+    DnsCacheEntryPtr entry;
+    int positive = object->headers && object->headers->length > 0;
+
+    if(dnsCacheTable == NULL)
+        return;
+
+    entry = *dnsCacheBucket(name);
+    while(entry) {
+        if(entry->name == name)
+            break;
+        entry = entry->hash_next;
+    }
+
+    if(entry && entry->refreshing) {
+        entry->refreshing = 0;
+        if(!positive && entry->addr &&
+           entry->expires > current_time.tv_sec) {
+            /* Keep serving the old addresses until they expire. */
+            dnsCacheRefreshFailures++;
+            goto done;
+        }
+    }
+
+    if(!positive &&
+       (!(object->flags & OBJECT_ABORTED) ||
+        object->expires <= current_time.tv_sec)) {
+        if(entry)
+            dnsCacheRemove(entry);
+        goto done;
+    }
+
+    if(entry == NULL) {
+        entry = dnsCacheInsert(name);
+        if(entry == NULL)
+            goto done;
+    }
+
+    releaseAtom(entry->addr);
+    releaseAtom(entry->message);
+    entry->addr = positive ? retainAtom(object->headers) : NULL;
+    entry->message = object->message ? retainAtom(object->message) : NULL;
+    entry->expires = object->expires;
+    entry->ttl = object->expires - current_time.tv_sec;
+    entry->hits = 0;
+
+ done:
+    /* The cache is authoritative from now on. */
+    privatiseObject(object, 0);
+}
+
+static int
+dnsCacheHandler(int status, ConditionHandlerPtr chandler)
+{
+    DnsCacheRequestPtr request = (DnsCacheRequestPtr)chandler->data;
+
+    if(request->object->flags & OBJECT_INPROGRESS)
+        return 0;
+
+    dnsCacheStore(request->name, request->object);
+    releaseAtom(request->name);
+    releaseObject(request->object);
+    return 1;
+}
+
+/* Arrange for the result of the lookup being done by object to end
+   up in the cache. */
+
+static void
+dnsCacheWatch(AtomPtr name, ObjectPtr object)
+{
+    DnsCacheRequestRec request;
+    ConditionHandlerPtr chandler;
+
+    if(dnsCacheTable == NULL)
+        return;
+
+    if(!(object->flags & OBJECT_INITIAL)) {
+        dnsCacheStore(name, object);
+        return;
+    }
+
+    request.name = retainAtom(name);
+    request.object = retainObject(object);
+    chandler = conditionWait(&object->condition, dnsCacheHandler,
+                             sizeof(request), &request);
+    if(chandler == NULL) {
+        do_log(L_ERROR, "Couldn't schedule DNS cache handler.\n");
+        releaseAtom(request.name);
+        releaseObject(request.object);
+    }
+}
+
+static int
+really_do_lookup(AtomPtr name, ObjectPtr object)
+{
+    if(dnsUseGethostbyname >= 3)
+        return really_do_gethostbyname(name, object);
+    else
+        return really_do_dns(name, object);
+}
+
+static void
+dnsCacheRefresh(DnsCacheEntryPtr entry)
+{
+    AtomPtr name = entry->name;
+    ObjectPtr object;
+    int rc;
+
+    object = findObject(OBJECT_DNS, name->string, name->length);
+    if(object) {
+        /* Somebody is already on it. */
+        releaseObject(object);
+        return;
+    }
+
+    object = makeObject(OBJECT_DNS, name->string, name->length,
+                        1, 0, NULL, NULL);
+    if(object == NULL) {
+        do_log(L_ERROR, "Couldn't allocate DNS object.\n");
+        return;
+    }
+
+    do_log(D_DNS, "DNS: refreshing %s (%d lookups, %ds left).\n",
+           scrub(name->string), entry->hits,
+           (int)(entry->expires - current_time.tv_sec));
+    entry->refreshing = 1;
+    dnsCacheRefreshes++;
+    rc = really_do_lookup(name, object);
+    if(rc < 0) {
+        entry->refreshing = 0;
+        dnsCacheRefreshFailures++;
+        releaseNotifyObject(object);
+        return;
+    }
+    /* This may replace entry. */
+    dnsCacheWatch(name, object);
+    releaseObject(object);
+}
+
+/* The cache is saved across restarts as one line per positive entry,
+   least recently used first, so that reading it back preserves the
+   LRU order:  name, absolute expiry time, ttl, hits, address atom in
+   hex.  Negative entries are not worth keeping. */
+
+int
+dnsWriteState(FILE *out)
+{
+    DnsCacheEntryPtr entry;
+    int i, n = 0;
+
+    for(entry = dnsCacheLru; entry; entry = entry->previous) {
+        if(entry->addr == NULL || entry->addr->length == 0 ||
+           entry->expires <= current_time.tv_sec)
+            continue;
+        for(i = 0; i < entry->name->length; i++)
+            if(entry->name->string[i] <= ' ' ||
+               entry->name->string[i] >= 127)
+                break;
+        if(i < entry->name->length || i == 0)
+            continue;
+        fprintf(out, "dns %s %ld %d %u ", entry->name->string,
+                (long)entry->expires, entry->ttl, (unsigned)entry->hits);
+        for(i = 0; i < entry->addr->length; i++)
+            fprintf(out, "%02x", (unsigned char)entry->addr->string[i]);
+        fprintf(out, "\n");
+        n++;
+    }
+    return n;
+}
+
+int
+dnsReadState(char *line)
+{
+    char name[256];
+    char buf[1024];
+    long expires;
+    int ttl, n, len;
+    unsigned hits;
+    char *p;
+    int i;
+    AtomPtr atom;
+    DnsCacheEntryPtr entry;
+
+    if(dnsCacheTable == NULL)
+        return 0;
+
+    if(sscanf(line, "%255s %ld %d %u %n", name, &expires, &ttl, &hits, &n) < 4)
+        return -1;
+    if(expires <= current_time.tv_sec)
+        return 0;
+
+    if(ttl <= 0)
+        return -1;
+    /* Don't trust a clock that went backwards. */
+    expires = MIN(expires, current_time.tv_sec + ttl);
+
+    p = line + n;
+    len = 0;
+    while(h2i(p[0]) >= 0 && h2i(p[1]) >= 0 && len < 1024) {
+        buf[len++] = (h2i(p[0]) << 4) | h2i(p[1]);
+        p += 2;
+    }
+    if(len == 0 || (*p != '\0' && *p != '\n'))
+        return -1;
+
+    /* The file may be truncated or edited by hand; do_connect and
+       the CNAME code trust the address atom to be well formed. */
+    if(buf[0] == DNS_A) {
+        if(len <= 1 || (len - 1) % sizeof(HostAddressRec) != 0)
+            return -1;
+        for(i = 1; i < len; i += sizeof(HostAddressRec))
+            if(buf[i] != 4 && buf[i] != 6)
+                return -1;
+    } else if(buf[0] == DNS_CNAME) {
+        if(len <= 1)
+            return -1;
+        for(i = 1; i < len; i++)
+            if(buf[i] <= ' ' || buf[i] >= 127)
+                return -1;
+    } else {
+        return -1;
+    }
+
+    atom = internAtom(name);
+    if(atom == NULL)
+        return -1;
+    entry = dnsCacheFind(atom);
+    if(entry == NULL)
+        entry = dnsCacheInsert(atom);
+    releaseAtom(atom);
+    if(entry == NULL)
+        return -1;
+
+    releaseAtom(entry->addr);
+    entry->addr = internAtomN(buf, len);
+    if(entry->addr == NULL) {
+        dnsCacheRemove(entry);
+        return -1;
+    }
+    entry->expires = expires;
+    entry->ttl = ttl;
+    entry->hits = MIN(hits, 0xFFFF);
+    return 1;
+}
+
+void
+dnsPrintStatistics(ObjectPtr object)
+{
+#ifndef NO_FANCY_RESOLVER
+    int i;
+#endif
+
+    if(dnsCacheTable)
+        objectPrintf(object, object->size,
+                     "<p>The DNS cache holds %d names (max %d).  "
+                     "There were %u hits and %u misses, "
+                     "%u evictions, and %u background refreshes "
+                     "(%u failed).</p>\n",
+                     dnsCacheCount, dnsCacheSize,
+                     dnsCacheHits, dnsCacheMisses,
+                     dnsCacheEvictions, dnsCacheRefreshes,
+                     dnsCacheRefreshFailures);
+
+#ifndef NO_FANCY_RESOLVER
+    if(dnsUseGethostbyname >= 3 || numDnsServers <= 0)
+        return;
+    objectPrintf(object, object->size, "<p>Name servers:</p>\n<ul>\n");
+    for(i = 0; i < numDnsServers; i++) {
+        DnsServerPtr server = &dnsServers[i];
+        objectPrintf(object, object->size,
+                     "<li>%s: %u queries, %u replies, %u timeouts",
+                     server->name->string,
+                     server->queries, server->replies, server->timeouts);
+        if(server->srtt >= 0)
+            objectPrintf(object, object->size,
+                         ", RTT %dms &plusmn; %dms",
+                         server->srtt, server->rttvar);
+        objectPrintf(object, object->size, ".</li>\n");
+    }
+    objectPrintf(object, object->size, "</ul>\n");
 #endif
 }
 
@@ -268,6 +764,7 @@ do_gethostbyname(char *origname,
     int n = strlen(origname);
     AtomPtr name;
     GethostbynameRequestRec request;
+    DnsCacheEntryPtr entry;
     int done, rc;
 
     memset(&request, 0, sizeof(request));
@@ -315,6 +812,31 @@ do_gethostbyname(char *origname,
     request.handler = handler;
     request.data = data;
 
+    entry = dnsCacheFind(name);
+    if(entry) {
+        dnsCacheHits++;
+        if(entry->hits < 0xFFFF)
+            entry->hits++;
+        if(entry->addr && !entry->refreshing &&
+           dnsRefreshHits >= 0 && entry->hits >= dnsRefreshHits &&
+           entry->expires - current_time.tv_sec <= MAX(entry->ttl / 10, 1))
+            dnsCacheRefresh(entry);
+        if(entry->addr) {
+            request.addr = retainAtom(entry->addr);
+            done = handler(1, &request);
+        } else {
+            request.error_message = retainAtom(entry->message);
+            done = handler(-EDNS_HOST_NOT_FOUND, &request);
+        }
+        assert(done);
+        releaseAtom(request.addr); request.addr = NULL;
+        releaseAtom(request.name); request.name = NULL;
+        releaseAtom(request.error_message); request.error_message = NULL;
+        return 1;
+    }
+    if(dnsCacheTable)
+        dnsCacheMisses++;
+
     object = findObject(OBJECT_DNS, name->string, name->length);
     if(object == NULL || objectMustRevalidate(object, NULL)) {
         if(object) {
@@ -336,14 +858,12 @@ do_gethostbyname(char *origname,
 
     if((object->flags & (OBJECT_INITIAL | OBJECT_INPROGRESS)) ==
        OBJECT_INITIAL) {
-        if(dnsUseGethostbyname >= 3)
-            rc = really_do_gethostbyname(name, object);
-        else
-            rc = really_do_dns(name, object);
+        rc = really_do_lookup(name, object);
         if(rc < 0) {
             assert(!(object->flags & (OBJECT_INITIAL | OBJECT_INPROGRESS)));
             goto fail;
         }
+        dnsCacheWatch(name, object);
     }
 
     if(dnsUseGethostbyname >= 3)
@@ -728,8 +1248,10 @@ really_do_gethostbyname(AtomPtr name, ObjectPtr object)
 
 #ifndef NO_FANCY_RESOLVER
 
-static int dnsSocket = -1;
-static FdEventHandlerPtr dnsSocketHandler = NULL;
+static int dnsPickServer(int exclude);
+static int dnsServerTimeout(int i);
+static void dnsServerFailed(int i, int msecs);
+static void dnsFailover(int i);
 
 static int
 dnsHandler(int status, ConditionHandlerPtr chandler)
@@ -809,6 +1331,19 @@ findQuery(int id, AtomPtr name)
     return NULL;
 }
 
+/* True if we got some addresses for query, but are still waiting for
+   the other family. */
+
+static int
+dnsQueryPartial(DnsQueryPtr query)
+{
+    if(query->inet4 && query->inet4->length > 0)
+        return query->inet6 == NULL && dnsQueryIPv6 > 0;
+    if(query->inet6 && query->inet6->length > 0)
+        return query->inet4 == NULL && dnsQueryIPv6 < 3;
+    return 0;
+}
+
 static int
 dnsTimeoutHandler(TimeEventHandlerPtr event)
 {
@@ -823,6 +1358,46 @@ dnsTimeoutHandler(TimeEventHandlerPtr event)
         return 1;
     }
 
+    /* This handler is freed by our caller. */
+    query->timeout_handler = NULL;
+
+    if(dnsQueryPartial(query)) {
+        /* Give up on the missing family, and go with what we've got.
+           Make sure it's asked again soon. */
+        do_log(D_DNS, "DNS: %s: giving up on %s.\n",
+               scrub(query->name->string), query->inet4 ? "AAAA" : "A");
+        if(query->inet4)
+            query->ttl4 = MIN(query->ttl4,
+                              current_time.tv_sec + dnsNegativeTtl);
+        if(query->inet6)
+            query->ttl6 = MIN(query->ttl6,
+                              current_time.tv_sec + dnsNegativeTtl);
+        dnsQueryDone(query, NULL, 0, NULL);
+        return 1;
+    }
+
+    dnsServerFailed(query->server,
+                    timeval_minus_usec(&current_time, &query->sent) / 1000);
+    query->server = dnsPickServer(query->server);
+    query->attempts++;
+
+    if(query->attempts < numDnsServers) {
+        /* Try every server once before backing off. */
+        rc = sendQuery(query);
+        if(rc < 0 && rc != -EWOULDBLOCK && rc != -EAGAIN && rc != -ENOBUFS)
+            do_log_error(L_WARN, -rc, "Couldn't send DNS query");
+        query->timeout_handler =
+            scheduleTimeEventMsec(dnsServerTimeout(query->server),
+                                  dnsTimeoutHandler, sizeof(query), &query);
+        if(query->timeout_handler == NULL) {
+            do_log(L_ERROR, "Couldn't schedule DNS timeout handler.\n");
+            abortObject(object, 501,
+                        internAtom("Couldn't schedule DNS timeout handler"));
+            goto fail;
+        }
+        return 1;
+    }
+
     query->timeout = MAX(10, query->timeout * 2);
 
     if(query->timeout > dnsMaxTimeout) {
@@ -862,11 +1437,12 @@ dnsTimeoutHandler(TimeEventHandlerPtr event)
 }
 
 static int
-establishDnsSocket()
+establishDnsSocket(int i)
 {
+    DnsServerPtr server = &dnsServers[i];
     int rc;
 #ifdef HAVE_IPv6
-    int inet6 = (nameserverAddress.sa_family == AF_INET6);
+    int inet6 = (server->addr.sa.sa_family == AF_INET6);
     int pf = inet6 ? PF_INET6 : PF_INET;
     int sa_size = 
         inet6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
@@ -875,30 +1451,31 @@ establishDnsSocket()
     int sa_size = sizeof(struct sockaddr_in);
 #endif
 
-    if(dnsSocket < 0) {
-        assert(!dnsSocketHandler);
-        dnsSocket = socket(pf, SOCK_DGRAM, 0);
-        if(dnsSocket < 0) {
+    if(server->fd < 0) {
+        assert(!server->handler);
+        server->fd = socket(pf, SOCK_DGRAM, 0);
+        if(server->fd < 0) {
             do_log_error(L_ERROR, errno, "Couldn't create DNS socket");
             return -errno;
         }
 
-        rc = connect(dnsSocket, &nameserverAddress, sa_size);
+        rc = connect(server->fd, &server->addr.sa, sa_size);
         if(rc < 0) {
-            CLOSE(dnsSocket);
-            dnsSocket = -1;
+            CLOSE(server->fd);
+            server->fd = -1;
             do_log_error(L_ERROR, errno, "Couldn't create DNS \"connection\"");
             return -errno;
         }
     }
 
-    if(!dnsSocketHandler) {
-        dnsSocketHandler = 
-            registerFdEvent(dnsSocket, POLLIN, dnsReplyHandler, 0, NULL);
-        if(dnsSocketHandler == NULL) {
+    if(!server->handler) {
+        server->handler = 
+            registerFdEvent(server->fd, POLLIN, dnsReplyHandler,
+                            sizeof(i), &i);
+        if(server->handler == NULL) {
             do_log(L_ERROR, "Couldn't register DNS socket handler.\n");
-            CLOSE(dnsSocket);
-            dnsSocket = -1;
+            CLOSE(server->fd);
+            server->fd = -1;
             return -ENOMEM;
         }
     }
@@ -906,6 +1483,97 @@ establishDnsSocket()
     return 1;
 }
 
+/* Choose the server with the lowest smoothed RTT, preferring servers
+   we know nothing about yet.  The servers not chosen age slowly, so
+   that one that has been penalised gets another chance eventually. */
+
+static int
+dnsPickServer(int exclude)
+{
+    int i, best = -1;
+
+    for(i = 0; i < numDnsServers; i++) {
+        if(i == exclude && numDnsServers > 1)
+            continue;
+        if(best < 0 || dnsServers[i].srtt < dnsServers[best].srtt)
+            best = i;
+    }
+
+    for(i = 0; i < numDnsServers; i++) {
+        if(i != best && dnsServers[i].srtt > 0)
+            dnsServers[i].srtt -= (dnsServers[i].srtt + 63) / 64;
+    }
+    return best;
+}
+
+/* How long to wait for server before trying the next one, in msecs. */
+
+static int
+dnsServerTimeout(int i)
+{
+    DnsServerPtr server = &dnsServers[i];
+    if(server->srtt < 0)
+        return 1000;
+    return MIN(MAX(server->srtt + 4 * server->rttvar, 200), 4000);
+}
+
+static void
+dnsServerRtt(int i, int rtt)
+{
+    DnsServerPtr server = &dnsServers[i];
+    int delta;
+
+    if(server->srtt < 0) {
+        server->srtt = rtt;
+        server->rttvar = rtt / 2;
+    } else {
+        delta = rtt - server->srtt;
+        server->srtt += delta / 8;
+        server->rttvar += (abs(delta) - server->rttvar) / 4;
+    }
+}
+
+static void
+dnsServerFailed(int i, int msecs)
+{
+    DnsServerPtr server = &dnsServers[i];
+
+    server->timeouts++;
+    server->srtt = MIN(MAX(2 * server->srtt, msecs), 60000);
+    do_log(D_DNS, "DNS: name server %s penalised, srtt %dms.\n",
+           server->name->string, server->srtt);
+}
+
+/* Server i is unusable; move the queries waiting on it elsewhere. */
+
+static void
+dnsFailover(int i)
+{
+    DnsQueryPtr query;
+    TimeEventHandlerPtr handler;
+    int rc;
+
+    for(query = inFlightDnsQueries; query; query = query->next) {
+        if(query->server != i)
+            continue;
+        query->server = dnsPickServer(i);
+        if(query->server == i)
+            continue;
+        rc = sendQuery(query);
+        if(rc < 0)
+            continue;
+        if(query->timeout_handler) {
+            handler = scheduleTimeEventMsec(dnsServerTimeout(query->server),
+                                            dnsTimeoutHandler,
+                                            sizeof(query), &query);
+            if(handler) {
+                cancelTimeEvent(query->timeout_handler);
+                query->timeout_handler = handler;
+            }
+        }
+    }
+}
+
 static int
 sendQuery(DnsQueryPtr query)
 {
@@ -914,9 +1582,14 @@ sendQuery(DnsQueryPtr query)
     int rc;
     int af[2];
     int i;
+    DnsServerPtr server;
 
-    if(dnsSocket < 0)
-        return -1;
+    rc = establishDnsSocket(query->server);
+    if(rc < 0)
+        return rc;
+    server = &dnsServers[query->server];
+    server->queries++;
+    query->sent = current_time;
 
     if(dnsQueryIPv6 <= 0) {
         af[0] = 4; af[1] = 0;
@@ -940,7 +1613,7 @@ sendQuery(DnsQueryPtr query)
             return buflen;
         }
 
-        rc = send(dnsSocket, buf, buflen, 0);
+        rc = send(server->fd, buf, buflen, 0);
         if(rc < buflen) {
             if(rc >= 0) {
                 do_log(L_ERROR, "Couldn't send DNS query: partial send.\n");
@@ -958,6 +1631,7 @@ static int
 really_do_dns(AtomPtr name, ObjectPtr object)
 {
     int rc;
+    int server;
     DnsQueryPtr query;
     AtomPtr message = NULL;
     int id;
@@ -1017,7 +1691,12 @@ really_do_dns(AtomPtr name, ObjectPtr object)
         return 0;
     }
 
-    rc = establishDnsSocket();
+    if(numDnsServers <= 0) {
+        message = internAtom("No name server configured");
+        goto fallback;
+    }
+    server = dnsPickServer(-1);
+    rc = establishDnsSocket(server);
     if(rc < 0) {
         do_log_error(L_ERROR, -rc, "Couldn't establish DNS socket.\n");
         message = internAtomError(-rc, "Couldn't establish DNS socket");
@@ -1042,11 +1721,18 @@ really_do_dns(AtomPtr name, ObjectPtr object)
     query->object = retainObject(object);
     query->timeout = 4;
     query->timeout_handler = NULL;
+    query->server = server;
+    query->attempts = 0;
     query->next = NULL;
 
-    query->timeout_handler = 
-        scheduleTimeEvent(query->timeout, dnsTimeoutHandler,
-                          sizeof(query), &query);
+    if(numDnsServers > 1)
+        query->timeout_handler =
+            scheduleTimeEventMsec(dnsServerTimeout(server), dnsTimeoutHandler,
+                                  sizeof(query), &query);
+    else
+        query->timeout_handler =
+            scheduleTimeEvent(query->timeout, dnsTimeoutHandler,
+                              sizeof(query), &query);
     if(query->timeout_handler == NULL) {
         do_log(L_ERROR, "Couldn't schedule DNS timeout handler.\n");
         message = internAtom("Couldn't schedule DNS timeout handler");
@@ -1085,13 +1771,87 @@ really_do_dns(AtomPtr name, ObjectPtr object)
     }
 }
 
+static void
+dnsQueryDone(DnsQueryPtr query, AtomPtr cname, unsigned ttl, AtomPtr message)
+{
+    ObjectPtr object;
+
+    if(query->timeout_handler)
+        cancelTimeEvent(query->timeout_handler);
+    object = query->object;
+
+    if(object->flags & OBJECT_INITIAL) {
+        assert(!object->headers);
+        if(cname) {
+            assert(query->inet4 == NULL && query->inet6 == NULL);
+            object->headers = cname;
+            object->expires = current_time.tv_sec + ttl;
+        } else if((!query->inet4 || query->inet4->length == 0) &&
+                  (!query->inet6 || query->inet6->length == 0)) {
+            releaseAtom(query->inet4);
+            releaseAtom(query->inet6);
+            abortObject(object, 500, retainAtom(message));
+            object->expires = current_time.tv_sec + dnsNegativeTtl;
+        } else if(!query->inet4 || query->inet4->length == 0) {
+            object->headers = query->inet6;
+            object->expires = query->ttl6;
+            releaseAtom(query->inet4);
+        } else if(!query->inet6 || query->inet6->length == 0) {
+            object->headers = query->inet4;
+            object->expires = query->ttl4;
+            releaseAtom(query->inet6);
+        } else {
+            /* need to merge results */
+            char buf[1024];
+            /* Local failures must not be cached as negative answers,
+               so they expire straight away. */
+            object->expires = current_time.tv_sec;
+            if(query->inet4->length + query->inet6->length > 1024) {
+                releaseAtom(query->inet4);
+                releaseAtom(query->inet6);
+                abortObject(object, 500, internAtom("DNS reply too long"));
+            } else {
+                if(dnsQueryIPv6 <= 1) {
+                    memcpy(buf, query->inet4->string, query->inet4->length);
+                    memcpy(buf + query->inet4->length,
+                           query->inet6->string + 1, query->inet6->length - 1);
+                } else {
+                    memcpy(buf, query->inet6->string, query->inet6->length);
+                    memcpy(buf + query->inet6->length,
+                           query->inet4->string + 1, query->inet4->length - 1);
+                }
+                object->headers =
+                    internAtomN(buf, 
+                                query->inet4->length + 
+                                query->inet6->length - 1);
+                if(object->headers == NULL)
+                    abortObject(object, 500, 
+                                internAtom("Couldn't allocate DNS atom"));
+                else
+                    object->expires = MIN(query->ttl4, query->ttl6);
+            }
+        }
+        object->age = current_time.tv_sec;
+        object->flags &= ~(OBJECT_INITIAL | OBJECT_INPROGRESS);
+    } else {
+        do_log(L_WARN, "DNS object ex nihilo for %s.\n",
+               scrub(query->name->string));
+    }
+    
+    removeQuery(query);
+    free(query);
+
+    releaseAtom(message);
+    releaseNotifyObject(object);
+}
+
 static int
 dnsReplyHandler(int abort, FdEventHandlerPtr event)
 {
     int fd = event->fd;
+    int i = *(int*)event->data;
     char buf[2048];
     int len, rc;
-    ObjectPtr object;
     unsigned ttl = 0;
     AtomPtr name, value, message = NULL;
     int id;
@@ -1100,8 +1860,8 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
     AtomPtr cname = NULL;
 
     if(abort) {
-        dnsSocketHandler = NULL;
-        rc = establishDnsSocket();
+        dnsServers[i].handler = NULL;
+        rc = establishDnsSocket(i);
         if(rc < 0) {
             do_log(L_ERROR, "Couldn't reestablish DNS socket.\n");
             /* At this point, we should abort all in-flight
@@ -1114,8 +1874,14 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
     if(len <= 0) {
         if(errno == EINTR || errno == EAGAIN) return 0;
         /* This is where we get ECONNREFUSED for an ICMP port unreachable */
-        do_log_error(L_ERROR, errno, "DNS: recv failed");
-        dnsGethostbynameFallback(-1, message);
+        do_log_error(L_ERROR, errno, "DNS: recv from %s failed",
+                     dnsServers[i].name->string);
+        if(numDnsServers > 1) {
+            dnsServerFailed(i, 1000);
+            dnsFailover(i);
+        } else {
+            dnsGethostbynameFallback(-1, message);
+        }
         return 0;
     }
 
@@ -1132,6 +1898,7 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
     if(!findQuery(id, NULL)) {
         return 0;
     }
+    dnsServers[i].replies++;
 
     rc = dnsDecodeReply(buf, 0, len, &id, &name, &value, &af, &ttl);
     if(rc < 0) {
@@ -1163,6 +1930,9 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
         return 0;
     }
 
+    if(query->server == i)
+        dnsServerRtt(i, timeval_minus_usec(&current_time, &query->sent) / 1000);
+
     /* We're going to use the information in this reply.  If it was an
        error, construct an empty atom to distinguish it from information
        we're still waiting for. */
@@ -1207,74 +1977,23 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
 
     if(rc >= 0 && !cname &&
        ((dnsQueryIPv6 < 3 && query->inet4 == NULL) ||
-        (dnsQueryIPv6 > 0 && query->inet6 == NULL)))
-        return 0;
-
-    /* This query is complete */
-
-    cancelTimeEvent(query->timeout_handler);
-    object = query->object;
-
-    if(object->flags & OBJECT_INITIAL) {
-        assert(!object->headers);
-        if(cname) {
-            assert(query->inet4 == NULL && query->inet6 == NULL);
-            object->headers = cname;
-            object->expires = current_time.tv_sec + ttl;
-        } else if((!query->inet4 || query->inet4->length == 0) &&
-                  (!query->inet6 || query->inet6->length == 0)) {
-            releaseAtom(query->inet4);
-            releaseAtom(query->inet6);
-            object->expires = current_time.tv_sec + dnsNegativeTtl;
-            abortObject(object, 500, retainAtom(message));
-        } else if(!query->inet4 || query->inet4->length == 0) {
-            object->headers = query->inet6;
-            object->expires = query->ttl6;
-            releaseAtom(query->inet4);
-        } else if(!query->inet6 || query->inet6->length == 0) {
-            object->headers = query->inet4;
-            object->expires = query->ttl4;
-            releaseAtom(query->inet6);
-        } else {
-            /* need to merge results */
-            char buf[1024];
-            if(query->inet4->length + query->inet6->length > 1024) {
-                releaseAtom(query->inet4);
-                releaseAtom(query->inet6);
-                abortObject(object, 500, internAtom("DNS reply too long"));
-            } else {
-                if(dnsQueryIPv6 <= 1) {
-                    memcpy(buf, query->inet4->string, query->inet4->length);
-                    memcpy(buf + query->inet4->length,
-                           query->inet6->string + 1, query->inet6->length - 1);
-                } else {
-                    memcpy(buf, query->inet6->string, query->inet6->length);
-                    memcpy(buf + query->inet6->length,
-                           query->inet4->string + 1, query->inet4->length - 1);
-                }
-                object->headers =
-                    internAtomN(buf, 
-                                query->inet4->length + 
-                                query->inet6->length - 1);
-                if(object->headers == NULL)
-                    abortObject(object, 500, 
-                                internAtom("Couldn't allocate DNS atom"));
-            }
-            object->expires = MIN(query->ttl4, query->ttl6);
+        (dnsQueryIPv6 > 0 && query->inet6 == NULL))) {
+        /* We have addresses for one family.  Don't let a slow or lost
+           reply for the other one hold up the connection for a full
+           retransmission timeout -- see dnsTimeoutHandler. */
+        if(dnsResolutionDelay >= 0 && dnsQueryPartial(query)) {
+            if(query->timeout_handler)
+                cancelTimeEvent(query->timeout_handler);
+            query->timeout_handler =
+                scheduleTimeEventMsec(dnsResolutionDelay, dnsTimeoutHandler,
+                                      sizeof(query), &query);
         }
-        object->age = current_time.tv_sec;
-        object->flags &= ~(OBJECT_INITIAL | OBJECT_INPROGRESS);
-    } else {
-        do_log(L_WARN, "DNS object ex nihilo for %s.\n",
-               scrub(query->name->string));
+        return 0;
     }
-    
-    removeQuery(query);
-    free(query);
 
+    /* This query is complete */
+    dnsQueryDone(query, cname, ttl, message);
     releaseAtom(name);
-    releaseAtom(message);
-    releaseNotifyObject(object);
     return 0;
 }
 
@@ -46,3 +46,6 @@ void preinitDns(void);
 void initDns(void);
 int do_gethostbyname(char *name, int count,
                      int (*handler)(int, GethostbynameRequestPtr), void *data);
+void dnsPrintStatistics(ObjectPtr object);
+int dnsWriteState(FILE *out);
+int dnsReadState(char *line);
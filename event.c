@@ -22,6 +22,16 @@ THE SOFTWARE.
 
 #include "polipo.h"
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <endian.h>
+#include <linux/io_uring.h>
+#endif
+
 #ifdef HAVE_FORK
 static volatile sig_atomic_t exitFlag = 0;
 #else
@@ -29,8 +39,27 @@ static int exitFlag = 0;
 #endif
 static int in_signalCondition = 0;
 
+/* Time events that are due during the current second live in
+   timeEventQueue, which is sorted.  Events further in the future are
+   kept, unsorted, in a hierarchical timing wheel: level l has
+   TIME_WHEEL_SIZE slots, each spanning TIME_WHEEL_SIZE^l seconds.
+   An event at level l agrees with timeWheelTime on all the digits
+   above l, and its digit at level l is strictly larger.  As time goes
+   by, slots are cascaded to the level below, and eventually into
+   timeEventQueue.  Both insertion and cancellation are O(1). */
+
+#define TIME_WHEEL_BITS 6
+#define TIME_WHEEL_SIZE (1 << TIME_WHEEL_BITS)
+#define TIME_WHEEL_MASK (TIME_WHEEL_SIZE - 1)
+#define TIME_WHEEL_LEVELS 4
+
 static TimeEventHandlerPtr timeEventQueue;
 static TimeEventHandlerPtr timeEventQueueLast;
+static TimeEventHandlerPtr timeWheel[TIME_WHEEL_LEVELS][TIME_WHEEL_SIZE];
+/* Events that are too far in the future for the wheel. */
+static TimeEventHandlerPtr timeWheelOverflow;
+static time_t timeWheelTime = 0;
+static int timeWheelCount = 0;
 
 struct timeval current_time;
 struct timeval null_time = {0,0};
@@ -43,6 +72,82 @@ int diskIsClean = 1;
 
 static int fds_invalid = 0;
 
+#ifdef HAVE_EPOLL
+/* With epoll, the kernel keeps the set of interesting descriptors, and
+   we only get told about the ones that are ready.  poll_fds is still
+   used to remember the events we are interested in, but slots are
+   found through fdSlots, which is indexed by file descriptor.
+
+   The kernel's set is updated lazily: a descriptor is added with its
+   events when it gets a slot, but it is not removed when the slot is
+   released (closing it is enough), and events that are no longer
+   wanted are only removed if they fire.  fdStates remembers what the
+   kernel has been told.  Its generation is bumped whenever the
+   descriptor stops referring to the file we know about, and is
+   carried in epoll_data together with the descriptor, so that events
+   for a file that has since been closed can be ignored. */
+
+#define EPOLL_BATCH 256
+
+typedef struct _FdState {
+    unsigned int gen;
+    /* Events in the kernel's set, or -1 if the descriptor isn't there */
+    short kernel;
+    /* The value of forkEpoch when the descriptor was added */
+    unsigned short epoch;
+} FdStateRec, *FdStatePtr;
+
+static int epoll_fd = -1;
+static int *fdSlots = NULL;
+static FdStatePtr fdStates = NULL;
+static int fdSlotsSize = 0;
+static unsigned short forkEpoch = 0;
+static struct epoll_event epoll_events[EPOLL_BATCH];
+#endif
+
+#ifdef HAVE_IO_URING
+/* With io_uring, readiness is obtained with one-shot poll requests.
+   Changes to the set of interesting events are only recorded in
+   ringDirty, and turned into poll requests just before we wait, so
+   that they are submitted together with the wait in a single system
+   call.  A poll that has fired is rearmed in the same manner, which
+   gives level-triggered semantics.  The ring also carries disk reads
+   and writes, see submitRingIo.
+
+   The user_data of a poll request is its file descriptor and
+   a generation number, with the low bit set; requests whose
+   generation is stale are ignored.  That of an I/O request is
+   a pointer to a RingIoRequest, and removals use 0. */
+
+#define RING_ENTRIES 1024
+
+int useIoUring = 1;
+
+typedef struct _RingFd {
+    unsigned int gen;
+    short armed;
+    short dirty;
+} RingFdRec, *RingFdPtr;
+
+typedef struct _RingIoRequest {
+    void (*handler)(int, void*);
+    void *data;
+} RingIoRequestRec, *RingIoRequestPtr;
+
+static int ring_fd = -1;
+static void *ring_sq = NULL, *ring_cq = NULL;
+static size_t ring_sq_size = 0, ring_cq_size = 0;
+static struct io_uring_sqe *ring_sqes = NULL;
+static size_t ring_sqes_size = 0;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *ring_cqes;
+static unsigned sq_entries, sq_local_tail;
+static RingFdPtr ringFds = NULL;
+static int *ringDirty = NULL;
+static int ringDirtyCount = 0;
+#endif
+
 static inline int
 timeval_cmp(struct timeval *t1, struct timeval *t2)
 {
@@ -136,11 +241,36 @@ initEvents()
 
     timeEventQueue = NULL;
     timeEventQueueLast = NULL;
+    memset(timeWheel, 0, sizeof(timeWheel));
+    timeWheelOverflow = NULL;
+    timeWheelTime = 0;
+    timeWheelCount = 0;
     fdEventSize = 0;
     fdEventNum = 0;
     poll_fds = NULL;
     fdEvents = NULL;
     fdEventsLast = NULL;
+#ifdef HAVE_EPOLL
+    if(epoll_fd >= 0)
+        close(epoll_fd);
+    epoll_fd = -1;
+    fdSlots = NULL;
+    fdStates = NULL;
+    fdSlotsSize = 0;
+#endif
+#ifdef HAVE_IO_URING
+    if(ring_fd >= 0) {
+        munmap(ring_sqes, ring_sqes_size);
+        if(ring_cq != ring_sq)
+            munmap(ring_cq, ring_cq_size);
+        munmap(ring_sq, ring_sq_size);
+        close(ring_fd);
+    }
+    ring_fd = -1;
+    ringFds = NULL;
+    ringDirty = NULL;
+    ringDirtyCount = 0;
+#endif
 }
 
 void
@@ -195,14 +325,56 @@ interestingSignals(sigset_t *ss)
 }
 #endif
 
+static int
+timeWheelDigit(time_t t, int level)
+{
+    return (t >> (level * TIME_WHEEL_BITS)) & TIME_WHEEL_MASK;
+}
+
+/* Returns a lower bound on the time of the events in the wheel, or -1
+   if the wheel is empty. */
+static time_t
+timeWheelNext()
+{
+    int level, i;
+    time_t base;
+
+    if(timeWheelCount == 0)
+        return -1;
+
+    for(level = 0; level < TIME_WHEEL_LEVELS; level++) {
+        base = timeWheelTime >> ((level + 1) * TIME_WHEEL_BITS);
+        base <<= (level + 1) * TIME_WHEEL_BITS;
+        for(i = timeWheelDigit(timeWheelTime, level) + 1;
+            i < TIME_WHEEL_SIZE; i++) {
+            if(timeWheel[level][i])
+                return base + ((time_t)i << (level * TIME_WHEEL_BITS));
+        }
+    }
+
+    assert(timeWheelOverflow);
+    base = timeWheelTime >> (TIME_WHEEL_LEVELS * TIME_WHEEL_BITS);
+    return (base + 1) << (TIME_WHEEL_LEVELS * TIME_WHEEL_BITS);
+}
+
 void
 timeToSleep(struct timeval *time)
 {
-    if(!timeEventQueue) {
+    time_t next;
+
+    if(timeEventQueue) {
+        *time = timeEventQueue->time;
+        return;
+    }
+
+    next = timeWheelNext();
+    if(next < 0) {
         time->tv_sec = ~0L;
         time->tv_usec = ~0L;
     } else {
-        *time = timeEventQueue->time;
+        /* This may be a little early, which is harmless. */
+        time->tv_sec = next;
+        time->tv_usec = 0;
     }
 }
 
@@ -211,6 +383,8 @@ enqueueTimeEvent(TimeEventHandlerPtr event)
 {
     TimeEventHandlerPtr otherevent;
 
+    event->slot = NULL;
+
     /* We try to optimise two cases -- the event happens very soon, or
        it happens after most of the other events. */
     if(timeEventQueue == NULL ||
@@ -249,20 +423,183 @@ enqueueTimeEvent(TimeEventHandlerPtr event)
     return event;
 }
 
-TimeEventHandlerPtr
-scheduleTimeEvent(int seconds,
-                  int (*handler)(TimeEventHandlerPtr), int dsize, void *data)
+static void
+unlinkTimeEvent(TimeEventHandlerPtr event)
 {
-    struct timeval when;
-    TimeEventHandlerPtr event;
-
-    if(seconds >= 0) {
-        when = current_time;
-        when.tv_sec += seconds;
+    if(event->slot == NULL) {
+        if(event == timeEventQueue)
+            timeEventQueue = event->next;
+        if(event == timeEventQueueLast)
+            timeEventQueueLast = event->previous;
     } else {
-        when.tv_sec = 0;
-        when.tv_usec = 0;
+        if(event == *event->slot)
+            *event->slot = event->next;
+        timeWheelCount--;
+    }
+    if(event->next)
+        event->next->previous = event->previous;
+    if(event->previous)
+        event->previous->next = event->next;
+}
+
+static TimeEventHandlerPtr
+placeTimeEvent(TimeEventHandlerPtr event)
+{
+    time_t t = event->time.tv_sec;
+    TimeEventHandlerPtr *slot;
+    int level;
+
+    /* An empty wheel can be moved forward for free. */
+    if(timeWheelCount == 0 && timeWheelTime < current_time.tv_sec)
+        timeWheelTime = current_time.tv_sec;
+
+    if(t <= timeWheelTime)
+        return enqueueTimeEvent(event);
+
+    for(level = 0; level < TIME_WHEEL_LEVELS; level++) {
+        if((t >> ((level + 1) * TIME_WHEEL_BITS)) ==
+           (timeWheelTime >> ((level + 1) * TIME_WHEEL_BITS)))
+            break;
+    }
+
+    if(level < TIME_WHEEL_LEVELS)
+        slot = &timeWheel[level][timeWheelDigit(t, level)];
+    else
+        slot = &timeWheelOverflow;
+
+    event->slot = slot;
+    event->previous = NULL;
+    event->next = *slot;
+    if(*slot)
+        (*slot)->previous = event;
+    *slot = event;
+    timeWheelCount++;
+    return event;
+}
+
+static void
+cascadeTimeEvents(TimeEventHandlerPtr *slot)
+{
+    TimeEventHandlerPtr event, next;
+
+    event = *slot;
+    *slot = NULL;
+    while(event) {
+        next = event->next;
+        timeWheelCount--;
+        placeTimeEvent(event);
+        event = next;
+    }
+}
+
+/* Merge sort a singly linked list of time events.  Equal events keep
+   their relative order. */
+static TimeEventHandlerPtr
+sortTimeEvents(TimeEventHandlerPtr list, int n)
+{
+    TimeEventHandlerPtr a, b, *last;
+    int i;
+
+    if(n <= 1) {
+        if(list)
+            list->next = NULL;
+        return list;
+    }
+
+    b = list;
+    for(i = 0; i < n / 2; i++)
+        b = b->next;
+    a = sortTimeEvents(list, n / 2);
+    b = sortTimeEvents(b, n - n / 2);
+
+    last = &list;
+    while(a && b) {
+        if(timeval_cmp(&b->time, &a->time) < 0) {
+            *last = b;
+            b = b->next;
+        } else {
+            *last = a;
+            a = a->next;
+        }
+        last = &(*last)->next;
     }
+    *last = a ? a : b;
+    return list;
+}
+
+/* Move the events of a level 0 slot, which are all due during the
+   current second, into timeEventQueue.  Sorting them first avoids
+   quadratic behaviour when a lot of events expire at once. */
+static void
+flushTimeEvents(TimeEventHandlerPtr *slot)
+{
+    TimeEventHandlerPtr event, next, list;
+    int n;
+
+    list = NULL;
+    n = 0;
+    event = *slot;
+    *slot = NULL;
+    /* Slots are LIFO; reverse to get the order of scheduling. */
+    while(event) {
+        next = event->next;
+        event->next = list;
+        list = event;
+        n++;
+        event = next;
+    }
+    timeWheelCount -= n;
+
+    event = sortTimeEvents(list, n);
+    while(event) {
+        next = event->next;
+        enqueueTimeEvent(event);
+        event = next;
+    }
+}
+
+/* Move the wheel forward to time now, moving any events that become
+   due into timeEventQueue. */
+static void
+advanceTimeWheel(time_t now)
+{
+    int level;
+    time_t next;
+
+    while(timeWheelTime < now) {
+        next = timeWheelNext();
+        if(next < 0 || next > now) {
+            /* Nothing to cascade in between */
+            timeWheelTime = now;
+            break;
+        }
+        /* Skip over empty slots */
+        if(next - 1 > timeWheelTime)
+            timeWheelTime = next - 1;
+        timeWheelTime++;
+        /* Find the highest level at which we just entered a new slot. */
+        for(level = 0; level < TIME_WHEEL_LEVELS; level++) {
+            if(timeWheelDigit(timeWheelTime, level) != 0)
+                break;
+        }
+        if(level >= TIME_WHEEL_LEVELS) {
+            cascadeTimeEvents(&timeWheelOverflow);
+            level = TIME_WHEEL_LEVELS - 1;
+        }
+        while(level > 0) {
+            cascadeTimeEvents(&timeWheel[level]
+                              [timeWheelDigit(timeWheelTime, level)]);
+            level--;
+        }
+        flushTimeEvents(&timeWheel[0][timeWheelDigit(timeWheelTime, 0)]);
+    }
+}
+
+static TimeEventHandlerPtr
+scheduleTimeEventAt(struct timeval when,
+                    int (*handler)(TimeEventHandlerPtr), int dsize, void *data)
+{
+    TimeEventHandlerPtr event;
 
     event = malloc(sizeof(TimeEventHandlerRec) - 1 + dsize);
     if(event == NULL) {
@@ -280,23 +617,690 @@ scheduleTimeEvent(int seconds,
     else if(dsize > 0)
         memcpy(event->data, data, dsize);
 
-    return enqueueTimeEvent(event);
+    return placeTimeEvent(event);
+}
+
+TimeEventHandlerPtr
+scheduleTimeEvent(int seconds,
+                  int (*handler)(TimeEventHandlerPtr), int dsize, void *data)
+{
+    struct timeval when;
+
+    if(seconds >= 0) {
+        when = current_time;
+        when.tv_sec += seconds;
+    } else {
+        when.tv_sec = 0;
+        when.tv_usec = 0;
+    }
+
+    return scheduleTimeEventAt(when, handler, dsize, data);
+}
+
+/* Same as above, for the few timeouts that need sub-second accuracy. */
+
+TimeEventHandlerPtr
+scheduleTimeEventMsec(int msecs,
+                      int (*handler)(TimeEventHandlerPtr),
+                      int dsize, void *data)
+{
+    struct timeval when;
+
+    when = current_time;
+    when.tv_sec += msecs / 1000;
+    when.tv_usec += (msecs % 1000) * 1000;
+    if(when.tv_usec >= 1000000) {
+        when.tv_sec++;
+        when.tv_usec -= 1000000;
+    }
+
+    return scheduleTimeEventAt(when, handler, dsize, data);
 }
 
 void
 cancelTimeEvent(TimeEventHandlerPtr event)
 {
-    if(event == timeEventQueue)
-        timeEventQueue = event->next;
-    if(event == timeEventQueueLast)
-        timeEventQueueLast = event->previous;
-    if(event->next)
-        event->next->previous = event->previous;
-    if(event->previous)
-        event->previous->next = event->next;
+    unlinkTimeEvent(event);
     free(event);
 }
 
+#ifdef HAVE_EPOLL
+
+static int
+pollToEpoll(int events)
+{
+    int e = 0;
+    if(events & POLLIN) e |= EPOLLIN;
+    if(events & POLLOUT) e |= EPOLLOUT;
+    return e;
+}
+
+static int
+epollToPoll(int events)
+{
+    int e = 0;
+    if(events & EPOLLIN) e |= POLLIN;
+    if(events & EPOLLOUT) e |= POLLOUT;
+    if(events & EPOLLERR) e |= POLLERR;
+    if(events & EPOLLHUP) e |= POLLHUP;
+    return e;
+}
+
+static unsigned long long
+epollData(int fd)
+{
+    return ((unsigned long long)fdStates[fd].gen << 32) | (unsigned)fd;
+}
+
+/* Tell the kernel that we want events on fd. */
+static int
+epollSet(int fd, int events)
+{
+    FdStatePtr state = &fdStates[fd];
+    struct epoll_event ev;
+    int rc;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = pollToEpoll(events);
+    ev.data.u64 = epollData(fd);
+    if(state->kernel >= 0) {
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        if(rc >= 0 || errno != ENOENT)
+            goto done;
+        /* The file was closed and reopened under our feet. */
+    }
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if(rc >= 0) {
+        state->epoch = forkEpoch;
+    } else if(errno == EEXIST) {
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        /* We don't know where this registration comes from. */
+        state->epoch = forkEpoch - 1;
+    }
+
+ done:
+    state->kernel = rc >= 0 ? events : -1;
+    return rc;
+}
+
+#ifdef HAVE_IO_URING
+
+static int
+ringSetup(void)
+{
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if(fd < 0) {
+        do_log_error(L_WARN, errno, "Couldn't create io_uring, using epoll");
+        return -1;
+    }
+    if(!(p.features & IORING_FEAT_EXT_ARG) ||
+       !(p.features & IORING_FEAT_NODROP)) {
+        do_log(L_WARN, "Kernel io_uring is too old, using epoll.\n");
+        CLOSE(fd);
+        return -1;
+    }
+
+    ring_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        ring_sq_size = ring_cq_size = MAX(ring_sq_size, ring_cq_size);
+    ring_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring_sq = mmap(NULL, ring_sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ring_sq == MAP_FAILED)
+        goto fail;
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring_cq = ring_sq;
+    } else {
+        ring_cq = mmap(NULL, ring_cq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(ring_cq == MAP_FAILED) {
+            munmap(ring_sq, ring_sq_size);
+            goto fail;
+        }
+    }
+    ring_sqes = mmap(NULL, ring_sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ring_sqes == MAP_FAILED) {
+        if(ring_cq != ring_sq)
+            munmap(ring_cq, ring_cq_size);
+        munmap(ring_sq, ring_sq_size);
+        goto fail;
+    }
+
+    sq_head = (unsigned*)((char*)ring_sq + p.sq_off.head);
+    sq_tail = (unsigned*)((char*)ring_sq + p.sq_off.tail);
+    sq_mask = (unsigned*)((char*)ring_sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)((char*)ring_sq + p.sq_off.array);
+    cq_head = (unsigned*)((char*)ring_cq + p.cq_off.head);
+    cq_tail = (unsigned*)((char*)ring_cq + p.cq_off.tail);
+    cq_mask = (unsigned*)((char*)ring_cq + p.cq_off.ring_mask);
+    ring_cqes = (struct io_uring_cqe*)((char*)ring_cq + p.cq_off.cqes);
+    sq_entries = p.sq_entries;
+    sq_local_tail = *sq_tail;
+    ring_fd = fd;
+    return 1;
+
+ fail:
+    do_log_error(L_WARN, errno, "Couldn't map io_uring, using epoll");
+    CLOSE(fd);
+    return -1;
+}
+
+/* Pass queued requests to the kernel, and wait for at least
+   min_complete completions, with a timeout in milliseconds. */
+static int
+ringEnter(int min_complete, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0, submit;
+    int rc;
+
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if(submit == 0 && min_complete == 0)
+        return 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if(min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if(timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            arg.ts = (unsigned long)&ts;
+        }
+    }
+    rc = syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags,
+                 (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg));
+    if(rc < 0 && errno == ETIME)
+        return 0;
+    return rc;
+}
+
+static struct io_uring_sqe *
+ringGetSqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned i;
+
+    if(sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+       sq_entries) {
+        ringEnter(0, 0);
+        if(sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+           sq_entries)
+            return NULL;
+    }
+    i = sq_local_tail & *sq_mask;
+    sqe = &ring_sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[i] = i;
+    sq_local_tail++;
+    return sqe;
+}
+
+static unsigned long long
+ringPollData(int fd)
+{
+    return ((unsigned long long)ringFds[fd].gen << 32) |
+        ((unsigned)fd << 1) | 1;
+}
+
+static void
+ringMarkDirty(int fd)
+{
+    if(!ringFds[fd].dirty) {
+        ringFds[fd].dirty = 1;
+        ringDirty[ringDirtyCount++] = fd;
+    }
+}
+
+static void
+ringDisarm(int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if(!ringFds[fd].armed)
+        return;
+    sqe = ringGetSqe();
+    if(sqe == NULL) {
+        do_log(L_ERROR, "Couldn't queue io_uring poll removal.\n");
+    } else {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ringPollData(fd);
+        sqe->user_data = 0;
+    }
+    ringFds[fd].gen++;
+    ringFds[fd].armed = 0;
+}
+
+static void
+ringFlush(void)
+{
+    struct io_uring_sqe *sqe;
+    int k, fd, i, want;
+    unsigned events;
+
+    for(k = 0; k < ringDirtyCount; k++) {
+        fd = ringDirty[k];
+        ringFds[fd].dirty = 0;
+        i = fdSlots[fd];
+        want = i >= 0 ? poll_fds[i].events & (POLLIN | POLLOUT) : 0;
+        if(ringFds[fd].armed == want)
+            continue;
+        ringDisarm(fd);
+        if(!want)
+            continue;
+        sqe = ringGetSqe();
+        if(sqe == NULL) {
+            do_log(L_ERROR, "Couldn't queue io_uring poll request.\n");
+            continue;
+        }
+        events = want;
+#if __BYTE_ORDER == __BIG_ENDIAN
+        events = (events << 16) | (events >> 16);
+#endif
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->user_data = ringPollData(fd);
+        ringFds[fd].armed = want;
+    }
+    ringDirtyCount = 0;
+}
+
+/* Consume completions.  Readiness is stored in events, if not NULL,
+   in the same format as returned by epoll; otherwise it is dropped,
+   which is harmless since the poll will be rearmed.  Completed I/O
+   requests are passed to their handler.  Returns the number of
+   ready descriptors, and stores the number of I/O completions in
+   io_return. */
+static int
+ringHarvest(struct epoll_event *events, int *io_return)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, tail, gen;
+    unsigned long long data;
+    int n = 0, io = 0, res, fd;
+
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail && n < EPOLL_BATCH) {
+        cqe = &ring_cqes[head & *cq_mask];
+        data = cqe->user_data;
+        res = cqe->res;
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        if(data == 0)
+            continue;
+        if(data & 1) {
+            fd = (data & 0xFFFFFFFF) >> 1;
+            gen = data >> 32;
+            if(fd >= fdSlotsSize || ringFds[fd].gen != gen ||
+               !ringFds[fd].armed)
+                continue;
+            ringFds[fd].armed = 0;
+            ringMarkDirty(fd);
+            if(res < 0 || (res & POLLNVAL) || events == NULL)
+                continue;
+            memset(&events[n], 0, sizeof(struct epoll_event));
+            events[n].data.u64 = epollData(fd);
+            events[n].events = pollToEpoll(res);
+            if(res & POLLERR) events[n].events |= EPOLLERR;
+            if(res & POLLHUP) events[n].events |= EPOLLHUP;
+            n++;
+        } else {
+            RingIoRequestPtr request = (RingIoRequestPtr)(unsigned long)data;
+            request->handler(res, request->data);
+            free(request);
+            io++;
+            /* The handler may have queued more requests, but it
+               cannot have consumed any completions. */
+        }
+    }
+    if(io_return)
+        *io_return = io;
+    return n;
+}
+
+static int
+ringWait(int timeout)
+{
+    int rc, n, io;
+
+    ringFlush();
+    if(*cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        rc = ringEnter(timeout == 0 ? 0 : 1, timeout);
+        if(rc < 0)
+            return -1;
+    } else {
+        ringEnter(0, 0);
+    }
+    n = ringHarvest(epoll_events, &io);
+    if(n == 0 && io > 0) {
+        /* Let the event loop run the handlers scheduled by the
+           completed requests. */
+        errno = EINTR;
+        return -1;
+    }
+    return n;
+}
+
+static int
+ringPending(void)
+{
+    ringFlush();
+    ringEnter(0, 0);
+    return *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+}
+
+int
+ringActive(void)
+{
+    return ring_fd >= 0;
+}
+
+/* Queue a vectored read or write at the given offset in fd.  The
+   iovec must stay valid until handler is called, from the event
+   loop or from waitRingIo, with the result of the operation as
+   a byte count or a negated errno.  The request is only passed to the
+   kernel the next time the event loop waits. */
+int
+submitRingIo(int write, int fd, const struct iovec *iov, int iovcnt,
+             off_t offset, void (*handler)(int, void*), void *data)
+{
+    RingIoRequestPtr request;
+    struct io_uring_sqe *sqe;
+
+    assert(ring_fd >= 0);
+    request = malloc(sizeof(RingIoRequestRec));
+    if(request == NULL)
+        return -1;
+    sqe = ringGetSqe();
+    if(sqe == NULL) {
+        free(request);
+        return -1;
+    }
+    request->handler = handler;
+    request->data = data;
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = iovcnt;
+    sqe->off = offset;
+    sqe->user_data = (unsigned long)request;
+    return 1;
+}
+
+/* Block until at least one I/O request has completed. */
+void
+waitRingIo(void)
+{
+    int rc, io = 0;
+
+    while(io == 0) {
+        ringFlush();
+        rc = ringEnter(1, -1);
+        if(rc < 0 && errno != EINTR) {
+            do_log_error(L_ERROR, errno, "Couldn't wait for io_uring");
+            return;
+        }
+        ringHarvest(NULL, &io);
+    }
+}
+
+#endif
+
+/* Called when an event fired on fd that nobody wants. */
+static void
+epollTrim(int fd)
+{
+    int i = fdSlots[fd];
+    int rc;
+
+#ifdef HAVE_IO_URING
+    if(ring_fd >= 0)
+        return;
+#endif
+    if(i >= 0) {
+        rc = epollSet(fd, poll_fds[i].events & (POLLIN | POLLOUT));
+    } else {
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        fdStates[fd].kernel = -1;
+    }
+    if(rc < 0 && errno != EBADF && errno != ENOENT)
+        do_log_error(L_ERROR, errno, "Couldn't modify epoll set");
+}
+
+/* The descriptor fd no longer refers to the file we know about. */
+static void
+forgetFd(int fd)
+{
+#ifdef HAVE_IO_URING
+    if(ring_fd >= 0)
+        ringDisarm(fd);
+#endif
+    fdStates[fd].kernel = -1;
+    fdStates[fd].gen++;
+}
+
+static int
+findFdEventNum(int fd)
+{
+    if(fd < 0 || fd >= fdSlotsSize)
+        return -1;
+    return fdSlots[fd];
+}
+
+int
+allocateFdEventNum(int fd)
+{
+    int i;
+
+#ifdef HAVE_IO_URING
+    if(ring_fd < 0 && epoll_fd < 0 && useIoUring)
+        ringSetup();
+    if(ring_fd < 0 && epoll_fd < 0) {
+#else
+    if(epoll_fd < 0) {
+#endif
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(epoll_fd < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't create epoll descriptor");
+            return -1;
+        }
+    }
+
+    if(fd >= fdSlotsSize) {
+        int *new_fdSlots;
+        FdStatePtr new_fdStates;
+        int new_size = MAX(fd + 1, 2 * fdSlotsSize);
+        new_fdStates = realloc(fdStates, new_size * sizeof(FdStateRec));
+        if(!new_fdStates)
+            return -1;
+        fdStates = new_fdStates;
+        for(i = fdSlotsSize; i < new_size; i++) {
+            fdStates[i].gen = 0;
+            fdStates[i].kernel = -1;
+            fdStates[i].epoch = 0;
+        }
+        new_fdSlots = realloc(fdSlots, new_size * sizeof(int));
+        if(!new_fdSlots)
+            return -1;
+        for(i = fdSlotsSize; i < new_size; i++)
+            new_fdSlots[i] = -1;
+        fdSlots = new_fdSlots;
+#ifdef HAVE_IO_URING
+        if(ring_fd >= 0) {
+            RingFdPtr new_ringFds;
+            int *new_ringDirty;
+            new_ringFds = realloc(ringFds, new_size * sizeof(RingFdRec));
+            if(!new_ringFds)
+                return -1;
+            ringFds = new_ringFds;
+            memset(ringFds + fdSlotsSize, 0,
+                   (new_size - fdSlotsSize) * sizeof(RingFdRec));
+            new_ringDirty = realloc(ringDirty, new_size * sizeof(int));
+            if(!new_ringDirty) {
+                /* ringFds is larger than fdSlots, which is harmless */
+                return -1;
+            }
+            ringDirty = new_ringDirty;
+        }
+#endif
+        fdSlotsSize = new_size;
+    }
+
+    if(fdEventNum >= fdEventSize) {
+        struct pollfd *new_poll_fds;
+        FdEventHandlerPtr *new_fdEvents, *new_fdEventsLast;
+        int new_size = 3 * fdEventSize / 2 + 1;
+
+        new_poll_fds = realloc(poll_fds, new_size * sizeof(struct pollfd));
+        if(!new_poll_fds)
+            return -1;
+        poll_fds = new_poll_fds;
+        new_fdEvents = realloc(fdEvents, new_size * sizeof(FdEventHandlerPtr));
+        if(!new_fdEvents)
+            return -1;
+        fdEvents = new_fdEvents;
+        new_fdEventsLast = realloc(fdEventsLast, 
+                                   new_size * sizeof(FdEventHandlerPtr));
+        if(!new_fdEventsLast)
+            return -1;
+        fdEventsLast = new_fdEventsLast;
+        fdEventSize = new_size;
+    }
+
+    /* The descriptor is added to the epoll set when we know which
+       events we want. */
+    i = fdEventNum;
+    fdEventNum++;
+    poll_fds[i].fd = fd;
+    poll_fds[i].events = POLLERR | POLLHUP | POLLNVAL;
+    poll_fds[i].revents = 0;
+    fdEvents[i] = NULL;
+    fdEventsLast[i] = NULL;
+    fdSlots[fd] = i;
+    return i;
+}
+
+void
+deallocateFdEventNum(int i)
+{
+    int fd = poll_fds[i].fd;
+
+#ifdef HAVE_IO_URING
+    if(ring_fd >= 0)
+        /* The descriptor is about to be closed, and a pending poll
+           would keep the file alive. */
+        ringDisarm(fd);
+#endif
+    /* With epoll, the descriptor stays in the kernel's set: it goes
+       away when it is closed, and if it is not, epollTrim will remove
+       it the first time it fires. */
+    fdSlots[fd] = -1;
+
+    /* Slot order doesn't matter with epoll, so just move the last
+       slot into the hole. */
+    if(i < fdEventNum - 1) {
+        poll_fds[i] = poll_fds[fdEventNum - 1];
+        fdEvents[i] = fdEvents[fdEventNum - 1];
+        fdEventsLast[i] = fdEventsLast[fdEventNum - 1];
+        fdSlots[poll_fds[i].fd] = i;
+    }
+    fdEventNum--;
+    /* Slots have moved, which pokeFdEventHandler needs to know.  The
+       event loop itself finds slots through fdSlots. */
+    fds_invalid = 1;
+}
+
+static void
+setFdEventNumEvents(int i, int events)
+{
+    int fd = poll_fds[i].fd;
+    int want = events & (POLLIN | POLLOUT);
+    int rc;
+
+    poll_fds[i].events = events;
+#ifdef HAVE_IO_URING
+    if(ring_fd >= 0) {
+        ringMarkDirty(fd);
+        return;
+    }
+#endif
+    /* Events we no longer want are only removed if they fire. */
+    if(fdStates[fd].kernel >= 0 ? !(want & ~fdStates[fd].kernel) : !want)
+        return;
+    rc = epollSet(fd, want);
+    if(rc < 0 && errno != EBADF)
+        do_log_error(L_ERROR, errno, "Couldn't modify epoll set");
+}
+
+/* The descriptor fd has been made to refer to a different file,
+   typically by dup2. */
+void
+resetFdEvent(int fd)
+{
+    int i;
+
+    if(fd < 0 || fd >= fdSlotsSize)
+        return;
+    forgetFd(fd);
+    i = fdSlots[fd];
+    if(i >= 0)
+        setFdEventNumEvents(i, poll_fds[i].events);
+}
+
+/* Close a descriptor that may have been registered with the event
+   loop.  This is what CLOSE expands to. */
+int
+closeFd(int fd)
+{
+    int rc;
+
+    if(fd >= 0 && fd < fdSlotsSize) {
+        /* The kernel only drops the descriptor from the epoll set
+           when the underlying file is closed, which will not happen
+           if a child we forked still holds it. */
+        if(fdStates[fd].kernel >= 0 && fdStates[fd].epoch != forkEpoch) {
+            rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            if(rc < 0 && errno != EBADF && errno != ENOENT)
+                do_log_error(L_ERROR, errno,
+                             "Couldn't remove descriptor from epoll set");
+        }
+        forgetFd(fd);
+    }
+    return close(fd);
+}
+
+/* Called in the parent after a fork: the descriptors in the epoll set
+   may now be shared with the child. */
+void
+forkedEvents(void)
+{
+    forkEpoch++;
+}
+
+#else
+
+static int
+findFdEventNum(int fd)
+{
+    int i;
+    for(i = 0; i < fdEventNum; i++)
+        if(poll_fds[i].fd == fd)
+            return i;
+    return -1;
+}
+
 int
 allocateFdEventNum(int fd)
 {
@@ -352,6 +1356,26 @@ deallocateFdEventNum(int i)
     fds_invalid = 1;
 }
 
+static void
+setFdEventNumEvents(int i, int events)
+{
+    poll_fds[i].events = events;
+}
+
+void
+resetFdEvent(int fd)
+{
+    return;
+}
+
+void
+forkedEvents(void)
+{
+    return;
+}
+
+#endif
+
 FdEventHandlerPtr 
 makeFdEvent(int fd, int poll_events, 
             int (*handler)(int, FdEventHandlerPtr), int dsize, void *data)
@@ -384,11 +1408,8 @@ registerFdEventHelper(FdEventHandlerPtr event)
     int i;
     int fd = event->fd;
 
-    for(i = 0; i < fdEventNum; i++)
-        if(poll_fds[i].fd == fd)
-            break;
-
-    if(i >= fdEventNum)
+    i = findFdEventNum(fd);
+    if(i < 0)
         i = allocateFdEventNum(fd);
     if(i < 0) {
         free(event);
@@ -403,7 +1424,7 @@ registerFdEventHelper(FdEventHandlerPtr event)
         fdEventsLast[i]->next = event;
     }
     fdEventsLast[i] = event;
-    poll_fds[i].events |= event->poll_events;
+    setFdEventNumEvents(i, poll_fds[i].events | event->poll_events);
 
     return event;
 }
@@ -456,8 +1477,8 @@ unregisterFdEventI(FdEventHandlerPtr event, int i)
     if(fdEvents[i] == NULL) {
         deallocateFdEventNum(i);
     } else {
-        poll_fds[i].events = recomputePollEvents(fdEvents[i]) | 
-            POLLERR | POLLHUP | POLLNVAL;
+        setFdEventNumEvents(i, recomputePollEvents(fdEvents[i]) | 
+                            POLLERR | POLLHUP | POLLNVAL);
     }
 }
 
@@ -466,13 +1487,10 @@ unregisterFdEvent(FdEventHandlerPtr event)
 {
     int i;
 
-    for(i = 0; i < fdEventNum; i++) {
-        if(poll_fds[i].fd == event->fd) {
-            unregisterFdEventI(event, i);
-            return;
-        }
-    }
-    abort();
+    i = findFdEventNum(event->fd);
+    if(i < 0)
+        abort();
+    unregisterFdEventI(event, i);
 }
 
 void
@@ -481,14 +1499,12 @@ runTimeEventQueue()
     TimeEventHandlerPtr event;
     int done;
 
+    advanceTimeWheel(current_time.tv_sec);
+
     while(timeEventQueue && 
           timeval_cmp(&timeEventQueue->time, &current_time) <= 0) {
         event = timeEventQueue;
-        timeEventQueue = event->next;
-        if(timeEventQueue)
-            timeEventQueue->previous = NULL;
-        else
-            timeEventQueueLast = NULL;
+        unlinkTimeEvent(event);
         done = event->handler(event);
         assert(done);
         free(event);
@@ -554,12 +1570,8 @@ pokeFdEventHandler(TimeEventHandlerPtr tevent)
     FdEventHandlerPtr event, next;
     int i;
 
-    for(i = 0; i < fdEventNum; i++) {
-        if(poll_fds[i].fd == fd)
-            break;
-    }
-
-    if(i >= fdEventNum)
+    i = findFdEventNum(fd);
+    if(i < 0)
         return 1;
 
     event = fdEvents[i];
@@ -598,6 +1610,30 @@ pokeFdEvent(int fd, int status, int what)
     }
 }
 
+/* Wait for activity on our file descriptors, with a timeout in
+   milliseconds (-1 to wait forever).  Returns the number of ready
+   descriptors, or -1 on error. */
+
+static int
+waitFdEvents(int timeout)
+{
+#ifdef HAVE_EPOLL
+#ifdef HAVE_IO_URING
+    if(ring_fd >= 0)
+        return ringWait(timeout);
+#endif
+    if(epoll_fd < 0) {
+        /* Nothing has been registered yet. */
+        if(timeout != 0)
+            poll(NULL, 0, timeout);
+        return 0;
+    }
+    return epoll_wait(epoll_fd, epoll_events, EPOLL_BATCH, timeout);
+#else
+    return poll(poll_fds, fdEventNum, timeout);
+#endif
+}
+
 int
 workToDo()
 {
@@ -611,7 +1647,12 @@ workToDo()
     gettimeofday(&current_time, NULL);
     if(timeval_cmp(&sleep_time, &current_time) <= 0)
         return 1;
-    rc = poll(poll_fds, fdEventNum, 0);
+#ifdef HAVE_IO_URING
+    /* Don't consume completions, our caller is not ready for them. */
+    if(ring_fd >= 0)
+        return ringPending();
+#endif
+    rc = waitFdEvents(0);
     if(rc < 0) {
         do_log_error(L_ERROR, errno, "Couldn't poll");
         return 1;
@@ -623,14 +1664,18 @@ void
 eventLoop()
 {
     struct timeval sleep_time, timeout;
-    int rc, i, done, n;
+    int rc, i, done;
     FdEventHandlerPtr event;
-    int fd0;
+#ifndef HAVE_EPOLL
+    int n, fd0;
+#endif
 
     gettimeofday(&current_time, NULL);
 
     while(1) {
+#ifndef HAVE_EPOLL
     again:
+#endif
         if(exitFlag) {
             if(exitFlag < 3)
                 reopenLog();
@@ -641,6 +1686,7 @@ eventLoop()
                 free_chunk_arenas();
             } else {
                 writeoutObjects(1);
+                writeState();
             }
             initForbidden();
             exitFlag = 0;
@@ -648,8 +1694,7 @@ eventLoop()
 
         timeToSleep(&sleep_time);
         if(sleep_time.tv_sec == -1) {
-            rc = poll(poll_fds, fdEventNum, 
-                      diskIsClean ? -1 : idleTime * 1000);
+            rc = waitFdEvents(diskIsClean ? -1 : idleTime * 1000);
         } else if(timeval_cmp(&sleep_time, &current_time) <= 0) {
             runTimeEventQueue();
             continue;
@@ -662,8 +1707,7 @@ eventLoop()
                 int t;
                 timeval_minus(&timeout, &sleep_time, &current_time);
                 t = timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000;
-                rc = poll(poll_fds, fdEventNum,
-                          diskIsClean ? t : MIN(idleTime * 1000, t));
+                rc = waitFdEvents(diskIsClean ? t : MIN(idleTime * 1000, t));
             }
         }
 
@@ -698,6 +1742,32 @@ eventLoop()
            assume that something changed whenever we see any activity. */
         diskIsClean = 0;
 
+#ifdef HAVE_EPOLL
+        for(i = 0; i < rc; i++) {
+            unsigned long long data = epoll_events[i].data.u64;
+            int fd = data & 0xFFFFFFFF;
+            int revents, j;
+            /* A handler earlier in the batch may have closed fd; its
+               number may even have been reused already. */
+            if(fd >= fdSlotsSize || fdStates[fd].gen != data >> 32)
+                continue;
+            revents = epollToPoll(epoll_events[i].events);
+            j = fdSlots[fd];
+            if(j < 0 ||
+               (revents & (POLLIN | POLLOUT) & ~poll_fds[j].events)) {
+                epollTrim(fd);
+                if(j < 0)
+                    continue;
+            }
+            event = findEvent(revents, fdEvents[j]);
+            if(!event)
+                continue;
+            done = event->handler(0, event);
+            if(done)
+                unregisterFdEvent(event);
+        }
+        fds_invalid = 0;
+#else
         fd0 = 
             (current_time.tv_usec ^ (current_time.tv_usec >> 16)) % fdEventNum;
         n = rc;
@@ -723,6 +1793,7 @@ eventLoop()
                 } 
             }
         }
+#endif
     }
 }
 
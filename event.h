@@ -27,6 +27,7 @@ extern int diskIsClean;
 typedef struct _TimeEventHandler {
     struct timeval time;
     struct _TimeEventHandler *previous, *next;
+    struct _TimeEventHandler **slot;
     int (*handler)(struct _TimeEventHandler*);
     char data[1];
 } TimeEventHandlerRec, *TimeEventHandlerPtr;
@@ -59,6 +60,9 @@ void interestingSignals(sigset_t *ss);
 TimeEventHandlerPtr scheduleTimeEvent(int seconds,
                                       int (*handler)(TimeEventHandlerPtr),
                                       int dsize, void *data);
+TimeEventHandlerPtr scheduleTimeEventMsec(int msecs,
+                                          int (*handler)(TimeEventHandlerPtr),
+                                          int dsize, void *data);
 
 int timeval_minus_usec(const struct timeval *s1, const struct timeval *s2)
      ATTRIBUTE((pure));
@@ -75,6 +79,18 @@ FdEventHandlerPtr registerFdEvent(int fd, int poll_events,
                                   int dsize, void *data);
 FdEventHandlerPtr registerFdEventHelper(FdEventHandlerPtr event);
 void unregisterFdEvent(FdEventHandlerPtr event);
+void resetFdEvent(int fd);
+#ifdef HAVE_EPOLL
+int closeFd(int fd);
+#endif
+void forkedEvents(void);
+#ifdef HAVE_IO_URING
+extern int useIoUring;
+int ringActive(void);
+int submitRingIo(int write, int fd, const struct iovec *iov, int iovcnt,
+                 off_t offset, void (*handler)(int, void*), void *data);
+void waitRingIo(void);
+#endif
 void pokeFdEvent(int fd, int status, int what);
 int workToDo(void);
 void eventLoop(void);
@@ -512,9 +512,9 @@ redirectorKill(void)
     if(redirector_read_fd >= 0) {
         rc = waitpid(redirector_pid, &status, WNOHANG);
         dead = (rc > 0);
-        close(redirector_read_fd);
+        CLOSE(redirector_read_fd);
         redirector_read_fd = -1;
-        close(redirector_write_fd);
+        CLOSE(redirector_write_fd);
         redirector_write_fd = -1;
         if(!dead) {
             rc = kill(redirector_pid, SIGTERM);
@@ -713,6 +713,7 @@ runRedirector(pid_t *pid_return, int *read_fd_return, int *write_fd_return)
     }
 
     if(pid > 0) {
+        forkedEvents();
         do {
             rc = sigprocmask(SIG_SETMASK, &old_mask, NULL);
         } while(rc < 0 && errno == EINTR);
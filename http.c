@@ -44,6 +44,7 @@ NetAddressPtr allowedNets = NULL;
 
 IntListPtr allowedPorts = NULL;
 IntListPtr tunnelAllowedPorts = NULL;
+int tunnelSplice = 1;
 int expectContinue = 1;
 int dontTrustVaryETag = 1;
 
@@ -99,6 +100,10 @@ preinitHttp()
                     "Networks from which clients are allowed to connect.");
     CONFIG_VARIABLE(tunnelAllowedPorts, CONFIG_INT_LIST,
                     "Ports to which tunnelled connections are allowed.");
+#ifdef HAVE_SPLICE
+    CONFIG_VARIABLE_SETTABLE(tunnelSplice, CONFIG_BOOLEAN, configIntSetter,
+                             "Relay tunnelled data with splice.");
+#endif
     CONFIG_VARIABLE(allowedPorts, CONFIG_INT_LIST,
                     "Ports to which connections are allowed.");
     CONFIG_VARIABLE(expectContinue, CONFIG_TRISTATE,
@@ -582,10 +587,13 @@ httpMakeConnection()
     connection->reqoffset = 0;
     connection->bodylen = -1;
     connection->reqte = TE_IDENTITY;
+    connection->scanned = 0;
     connection->chunk_remaining = 0;
     connection->server = NULL;
     connection->pipelined = 0;
     connection->connecting = 0;
+    connection->dns_time = null_time;
+    connection->connect_time = null_time;
     connection->server = NULL;
     return connection;
 }
@@ -614,6 +622,7 @@ httpConnectionDestroyBuf(HTTPConnectionPtr connection)
     }
     connection->flags &= ~CONN_BIGBUF;
     connection->buf = NULL;
+    connection->scanned = 0;
 }
 
 void
@@ -627,6 +636,7 @@ httpConnectionDestroyReqbuf(HTTPConnectionPtr connection)
     }
     connection->flags &= ~CONN_BIGREQBUF;
     connection->reqbuf = NULL;
+    connection->scanned = 0;
 }
 
 HTTPRequestPtr 
@@ -653,6 +663,9 @@ httpMakeRequest()
     request->headers = NULL;
     request->time0 = null_time;
     request->time1 = null_time;
+    request->time_dns = null_time;
+    request->time_connect = null_time;
+    request->code = 0;
     request->request = NULL;
     request->next = NULL;
     return request;
@@ -45,6 +45,8 @@ typedef struct _HTTPRequest {
     struct _Atom *error_headers;
     AtomPtr headers;
     struct timeval time0, time1;
+    struct timeval time_dns, time_connect;
+    int code;
     struct _HTTPRequest *request;
     struct _HTTPRequest *next;
 } HTTPRequestRec, *HTTPRequestPtr;
@@ -62,6 +64,12 @@ typedef struct _HTTPRequest {
 #define REQUEST_PIPELINED 16
 /* This client-side request has already switched objects once. */
 #define REQUEST_SUPERSEDED 32
+/* This client-side request caused a request to the server. */
+#define REQUEST_FETCHED 64
+/* The server answered this client-side request with "not modified". */
+#define REQUEST_REVALIDATED 128
+/* Some of the data for this client-side request was read from disk. */
+#define REQUEST_FROM_DISK 256
 
 typedef struct _HTTPConnection {
     int flags;
@@ -82,11 +90,15 @@ typedef struct _HTTPConnection {
     int reqoffset;
     int bodylen;
     int reqte;
+    /* How far findEndOfHeadersResume got in the current header block */
+    int scanned;
     /* For server connections */
     int chunk_remaining;
     struct _HTTPServer *server;
     int pipelined;
     int connecting;
+    /* When name resolution and connection set-up completed */
+    struct timeval dns_time, connect_time;
 } HTTPConnectionRec, *HTTPConnectionPtr;
 
 /* connection->flags */
@@ -143,6 +155,7 @@ extern AtomListPtr allowedClients;
 extern NetAddressPtr allowedNets;
 extern IntListPtr allowedPorts;
 extern IntListPtr tunnelAllowedPorts;
+extern int tunnelSplice;
 extern int expectContinue;
 extern AtomPtr atom100Continue;
 extern int disableVia;
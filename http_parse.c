@@ -48,6 +48,11 @@ int laxHttpParser = 1;
 
 static AtomListPtr censoredHeaders;
 
+/* Known header names, indexed by a hash that is perfect over them. */
+#define LOG2_HEADER_TABLE_SIZE 8
+static AtomPtr headerTable[1 << LOG2_HEADER_TABLE_SIZE];
+static unsigned int headerSeed = 0x9E3779B1U;
+
 void
 preinitHttpParser()
 {
@@ -64,9 +69,60 @@ preinitHttpParser()
                              "Ignore unknown HTTP headers.");
 }
 
+static int
+headerHash(const char *restrict buf, int n)
+{
+    unsigned int h = n;
+    int i;
+    /* Folding with 0x20 is only exact for letters, which is fine since
+       a candidate is always checked with lwrcmp. */
+    for(i = 0; i < n; i++)
+        h = h * 31 + (buf[i] | 0x20);
+    return (h * headerSeed) >> (32 - LOG2_HEADER_TABLE_SIZE);
+}
+
+/* Returns the atom for a known header name without interning it, or
+   NULL if the name isn't one we handle specially. */
+
+static AtomPtr
+headerName(const char *restrict buf, int n)
+{
+    AtomPtr atom = headerTable[headerHash(buf, n)];
+    if(atom && atom->length == n && lwrcmp(atom->string, buf, n) == 0)
+        return atom;
+    return NULL;
+}
+
+static int
+headerListMember(const char *restrict buf, int n, AtomListPtr list)
+{
+    int i;
+    for(i = 0; i < list->length; i++) {
+        if(list->list[i]->length == n &&
+           lwrcmp(list->list[i]->string, buf, n) == 0)
+            return 1;
+    }
+    return 0;
+}
+
 void
 initHttpParser()
 {
+    AtomPtr *known[] = {
+        &atomConnection, &atomProxyConnection, &atomContentLength,
+        &atomHost, &atomAcceptRange, &atomTE,
+        &atomReferer, &atomProxyAuthenticate, &atomProxyAuthorization,
+        &atomKeepAlive, &atomTrailer, &atomUpgrade, &atomDate, &atomExpires,
+        &atomIfModifiedSince, &atomIfUnmodifiedSince, &atomIfRange,
+        &atomLastModified, &atomIfMatch, &atomIfNoneMatch, &atomAge,
+        &atomTransferEncoding, &atomETag, &atomCacheControl, &atomPragma,
+        &atomContentRange, &atomRange, &atomVia, &atomContentType,
+        &atomContentEncoding, &atomVary, &atomExpect, &atomAuthorization,
+        &atomSetCookie, &atomCookie, &atomCookie2,
+        &atomXPolipoDate, &atomXPolipoAccess, &atomXPolipoLocation,
+        &atomXPolipoBodyOffset
+    };
+    int i, n = sizeof(known) / sizeof(known[0]), tries;
 #define A(name, value) name = internAtom(value); if(!name) goto fail;
     /* These must be in lower-case */
     A(atomConnection, "connection");
@@ -110,7 +166,25 @@ initHttpParser()
     A(atomXPolipoLocation, "x-polipo-location");
     A(atomXPolipoBodyOffset, "x-polipo-body-offset");
 #undef A
-    return;
+
+    /* Look for a multiplier that puts every known name in its own
+       slot.  With a few dozen names and 256 slots, this takes a few
+       dozen tries at most. */
+    for(tries = 0; tries < 10000; tries++) {
+        memset(headerTable, 0, sizeof(headerTable));
+        for(i = 0; i < n; i++) {
+            AtomPtr atom = *known[i];
+            int h = headerHash(atom->string, atom->length);
+            if(headerTable[h])
+                break;
+            headerTable[h] = atom;
+        }
+        if(i >= n)
+            return;
+        headerSeed += 2;
+    }
+    do_log(L_ERROR, "Couldn't build header table.\n");
+    exit(1);
 
  fail:
     do_log(L_ERROR, "Couldn't allocate atom.\n");
@@ -589,13 +663,40 @@ findEndOfHeaders(const char *restrict buf, int from, int to, int *body_return)
                 i++;
             }
         } else {
+            /* Skip to the next LF in one go; the C library's memchr
+               is vectorised on all the platforms we care about. */
+            const char *p = memchr(buf + i, '\n', to - i);
+            if(p == NULL)
+                return -1;
             eol = 0;
-            i++;
+            i = p - buf;
+            if(buf[i - 1] == '\r')
+                i--;
         }
     }
     return -1;
 }
 
+/* Like findEndOfHeaders, but resumes from where the previous call on
+   the same buffer gave up.  *scanned must be 0 when a new message
+   starts; it is reset to 0 once the end of headers is found. */
+
+int
+findEndOfHeadersResume(const char *restrict buf, int *scanned, int to,
+                       int *body_return)
+{
+    int from, rc;
+
+    /* Back up far enough to see a terminator straddling the boundary. */
+    from = MAX(0, MIN(*scanned, to) - 3);
+    if(from > 0 && buf[from] == '\n' && buf[from - 1] == '\r')
+        from--;
+
+    rc = findEndOfHeaders(buf, from, to, body_return);
+    *scanned = rc < 0 ? to : 0;
+    return rc;
+}
+
 static int
 parseContentRange(const char *restrict buf, int i, 
                   int *from_return, int *to_return, int *full_len_return)
@@ -814,7 +915,7 @@ httpParseHeaders(int client, AtomPtr url,
         if(name_start < 0)
             continue;
 
-        name = internAtomLowerN(buf + name_start, name_end - name_start);
+        name = headerName(buf + name_start, name_end - name_start);
 
         if(name == atomConnection) {
             j = getNextTokenInList(buf, value_start, 
@@ -852,9 +953,6 @@ httpParseHeaders(int client, AtomPtr url,
             }
         } else if(name == atomCacheControl)
             haveCacheControl = 1;
-
-        releaseAtom(name);
-        name = NULL;
     }
     
     i = start;
@@ -878,7 +976,7 @@ httpParseHeaders(int client, AtomPtr url,
                 goto fail;
         }
 
-        name = internAtomLowerN(buf + name_start, name_end - name_start);
+        name = headerName(buf + name_start, name_end - name_start);
         
         if(name == atomProxyConnection) {
             j = getNextTokenInList(buf, value_start, 
@@ -1253,8 +1351,11 @@ httpParseHeaders(int client, AtomPtr url,
                    name != atomAcceptRange && name != atomTE &&
                    name != atomProxyAuthenticate &&
                    name != atomKeepAlive &&
-                   (!hopToHop || !atomListMember(name, hopToHop)) &&
-                   !atomListMember(name, censoredHeaders)) {
+                   (!hopToHop ||
+                    !headerListMember(buf + name_start,
+                                      name_end - name_start, hopToHop)) &&
+                   !headerListMember(buf + name_start, name_end - name_start,
+                                     censoredHeaders)) {
                     int h;
                     while(hbuf_length > hbuf_size - 2)
                         RESIZE_HBUF();
@@ -1270,8 +1371,6 @@ httpParseHeaders(int client, AtomPtr url,
                 }
             }
         }
-        releaseAtom(name);
-        name = NULL;
     }
 
     if(headers_return) {
@@ -1360,7 +1459,6 @@ httpParseHeaders(int client, AtomPtr url,
 
  fail:
     if(hbuf && hbuf != hbuf_small) free(hbuf);
-    if(name) releaseAtom(name);
     if(etag) free(etag);
     if(location) free(location);
     if(via) releaseAtom(via);
@@ -41,6 +41,8 @@ int httpParseServerFirstLine(const char *buf,
                              AtomPtr *message_return);
 
 int findEndOfHeaders(const char *buf, int from, int to, int *body_return);
+int findEndOfHeadersResume(const char *buf, int *scanned, int to,
+                           int *body_return);
 
 int httpParseHeaders(int, AtomPtr, const char *, int, HTTPRequestPtr,
                      AtomPtr*, int*, CacheControlPtr, 
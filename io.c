@@ -22,6 +22,10 @@ THE SOFTWARE.
 
 #include "polipo.h"
 
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #ifdef HAVE_IPv6
 #ifdef IPV6_PREFER_TEMPADDR
 #define HAVE_IPV6_PREFER_TEMPADDR 1
@@ -32,6 +36,9 @@ THE SOFTWARE.
 int useTemporarySourceAddress = 1;
 #endif
 
+int acceptBatch = 16;
+int connectRaceDelay = 250;
+
 void
 preinitIo()
 {
@@ -41,6 +48,15 @@ preinitIo()
                              "Prefer IPv6 temporary source address.");
 #endif
 
+#ifdef HAVE_IO_URING
+    CONFIG_VARIABLE(useIoUring, CONFIG_BOOLEAN,
+                    "Use io_uring rather than epoll.");
+#endif
+    CONFIG_VARIABLE_SETTABLE(acceptBatch, CONFIG_INT, configIntSetter,
+                             "Max number of connections accepted at once.");
+    CONFIG_VARIABLE_SETTABLE(connectRaceDelay, CONFIG_INT, configIntSetter,
+                             "Msecs before racing another server address.");
+
 #ifdef HAVE_WINSOCK
     /* Load the winsock dll */
     WSADATA wsaData;
@@ -444,6 +460,390 @@ serverSocket(int af)
     return fd;
 }
 
+#ifdef HAVE_SENDFILE
+
+/* Copy len bytes starting at offset from the file from to the socket
+   fd without going through userspace.  Like do_stream with IO_NOTNOW,
+   this waits for the poll loop before doing anything; the handler is
+   called after every successful write, and should return 0 until
+   request->sent reaches request->len. */
+
+FdEventHandlerPtr
+do_sendfile(int fd, int from, off_t offset, int len,
+            int (*handler)(int, FdEventHandlerPtr, SendfileRequestPtr),
+            void *data)
+{
+    SendfileRequestRec request;
+    FdEventHandlerPtr event;
+    int done;
+
+    request.fd = fd;
+    request.from = from;
+    request.offset = offset;
+    request.len = len;
+    request.sent = 0;
+    request.handler = handler;
+    request.data = data;
+
+    event = makeFdEvent(fd, POLLOUT, do_scheduled_sendfile,
+                        sizeof(SendfileRequestRec), &request);
+    if(!event) {
+        done = (*handler)(-ENOMEM, NULL, &request);
+        assert(done);
+        return NULL;
+    }
+    return registerFdEventHelper(event);
+}
+
+int
+do_scheduled_sendfile(int status, FdEventHandlerPtr event)
+{
+    SendfileRequestPtr request = (SendfileRequestPtr)&event->data;
+    ssize_t rc;
+    int done;
+
+    if(status) {
+        done = request->handler(status, event, request);
+        return done;
+    }
+
+    rc = sendfile(request->fd, request->from, &request->offset,
+                  request->len - request->sent);
+    if(rc > 0) {
+        request->sent += rc;
+        done = request->handler(0, event, request);
+        return done;
+    } else if(rc == 0 || errno == EPIPE) {
+        /* The file is shorter than we expected, or the client went away. */
+        done = request->handler(1, event, request);
+    } else if(errno == EAGAIN || errno == EINTR) {
+        return 0;
+    } else {
+        done = request->handler(-errno, event, request);
+    }
+    assert(done);
+    return done;
+}
+
+#endif
+
+static int
+connectHost(int fd, HostAddressPtr host, int port)
+{
+    struct sockaddr_in servaddr;
+#ifdef HAVE_IPv6
+    struct sockaddr_in6 servaddr6;
+#endif
+
+    switch(host->af) {
+    case 4:
+        memset(&servaddr, 0, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_port = htons(port);
+        memcpy(&servaddr.sin_addr, &host->data, sizeof(struct in_addr));
+        return connect(fd, (struct sockaddr*)&servaddr, sizeof(servaddr));
+    case 6:
+#ifdef HAVE_IPv6
+        memset(&servaddr6, 0, sizeof(servaddr6));
+        servaddr6.sin6_family = AF_INET6;
+        servaddr6.sin6_port = htons(port);
+        memcpy(&servaddr6.sin6_addr, &host->data, sizeof(struct in6_addr));
+        return connect(fd, (struct sockaddr*)&servaddr6, sizeof(servaddr6));
+#else
+        errno = EAFNOSUPPORT;
+        return -1;
+#endif
+    default:
+        abort();
+    }
+}
+
+/* Connection racing, as in RFC 8305.  When a host has more than one
+   address, we try them in an order that alternates between address
+   families, and start a new attempt every connectRaceDelay
+   milliseconds, or as soon as an attempt fails, without abandoning
+   the attempts in flight.  The first socket to connect wins. */
+
+typedef struct _ConnectRace {
+    AtomPtr addr;
+    int firstindex;
+    int port;
+    int (*handler)(int, FdEventHandlerPtr, ConnectRequestPtr);
+    void *data;
+    int n;
+    int next;
+    int pending;
+    int error;
+    int *order;
+    int *fds;
+    FdEventHandlerPtr *attempts;
+    TimeEventHandlerPtr timeout;
+} ConnectRaceRec, *ConnectRacePtr;
+
+typedef struct _ConnectAttempt {
+    ConnectRacePtr race;
+    int k;
+} ConnectAttemptRec, *ConnectAttemptPtr;
+
+static int raceStart(ConnectRacePtr race);
+
+static HostAddressPtr
+raceHost(ConnectRacePtr race, int k)
+{
+    return (HostAddressPtr)&race->addr->string[1 + race->order[k] *
+                                               sizeof(HostAddressRec)];
+}
+
+static int
+raceTimeoutHandler(TimeEventHandlerPtr event)
+{
+    ConnectRacePtr race = *(ConnectRacePtr*)event->data;
+    int k;
+
+    race->timeout = NULL;
+    /* Failed attempts are only closed here, once the event loop has
+       forgotten about them. */
+    for(k = 0; k < race->next; k++) {
+        if(race->fds[k] >= 0 && race->attempts[k] == NULL) {
+            CLOSE(race->fds[k]);
+            race->fds[k] = -1;
+        }
+    }
+    raceStart(race);
+    return 1;
+}
+
+static void
+raceSchedule(ConnectRacePtr race, int msecs)
+{
+    if(race->timeout)
+        cancelTimeEvent(race->timeout);
+    race->timeout = scheduleTimeEventMsec(msecs, raceTimeoutHandler,
+                                          sizeof(race), &race);
+    if(race->timeout == NULL)
+        do_log(L_ERROR, "Couldn't schedule connection race.\n");
+}
+
+/* Terminate the race, keeping the socket for attempt k if k >= 0. */
+
+static int
+raceDone(ConnectRacePtr race, int k, FdEventHandlerPtr event)
+{
+    ConnectRequestRec request;
+    int j, done;
+
+    if(race->timeout) {
+        cancelTimeEvent(race->timeout);
+        race->timeout = NULL;
+    }
+
+    for(j = 0; j < race->next; j++) {
+        if(j == k)
+            continue;
+        if(race->attempts[j])
+            unregisterFdEvent(race->attempts[j]);
+        if(race->fds[j] >= 0)
+            CLOSE(race->fds[j]);
+    }
+
+    request.addr = race->addr;
+    request.firstindex = race->firstindex;
+    request.port = race->port;
+    request.handler = race->handler;
+    request.data = race->data;
+    if(k >= 0) {
+        request.fd = race->fds[k];
+        request.index = race->order[k];
+        request.af = raceHost(race, k)->af;
+        done = request.handler(1, event, &request);
+    } else {
+        request.fd = -1;
+        request.index = race->firstindex;
+        request.af = raceHost(race, 0)->af;
+        done = request.handler(-race->error, NULL, &request);
+    }
+    assert(done);
+
+    releaseAtom(race->addr);
+    free(race->order);
+    free(race->fds);
+    free(race->attempts);
+    free(race);
+    return 1;
+}
+
+static int
+raceConnectHandler(int status, FdEventHandlerPtr event)
+{
+    ConnectAttemptPtr attempt = (ConnectAttemptPtr)&event->data;
+    ConnectRacePtr race = attempt->race;
+    int k = attempt->k;
+    int rc;
+
+    if(status == 0) {
+        rc = connectHost(race->fds[k], raceHost(race, k), race->port);
+        if(rc >= 0 || errno == EISCONN) {
+            race->attempts[k] = NULL;
+            race->pending--;
+            return raceDone(race, k, event);
+        }
+        if(errno == EINPROGRESS || errno == EALREADY || errno == EINTR)
+            return 0;
+        else if(errno == EFAULT || errno == EBADF)
+            abort();
+        race->error = errno;
+    } else {
+        race->error = -status;
+    }
+
+    do_log_error(D_SERVER_CONN, race->error, "Connection attempt failed");
+    race->attempts[k] = NULL;
+    race->pending--;
+    /* Don't start the next attempt straight away: the socket we're
+       abandoning is still registered with the event loop. */
+    raceSchedule(race, 0);
+    return 1;
+}
+
+/* Start attempts until one of them is in progress.  Returns 1 if the
+   race is over. */
+
+static int
+raceStart(ConnectRacePtr race)
+{
+    ConnectAttemptRec attempt;
+    FdEventHandlerPtr event;
+    int k, fd, rc;
+
+    while(race->next < race->n) {
+        k = race->next++;
+        fd = serverSocket(raceHost(race, k)->af);
+        if(fd < 0) {
+            race->error = errno;
+            continue;
+        }
+        race->fds[k] = fd;
+
+        rc = connectHost(fd, raceHost(race, k), race->port);
+        if(rc >= 0 || errno == EISCONN)
+            return raceDone(race, k, NULL);
+
+        if(errno != EINPROGRESS && errno != EINTR) {
+            race->error = errno;
+            CLOSE(fd);
+            race->fds[k] = -1;
+            continue;
+        }
+
+        attempt.race = race;
+        attempt.k = k;
+        /* POLLIN is apparently needed on Windows */
+        event = registerFdEvent(fd, POLLIN | POLLOUT, raceConnectHandler,
+                                sizeof(ConnectAttemptRec), &attempt);
+        if(event == NULL) {
+            race->error = ENOMEM;
+            CLOSE(fd);
+            race->fds[k] = -1;
+            continue;
+        }
+        race->attempts[k] = event;
+        race->pending++;
+        if(race->next < race->n)
+            raceSchedule(race, connectRaceDelay);
+        return 0;
+    }
+
+    if(race->pending == 0)
+        return raceDone(race, -1, NULL);
+    return 0;
+}
+
+/* Index of the next address at or after *i (counting from first)
+   whose family is (or, if same is false, isn't) af. */
+
+static int
+raceNextAddress(AtomPtr addr, int n, int first, int *i, int af, int same)
+{
+    HostAddressPtr host;
+    int j;
+
+    while(*i < n) {
+        j = (first + *i) % n;
+        (*i)++;
+        host = (HostAddressPtr)&addr->string[1 + j * sizeof(HostAddressRec)];
+        if((host->af == af) == !!same)
+            return j;
+    }
+    return -1;
+}
+
+static void
+do_race_connect(AtomPtr addr, int index, int port,
+                int (*handler)(int, FdEventHandlerPtr, ConnectRequestPtr),
+                void *data)
+{
+    ConnectRacePtr race;
+    ConnectRequestRec request;
+    int n = (addr->length - 1) / sizeof(HostAddressRec);
+    int af = addr->string[1 + index * sizeof(HostAddressRec)];
+    int i1 = 0, i2 = 0, j, k, done;
+
+    race = malloc(sizeof(ConnectRaceRec));
+    if(race) {
+        race->order = malloc(n * sizeof(int));
+        race->fds = malloc(n * sizeof(int));
+        race->attempts = calloc(n, sizeof(FdEventHandlerPtr));
+    }
+    if(race == NULL ||
+       race->order == NULL || race->fds == NULL || race->attempts == NULL) {
+        if(race) {
+            free(race->order);
+            free(race->fds);
+            free(race->attempts);
+            free(race);
+        }
+        request.fd = -1;
+        request.af = af;
+        request.addr = addr;
+        request.firstindex = request.index = index;
+        request.port = port;
+        request.handler = handler;
+        request.data = data;
+        done = (*handler)(-ENOMEM, NULL, &request);
+        assert(done);
+        releaseAtom(addr);
+        return;
+    }
+
+    /* Alternate between families, starting with the address that
+       worked last time. */
+    for(k = 0; k < n; k++) {
+        j = -1;
+        if(k % 2 == 0)
+            j = raceNextAddress(addr, n, index, &i1, af, 1);
+        if(j < 0)
+            j = raceNextAddress(addr, n, index, &i2, af, 0);
+        if(j < 0)
+            j = raceNextAddress(addr, n, index, &i1, af, 1);
+        assert(j >= 0);
+        race->order[k] = j;
+        race->fds[k] = -1;
+    }
+
+    race->addr = addr;
+    race->firstindex = index;
+    race->port = port;
+    race->handler = handler;
+    race->data = data;
+    race->n = n;
+    race->next = 0;
+    race->pending = 0;
+    race->error = EHOSTUNREACH;
+    race->timeout = NULL;
+
+    raceStart(race);
+}
+
 FdEventHandlerPtr
 do_connect(AtomPtr addr, int index, int port,
            int (*handler)(int, FdEventHandlerPtr, ConnectRequestPtr),
@@ -459,6 +859,12 @@ do_connect(AtomPtr addr, int index, int port,
     if(index >= (addr->length - 1)/ sizeof(HostAddressRec))
         index = 0;
 
+    if(connectRaceDelay >= 0 &&
+       (addr->length - 1) / sizeof(HostAddressRec) > 1) {
+        do_race_connect(addr, index, port, handler, data);
+        return NULL;
+    }
+
     request.firstindex = index;
     request.port = port;
     request.handler = handler;
@@ -512,10 +918,6 @@ do_scheduled_connect(int status, FdEventHandlerPtr event)
     int done;
     int rc;
     HostAddressPtr host;
-    struct sockaddr_in servaddr;
-#ifdef HAVE_IPv6
-    struct sockaddr_in6 servaddr6;
-#endif
 
     assert(addr->length > 0 && addr->string[0] == DNS_A);
     assert(addr->length % sizeof(HostAddressRec) == 1);
@@ -563,34 +965,11 @@ do_scheduled_connect(int status, FdEventHandlerPtr event)
                 return 1;
             }
         }
+        /* The event loop might be keeping track of the old socket. */
+        resetFdEvent(request->fd);
         request->af = host->af;
     }
-    switch(host->af) {
-    case 4:
-        memset(&servaddr, 0, sizeof(servaddr));
-        servaddr.sin_family = AF_INET;
-        servaddr.sin_port = htons(request->port);
-        memcpy(&servaddr.sin_addr, &host->data, sizeof(struct in_addr));
-        rc = connect(request->fd,
-                     (struct sockaddr*)&servaddr, sizeof(servaddr));
-        break;
-    case 6:
-#ifdef HAVE_IPv6
-        memset(&servaddr6, 0, sizeof(servaddr6));
-        servaddr6.sin6_family = AF_INET6;
-        servaddr6.sin6_port = htons(request->port);
-        memcpy(&servaddr6.sin6_addr, &host->data, sizeof(struct in6_addr));
-        rc = connect(request->fd,
-                     (struct sockaddr*)&servaddr6, sizeof(servaddr6));
-#else
-        rc = -1;
-        errno = EAFNOSUPPORT;
-#endif
-        break;
-    default:
-        abort();
-    }
-        
+    rc = connectHost(request->fd, host, request->port);
     if(rc >= 0 || errno == EISCONN) {
         done = request->handler(1, event, request);
         assert(done);
@@ -656,30 +1035,93 @@ schedule_accept(int fd,
     return event;
 }
 
+/* Statistics about accepting connections, used for tuning
+   acceptBatch. */
+static int acceptWakeups = 0, acceptCount = 0, acceptMax = 0;
+static int acceptExhausted = 0, acceptBacklogMax = -1;
+static long long acceptTime = 0;
+
+/* Accept up to acceptBatch connections, which are passed to the handler
+   in non-blocking mode.  If the batch is used up, the remaining
+   connections wait for the next iteration of the event loop. */
 int
 do_scheduled_accept(int status, FdEventHandlerPtr event)
 {
     AcceptRequestPtr request = (AcceptRequestPtr)&event->data;
-    int rc, done;
+    int rc, done = 0, n = 0;
     unsigned len;
     struct sockaddr_in addr;
+    struct timeval start, end;
 
     if(status) {
         done = request->handler(status, event, request);
         if(done) return done;
     }
 
-    len = sizeof(struct sockaddr_in);
-
-    rc = accept(request->fd, (struct sockaddr*)&addr, &len);
-
-    if(rc >= 0)
+    gettimeofday(&start, NULL);
+    while(n < MAX(acceptBatch, 1)) {
+        len = sizeof(struct sockaddr_in);
+#ifdef HAVE_ACCEPT4
+        rc = accept4(request->fd, (struct sockaddr*)&addr, &len,
+                     SOCK_NONBLOCK);
+#else
+        rc = accept(request->fd, (struct sockaddr*)&addr, &len);
+        if(rc >= 0 && setNonblocking(rc, 1) < 0) {
+            do_log_error(L_WARN, errno, "Couldn't set non blocking mode");
+            CLOSE(rc);
+            n++;
+            continue;
+        }
+#endif
+        if(rc < 0) {
+            done = request->handler(-errno, event, request);
+            break;
+        }
+        n++;
         done = request->handler(rc, event, request);
-    else
-        done = request->handler(-errno, event, request);
+        if(done)
+            break;
+    }
+
+    if(n > 0) {
+        acceptWakeups++;
+        acceptCount += n;
+        acceptMax = MAX(acceptMax, n);
+    }
+    if(n >= MAX(acceptBatch, 1) && !done) {
+#if defined(__linux__) && defined(TCP_INFO)
+        /* For a listening socket, tcpi_unacked is the number of
+           connections waiting to be accepted. */
+        struct tcp_info info;
+        socklen_t ilen = sizeof(info);
+        if(getsockopt(request->fd, IPPROTO_TCP, TCP_INFO, &info, &ilen) >= 0)
+            acceptBacklogMax = MAX(acceptBacklogMax, (int)info.tcpi_unacked);
+#endif
+        acceptExhausted++;
+    }
+    gettimeofday(&end, NULL);
+    acceptTime += timeval_minus_usec(&end, &start);
     return done;
 }
 
+void
+acceptPrintStatistics(ObjectPtr object)
+{
+    if(acceptWakeups == 0)
+        return;
+    objectPrintf(object, object->size,
+                 "<p>Accepted %d connections in %d batches "
+                 "(%d max, limit %d), in %lld ms.  "
+                 "The limit was reached %d times",
+                 acceptCount, acceptWakeups, acceptMax, acceptBatch,
+                 acceptTime / 1000, acceptExhausted);
+    if(acceptBacklogMax >= 0)
+        objectPrintf(object, object->size,
+                     ", with up to %d connections left in the backlog",
+                     acceptBacklogMax);
+    objectPrintf(object, object->size, ".</p>\n");
+}
+
 FdEventHandlerPtr
 create_listener(char *address, int port,
                 int (*handler)(int, FdEventHandlerPtr, AcceptRequestPtr),
@@ -728,6 +1170,16 @@ create_listener(char *address, int port,
     if(rc < 0) do_log_error(L_WARN, errno, "Couldn't set SO_REUSEADDR");
 #endif
 
+#ifdef SO_REUSEPORT
+    /* Let every worker process bind its own listening socket, and have
+       the kernel spread incoming connections between them. */
+    if(workerProcesses > 0) {
+        rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                        (char *)&one, sizeof(one));
+        if(rc < 0) do_log_error(L_WARN, errno, "Couldn't set SO_REUSEPORT");
+    }
+#endif
+
     if(inet6) {
 #ifdef HAVE_IPv6
         rc = setV6only(fd, 0);
@@ -779,6 +1231,13 @@ create_listener(char *address, int port,
         assert(done);
         return NULL;
     }
+
+#ifdef __linux__
+    /* Accepted sockets inherit TCP_NODELAY from the listener. */
+    rc = setNodelay(fd, 1);
+    if(rc < 0)
+        do_log_error(L_WARN, errno, "Couldn't disable Nagle's algorithm");
+#endif
         
     rc = listen(fd, 1024);
     if(rc < 0) {
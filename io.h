@@ -63,6 +63,16 @@ typedef struct _StreamRequest {
     void *data;
 } StreamRequestRec, *StreamRequestPtr;
 
+typedef struct _SendfileRequest {
+    int fd;
+    int from;
+    off_t offset;
+    int len;
+    int sent;
+    int (*handler)(int, FdEventHandlerPtr, struct _SendfileRequest*);
+    void *data;
+} SendfileRequestRec, *SendfileRequestPtr;
+
 typedef struct _ConnectRequest {
     int fd;
     int af;
@@ -80,6 +90,9 @@ typedef struct _AcceptRequest {
     void *data;
 } AcceptRequestRec, *AcceptRequestPtr;
 
+extern int acceptBatch;
+extern int connectRaceDelay;
+
 void preinitIo();
 void initIo();
 
@@ -122,6 +135,15 @@ schedule_stream(int operation, int fd, int offset,
 int do_scheduled_stream(int, FdEventHandlerPtr);
 int streamRequestDone(StreamRequestPtr);
 
+#ifdef HAVE_SENDFILE
+FdEventHandlerPtr
+do_sendfile(int fd, int from, off_t offset, int len,
+            int (*handler)(int, FdEventHandlerPtr, SendfileRequestPtr),
+            void *data);
+
+int do_scheduled_sendfile(int, FdEventHandlerPtr);
+#endif
+
 FdEventHandlerPtr
 do_connect(struct _Atom *addr, int index, int port,
            int (*handler)(int, FdEventHandlerPtr, ConnectRequestPtr),
@@ -140,6 +162,8 @@ schedule_accept(int fd,
                 void* data);
 
 int do_scheduled_accept(int, FdEventHandlerPtr event);
+struct _Object;
+void acceptPrintStatistics(struct _Object *object);
 
 FdEventHandlerPtr
 create_listener(char *address, int port,
@@ -200,7 +200,23 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      "<p>There are %d public and %d private objects "
                      "currently in memory using %d KB in %d chunks "
                      "(%d KB allocated).</p>\n"
-                     "<p>There are %d atoms.</p>"
+                     "<p>There are %d atoms.</p>\n",
+                     proxyName->string, proxyPort,
+                     cacheIsShared ? "shared" : "private",
+                     proxyName->string, proxyPort,
+                     proxyOffline ? "off line" :
+                     (relaxTransparency ? 
+                      "on line (transparency relaxed)" :
+                      "on line"),
+                     publicObjectCount, privateObjectCount,
+                     used_chunks * CHUNK_SIZE / 1024, used_chunks,
+                     totalChunkArenaSize() / 1024,
+                     used_atoms);
+        objectPrintStatistics(object);
+        diskCachePrintStatistics(object);
+        acceptPrintStatistics(object);
+        dnsPrintStatistics(object);
+        objectPrintf(object, object->size,
                      "<p><form method=POST action=\"/polipo/status?\">"
                      "<input type=submit name=\"init-forbidden\" "
                      "value=\"Read forbidden file\"></form>\n"
@@ -217,18 +233,7 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      "<input type=submit name=\"free-chunk-arenas\" "
                      "value=\"Free chunk arenas\"></form></p>\n"
                      "<p><a href=\"/polipo/\">back</a></p>"
-                     "</body></html>\n",
-                     proxyName->string, proxyPort,
-                     cacheIsShared ? "shared" : "private",
-                     proxyName->string, proxyPort,
-                     proxyOffline ? "off line" :
-                     (relaxTransparency ? 
-                      "on line (transparency relaxed)" :
-                      "on line"),
-                     publicObjectCount, privateObjectCount,
-                     used_chunks * CHUNK_SIZE / 1024, used_chunks,
-                     totalChunkArenaSize() / 1024,
-                     used_atoms);
+                     "</body></html>\n");
         object->expires = current_time.tv_sec;
         object->length = object->size;
     } else if(matchUrl("/polipo/config", object)) {
@@ -550,6 +555,7 @@ fillSpecialObject(ObjectPtr object, void (*fn)(FILE*, char*), void* closure)
 
     if(pid > 0) {
         SpecialRequestPtr request;
+        forkedEvents();
         close(filedes[1]);
         do {
             rc = sigprocmask(SIG_SETMASK, &old_mask, NULL);
@@ -659,7 +665,7 @@ specialRequestHandler(int status,
     return 1;
 
  done:
-    close(request->fd);
+    CLOSE(request->fd);
     dispose_chunk(request->buf);
     releaseNotifyObject(request->object);
     /* That's a blocking wait.  It shouldn't block for long, as we've
@@ -26,6 +26,10 @@ THE SOFTWARE.
 #include <syslog.h>
 #endif
 
+#ifdef HAVE_LOG_THREAD
+#include <pthread.h>
+#endif
+
 static int logLevel = LOGGING_DEFAULT;
 static int logSyslog = 0;
 static AtomPtr logFile = NULL;
@@ -33,6 +37,14 @@ static FILE *logF;
 static int logFilePermissions = 0640;
 int scrubLogs = 0;
 
+static AtomPtr accessLogFile = NULL;
+static int accessLogFd = -1;
+static char *accessLogBuf = NULL;
+static int accessLogLength = 0;
+static int accessLogFlushScheduled = 0;
+
+#define ACCESS_LOG_BUFFER_SIZE (16 * 1024)
+
 #ifdef HAVE_SYSLOG
 static AtomPtr logFacility = NULL;
 static int facility;
@@ -42,6 +54,45 @@ static int facility;
 #define XSTR(x) #x
 
 static void initSyslog(void);
+static void flushAccessLog(void);
+
+#ifdef HAVE_LOG_THREAD
+/* Messages for the log file may be written by a separate thread, so
+   that a slow disk doesn't stall the event loop.  The main thread
+   formats each message into a ring buffer at logRingEnd, and advances
+   logRingHead once it has queued a complete line; the writer thread
+   writes out everything up to the head in a single write, so that
+   lines from several worker processes don't get mixed up, and
+   advances logRingTail.  The indices only ever grow, and each is
+   written by a single thread, so no lock is needed to exchange data.
+   The mutex only protects sleeping and waking up, and handing over a
+   new log file after reopenLog.  The access log has a ring of its
+   own, which is filled a whole buffer of records at a time. */
+
+static int logBufferSize = 256 * 1024;
+static char *logRing = NULL;
+static unsigned long logRingHead = 0, logRingTail = 0, logRingEnd = 0;
+static int logWriterIdle = 0;
+/* 0 = not started, 1 = writer running, -1 = off */
+static int logWriterState = 0;
+static int logDropped = 0;
+/* The file the writer is using; logF is the one it should be using. */
+static FILE *logWriterF = NULL;
+#define ACCESS_RING_SIZE (4 * ACCESS_LOG_BUFFER_SIZE)
+static char *accessRing = NULL;
+static unsigned long accessRingHead = 0, accessRingTail = 0;
+/* The descriptor the writer is using; accessLogFd is the one it
+   should be using. */
+static int accessWriterFd = -1;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t logDrained = PTHREAD_COND_INITIALIZER;
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+/* Whether messages for the log file go through the writer. */
+#define logRingActive() (logWriterState == 1 && logRing != NULL)
+#endif
 
 #ifdef HAVE_SYSLOG
 static char *syslogBuf;
@@ -64,12 +115,19 @@ preinitLog()
                     "Access rights of the logFile.");
     CONFIG_VARIABLE_SETTABLE(scrubLogs, CONFIG_BOOLEAN, configIntSetter,
                              "If true, don't include URLs in logs.");
+    CONFIG_VARIABLE(accessLogFile, CONFIG_ATOM,
+                    "Access log file (no access log if empty).");
 
 #ifdef HAVE_SYSLOG
     CONFIG_VARIABLE(logSyslog, CONFIG_BOOLEAN, "Log to syslog.");
     CONFIG_VARIABLE(logFacility, CONFIG_ATOM, "Syslog facility to use.");
     logFacility = internAtom("user");
 #endif
+#ifdef HAVE_LOG_THREAD
+    CONFIG_VARIABLE(logBufferSize, CONFIG_INT,
+                    "Size of the buffer for writing the logFile from "
+                    "a separate thread (0 = write directly).");
+#endif
 
     logF = stderr;
 }
@@ -127,6 +185,23 @@ initLog(void)
             logF = NULL;
         }
     }
+
+    if(accessLogFile != NULL && accessLogFile->length > 0) {
+        accessLogFile = expandTilde(accessLogFile);
+        accessLogFd = open(accessLogFile->string,
+                           O_WRONLY | O_CREAT | O_APPEND, logFilePermissions);
+        if(accessLogFd < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't open access log file %s",
+                         accessLogFile->string);
+            exit(1);
+        }
+        accessLogBuf = malloc(ACCESS_LOG_BUFFER_SIZE);
+        if(accessLogBuf == NULL) {
+            do_log(L_ERROR, "Couldn't allocate access log buffer.\n");
+            exit(1);
+        }
+        atexit(flushAccessLog);
+    }
 }
 
 #ifdef HAVE_SYSLOG
@@ -352,9 +427,307 @@ initSyslog()
 }
 #endif
 
-/* Flush any messages waiting to be logged. */
+#ifdef HAVE_LOG_THREAD
+
+static void
+writeLogRing(int fd, char *ring, int size,
+             unsigned long tail, unsigned long head)
+{
+    struct iovec iov[2];
+    int i, n, rc;
+
+    while(tail != head) {
+        i = tail % size;
+        n = head - tail;
+        iov[0].iov_base = ring + i;
+        iov[0].iov_len = MIN(n, size - i);
+        iov[1].iov_base = ring;
+        iov[1].iov_len = n - iov[0].iov_len;
+        do {
+            rc = WRITEV(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        } while(rc < 0 && errno == EINTR);
+        if(rc <= 0)
+            break;              /* nothing sensible to do */
+        tail += rc;
+    }
+}
+
+static void *
+logWriterThread(void *dummy)
+{
+    unsigned long tail = logRingTail, head;
+    unsigned long atail = accessRingTail, ahead;
+    FILE *old;
+    int oldfd;
+
+    while(1) {
+        old = NULL;
+        oldfd = -1;
+        pthread_mutex_lock(&logLock);
+        while(1) {
+            if(logWriterF != logF) {
+                old = logWriterF;
+                logWriterF = logF;
+            }
+            if(accessWriterFd != accessLogFd) {
+                oldfd = accessWriterFd;
+                accessWriterFd = accessLogFd;
+            }
+            head = LOAD(logRingHead);
+            ahead = LOAD(accessRingHead);
+            if(head != tail || ahead != atail || old || oldfd >= 0)
+                break;
+            pthread_cond_broadcast(&logDrained);
+            /* Pairs with the check of logWriterIdle in logAppend and
+               queueAccessLog. */
+            STORE(logWriterIdle, 1);
+            if(LOAD(logRingHead) == tail && LOAD(accessRingHead) == atail)
+                pthread_cond_wait(&logWork, &logLock);
+            STORE(logWriterIdle, 0);
+        }
+        pthread_mutex_unlock(&logLock);
+
+        /* Closing a file may block too. */
+        if(old)
+            fclose(old);
+        if(oldfd >= 0)
+            close(oldfd);
+        if(head != tail) {
+            writeLogRing(fileno(logWriterF), logRing, logBufferSize,
+                         tail, head);
+            tail = head;
+            STORE(logRingTail, tail);
+        }
+        if(ahead != atail) {
+            writeLogRing(accessWriterFd, accessRing, ACCESS_RING_SIZE,
+                         atail, ahead);
+            atail = ahead;
+            STORE(accessRingTail, atail);
+        }
+    }
+    return NULL;
+}
+
+static void
+wakeLogWriter(void)
+{
+    pthread_mutex_lock(&logLock);
+    pthread_cond_signal(&logWork);
+    pthread_mutex_unlock(&logLock);
+}
+
+static void logAppend(const char *s, int n);
+
+static void
+waitLogWriter(void)
+{
+    pthread_mutex_lock(&logLock);
+    pthread_cond_signal(&logWork);
+    while(LOAD(logRingTail) != logRingHead || logWriterF != logF ||
+          LOAD(accessRingTail) != accessRingHead ||
+          accessWriterFd != accessLogFd)
+        pthread_cond_wait(&logDrained, &logLock);
+    pthread_mutex_unlock(&logLock);
+}
+
+/* Wait until the writer has caught up; used at exit. */
+static void
+drainLog(void)
+{
+    if(logWriterState != 1)
+        return;
+    flushAccessLog();
+    STORE(logRingHead, logRingEnd);
+    waitLogWriter();
+    if(logDropped > 0) {
+        logAppend("", 0);       /* just the count of dropped messages */
+        waitLogWriter();
+    }
+}
+
+/* The writer doesn't survive fork; the parent will write out whatever
+   is pending, and the child goes back to writing directly. */
+static void
+logAtForkChild(void)
+{
+    if(logWriterState == 1) {
+        pthread_mutex_init(&logLock, NULL);
+        pthread_cond_init(&logWork, NULL);
+        pthread_cond_init(&logDrained, NULL);
+        logRingTail = logRingHead = logRingEnd;
+        accessRingTail = accessRingHead;
+        logWriterState = -1;
+    }
+}
+
+/* Start writing the log file from a separate thread.  This is called
+   once the process has finished forking off workers. */
+void
+startLogWriter(void)
+{
+    pthread_t thread;
+    sigset_t ss, old;
+    int rc;
+
+    if(logWriterState != 0)
+        return;
+    logWriterState = -1;
+    if(logBufferSize <= 0)
+        return;
+
+    if(logF != NULL && logF != stderr) {
+        logRing = malloc(logBufferSize);
+        if(logRing == NULL) {
+            do_log(L_ERROR, "Couldn't allocate log buffer.\n");
+            return;
+        }
+        fflush(logF);
+    }
+    if(accessLogFd >= 0) {
+        accessRing = malloc(ACCESS_RING_SIZE);
+        if(accessRing == NULL) {
+            do_log(L_ERROR, "Couldn't allocate access log buffer.\n");
+            free(logRing);
+            logRing = NULL;
+            return;
+        }
+    }
+    if(logRing == NULL && accessRing == NULL)
+        return;
+    logWriterF = logF;
+    accessWriterFd = accessLogFd;
+
+    /* Signals are for the main thread. */
+    sigfillset(&ss);
+    pthread_sigmask(SIG_BLOCK, &ss, &old);
+    rc = pthread_create(&thread, NULL, logWriterThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(rc != 0) {
+        do_log_error(L_ERROR, rc, "Couldn't create log writer thread");
+        free(logRing);
+        logRing = NULL;
+        free(accessRing);
+        accessRing = NULL;
+        return;
+    }
+    pthread_detach(thread);
+    pthread_atfork(NULL, NULL, logAtForkChild);
+    atexit(drainLog);
+    logWriterState = 1;
+}
+
+static void
+logRingCopy(const char *s, int n)
+{
+    int i = logRingEnd % logBufferSize, m;
+
+    m = MIN(n, logBufferSize - i);
+    memcpy(logRing + i, s, m);
+    if(m < n)
+        memcpy(logRing, s + m, n - m);
+    logRingEnd += n;
+}
+
+/* Queue n bytes for the writer, or drop them if there's no room. */
+static void
+logAppend(const char *s, int n)
+{
+    char buf[100];
+    unsigned long used = logRingEnd - LOAD(logRingTail);
+    int m = 0;
+
+    if(logDropped > 0)
+        m = snprintf(buf, 100, "\n(%d log messages dropped)\n", logDropped);
+    if(used + m + n > (unsigned long)logBufferSize) {
+        logDropped++;
+        return;
+    }
+    if(m > 0) {
+        logRingCopy(buf, m);
+        logDropped = 0;
+    }
+    logRingCopy(s, n);
+
+    /* Publish complete lines, but don't let a very long line fill the
+       buffer. */
+    if(logRing[(logRingEnd - 1) % logBufferSize] == '\n' ||
+       logRingEnd - logRingHead > (unsigned long)logBufferSize / 2) {
+        STORE(logRingHead, logRingEnd);
+        if(LOAD(logWriterIdle))
+            wakeLogWriter();
+    }
+}
+
+/* Hand the buffered access log records over to the writer.  If it
+   has fallen that far behind, wait for it rather than lose records. */
+static void
+queueAccessLog(void)
+{
+    unsigned long head = accessRingHead;
+    int i, m;
+
+    if(head + accessLogLength - LOAD(accessRingTail) > ACCESS_RING_SIZE)
+        waitLogWriter();
+
+    i = head % ACCESS_RING_SIZE;
+    m = MIN(accessLogLength, ACCESS_RING_SIZE - i);
+    memcpy(accessRing + i, accessLogBuf, m);
+    if(m < accessLogLength)
+        memcpy(accessRing, accessLogBuf + m, accessLogLength - m);
+    STORE(accessRingHead, head + accessLogLength);
+    accessLogLength = 0;
+    if(LOAD(logWriterIdle))
+        wakeLogWriter();
+}
+
+/* Format a message into the ring buffer. */
+static void
+logAppendV(const char *f, va_list args)
+{
+    char buf[512];
+    char *b = buf;
+    int n;
+    va_list args_copy;
+
+    va_copy(args_copy, args);
+    n = vsnprintf(buf, 512, f, args_copy);
+    va_end(args_copy);
+    if(n >= 512) {
+        b = malloc(n + 1);
+        if(b == NULL)
+            return;
+        va_copy(args_copy, args);
+        n = vsnprintf(b, n + 1, f, args_copy);
+        va_end(args_copy);
+    }
+    if(n > 0)
+        logAppend(b, n);
+    if(b != buf)
+        free(b);
+}
+
+#else
+
+void
+startLogWriter(void)
+{
+    return;
+}
+
+#endif
+
+/* Flush any messages waiting to be logged.  If the log file is being
+   written by a separate thread, just make sure it's awake: there's
+   nothing buffered in this process that a child could duplicate. */
 void flushLog()
 {
+    flushAccessLog();
+
+#ifdef HAVE_LOG_THREAD
+    if(logWriterState == 1)
+        wakeLogWriter();
+    if(!logRingActive())
+#endif
     if(logF)
         fflush(logF);
 
@@ -380,12 +753,119 @@ reopenLog()
                          logFile->string);
             exit(1);
         }
-        fclose(logF);
-        logF = f;
+#ifdef HAVE_LOG_THREAD
+        if(logRingActive()) {
+            /* The writer switches over and closes the old file, which
+               may block; don't wait for it. */
+            pthread_mutex_lock(&logLock);
+            logF = f;
+            pthread_cond_signal(&logWork);
+            pthread_mutex_unlock(&logLock);
+        } else
+#endif
+        {
+            fclose(logF);
+            logF = f;
+        }
     }
 
     if(logSyslog)
         initSyslog();
+
+    if(accessLogFd >= 0) {
+        int fd;
+        flushAccessLog();
+        fd = open(accessLogFile->string,
+                  O_WRONLY | O_CREAT | O_APPEND, logFilePermissions);
+        if(fd < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't reopen access log file %s",
+                         accessLogFile->string);
+        } else {
+#ifdef HAVE_LOG_THREAD
+            if(logWriterState == 1 && accessRing != NULL) {
+                /* The writer closes the old descriptor. */
+                pthread_mutex_lock(&logLock);
+                accessLogFd = fd;
+                pthread_cond_signal(&logWork);
+                pthread_mutex_unlock(&logLock);
+            } else
+#endif
+            {
+                close(accessLogFd);
+                accessLogFd = fd;
+            }
+        }
+    }
+}
+
+/* The access log is written in whole records, a buffer at a time, so
+   that records from several workers never interleave.  If the log
+   writer thread is running, the buffer is passed on to it, and the
+   event loop only writes directly when there is no writer. */
+
+int
+accessLogging(void)
+{
+    return accessLogFd >= 0;
+}
+
+static void
+flushAccessLog(void)
+{
+    int rc, done = 0;
+
+    if(accessLogLength <= 0)
+        return;
+
+#ifdef HAVE_LOG_THREAD
+    if(logWriterState == 1 && accessRing != NULL) {
+        queueAccessLog();
+        return;
+    }
+#endif
+
+    while(done < accessLogLength) {
+        rc = write(accessLogFd, accessLogBuf + done, accessLogLength - done);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            do_log_error(L_ERROR, errno, "Couldn't write access log");
+            break;
+        }
+        done += rc;
+    }
+    accessLogLength = 0;
+}
+
+static int
+flushAccessLogHandler(TimeEventHandlerPtr event)
+{
+    accessLogFlushScheduled = 0;
+    flushAccessLog();
+    return 1;
+}
+
+void
+logAccess(const char *s, int n)
+{
+    if(accessLogFd < 0)
+        return;
+
+    if(n > ACCESS_LOG_BUFFER_SIZE - accessLogLength) {
+        flushAccessLog();
+        if(n > ACCESS_LOG_BUFFER_SIZE)
+            n = ACCESS_LOG_BUFFER_SIZE;
+    }
+    memcpy(accessLogBuf + accessLogLength, s, n);
+    accessLogLength += n;
+
+    /* Don't let a quiet proxy sit on its records for long. */
+    if(!accessLogFlushScheduled) {
+        TimeEventHandlerPtr event;
+        event = scheduleTimeEvent(1, flushAccessLogHandler, 0, NULL);
+        if(event)
+            accessLogFlushScheduled = 1;
+    }
 }
 
 void
@@ -405,8 +885,12 @@ really_do_log_v(int type, const char *f, va_list args)
     va_list args_copy;
 
     if(type & LOGGING_MAX & logLevel) {
-        if(logF)
-        {
+#ifdef HAVE_LOG_THREAD
+        if(logRingActive())
+            logAppendV(f, args);
+        else
+#endif
+        if(logF) {
             va_copy(args_copy, args);
             vfprintf(logF, f, args_copy);
             va_end(args_copy);
@@ -441,6 +925,14 @@ really_do_log_error_v(int type, int e, const char *f, va_list args)
         if(es == NULL)
             es = "Unknown error";
 
+#ifdef HAVE_LOG_THREAD
+        if(logRingActive()) {
+            logAppendV(f, args);
+            logAppend(": ", 2);
+            logAppend(es, strlen(es));
+            logAppend("\n", 1);
+        } else
+#endif
         if(logF) {
             va_copy(args_copy, args);
             vfprintf(logF, f, args_copy);
@@ -476,6 +968,11 @@ void
 really_do_log_n(int type, const char *s, int n)
 {
     if((type & LOGGING_MAX & logLevel) != 0) {
+#ifdef HAVE_LOG_THREAD
+        if(logRingActive())
+            logAppend(s, n);
+        else
+#endif
         if(logF) {
             fwrite(s, n, 1, logF);
         }
@@ -52,8 +52,11 @@ extern int scrubLogs;
 void preinitLog(void);
 void initLog(void);
 void reopenLog(void);
+void startLogWriter(void);
 void flushLog(void);
 int loggingToStderr(void);
+int accessLogging(void);
+void logAccess(const char *s, int n);
 
 void really_do_log(int type, const char *f, ...)
     ATTRIBUTE ((format (printf, 2, 3)));
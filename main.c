@@ -25,6 +25,7 @@ THE SOFTWARE.
 AtomPtr configFile = NULL;
 AtomPtr pidFile = NULL;
 int daemonise = 0;
+int workerProcesses = 0;
 
 static void
 usage(char *argv0)
@@ -45,10 +46,13 @@ main(int argc, char **argv)
     int i;
     int rc;
     int expire = 0, printConfig = 0;
+    int worker;
 
     initAtoms();
     CONFIG_VARIABLE(daemonise, CONFIG_BOOLEAN, "Run as a daemon");
     CONFIG_VARIABLE(pidFile, CONFIG_ATOM, "File with pid of running daemon.");
+    CONFIG_VARIABLE(workerProcesses, CONFIG_INT,
+                    "Number of worker processes (0 = don't fork).");
 
     preinitChunks();
     preinitLog();
@@ -61,6 +65,7 @@ main(int argc, char **argv)
     preinitLocal();
     preinitForbidden();
     preinitSocks();
+    preinitState();
 
     i = 1;
     while(i < argc) {
@@ -149,21 +154,28 @@ main(int argc, char **argv)
         exit(0);
     }
 
+    initState();
+
     if(daemonise)
         do_daemonise(loggingToStderr());
 
     if(pidFile)
         writePid(pidFile->string);
 
+    /* The supervisor removes the pid file once all workers are gone. */
+    worker = runWorkers(workerProcesses, pidFile ? pidFile->string : NULL);
+    startLogWriter();
+
     listener = create_listener(proxyAddress->string, 
                                proxyPort, httpAccept, NULL);
     if(!listener) {
-        if(pidFile) unlink(pidFile->string);
+        if(pidFile && !worker) unlink(pidFile->string);
         exit(1);
     }
 
     eventLoop();
 
-    if(pidFile) unlink(pidFile->string);
+    writeState();
+    if(pidFile && !worker) unlink(pidFile->string);
     return 0;
 }
@@ -26,8 +26,57 @@ int mindlesslyCacheVary = 0;
 int objectHashTableSize = 0;
 int log2ObjectHashTableSize;
 
+/* The object list is kept in replacement order: discardObjects starts
+   from object_list_end.  Under the segmented policies, the list is
+   split in two: protected objects come first, and object_probation
+   points at the first object of the probationary segment. */
 static ObjectPtr object_list = NULL;
 static ObjectPtr object_list_end = NULL;
+static ObjectPtr object_probation = NULL;
+static int protectedObjectCount = 0;
+
+int objectReplacementPolicy = POLICY_LRU;
+static unsigned long policyLookups[NUM_POLICIES];
+static unsigned long policyHits[NUM_POLICIES];
+static double policyHitBytes[NUM_POLICIES];
+static double policyFetchedBytes[NUM_POLICIES];
+
+/* GreedyDual-Size-Frequency: an object's priority is the inflation
+   value at the time it was last touched, plus its hit count times the
+   cost of fetching it again divided by the number of chunks it pins.
+   Evicting an object raises the inflation value to its priority, which
+   ages the objects that haven't been touched since.
+
+   Under GDSF, public objects are kept in a binary heap ordered by
+   priority, and object->heap_index is the object's position in
+   gdsfHeap, or -1.  While discarding, the objects that cannot be
+   evicted are moved from the heap to gdsfAside, where their index is
+   -2 - heap_index. */
+#define GDSF_DEFAULT_COST 100000
+static double gdsfInflation = 0.0;
+static ObjectPtr *gdsfHeap = NULL;
+static int gdsfHeapSize = 0, gdsfHeapCount = 0;
+static ObjectPtr *gdsfAside = NULL;
+static int gdsfAsideSize = 0, gdsfAsideCount = 0;
+
+/* State of an incremental discardObjects. */
+static int discardPhase = 0;
+static ObjectPtr discardCursor = NULL;
+static int discardFreed = 0;
+static int discardEventPending = 0;
+
+#define DISCARD_STALL_BUCKETS 6
+static const int discardStallLimits[DISCARD_STALL_BUCKETS - 1] =
+    { 100, 1000, 5000, 20000, 100000 };
+static unsigned long discardStalls[DISCARD_STALL_BUCKETS];
+static int discardMaxStall = 0;
+
+/* 2Q remembers the hashes of recently evicted probationary objects in
+   a direct-mapped table, with a ring giving the order of insertion. */
+#define GHOST_SLOTS 4096
+static unsigned int ghostTable[GHOST_SLOTS];
+static unsigned int ghostRing[GHOST_SLOTS / 2];
+static int ghostRingNext = 0;
 
 int objectExpiryScheduled;
 
@@ -37,15 +86,23 @@ int cacheIsShared = 1;
 int publicObjectLowMark = 0, objectHighMark = 2048;
 
 static ObjectPtr *objectHashTable;
+static unsigned long objectLookups = 0, objectHits = 0;
+static unsigned long objectProbes = 0, objectCollisions = 0;
+static int objectHashTableResizes = 0;
 int maxExpiresAge = (30 * 24 + 1) * 3600;
 int maxAge = (14 * 24 + 1) * 3600;
 float maxAgeFraction = 0.1;
 int maxNoModifiedAge = 23 * 60;
 int maxWriteoutWhenIdle = 64 * 1024;
 int maxObjectsWhenIdle = 32;
+int maxDiscardObjects = 256;
+int maxDiscardTime = 2000;
 int idleTime = 20;
 int dontCacheCookies = 0;
 
+static int objectReplacementPolicySetter(ConfigVariablePtr, void*);
+static void scheduleDiscard(int seconds);
+
 void
 preinitObject()
 {
@@ -56,6 +113,12 @@ preinitObject()
     CONFIG_VARIABLE_SETTABLE(maxObjectsWhenIdle, CONFIG_INT, configIntSetter,
                              "Number of objects to write at a time "
                              "when idle.");
+    CONFIG_VARIABLE_SETTABLE(maxDiscardObjects, CONFIG_INT, configIntSetter,
+                             "Number of objects to examine at a time "
+                             "when discarding.");
+    CONFIG_VARIABLE_SETTABLE(maxDiscardTime, CONFIG_INT, configIntSetter,
+                             "Microseconds to spend at a time "
+                             "when discarding.");
     CONFIG_VARIABLE_SETTABLE(cacheIsShared, CONFIG_BOOLEAN, configIntSetter,
                              "If false, ignore s-maxage and private.");
     CONFIG_VARIABLE_SETTABLE(mindlesslyCacheVary, CONFIG_BOOLEAN,
@@ -67,6 +130,11 @@ preinitObject()
                     "High object count mark.");
     CONFIG_VARIABLE(publicObjectLowMark, CONFIG_INT,
                     "Low object count mark (0 = auto).");
+    CONFIG_VARIABLE_SETTABLE(objectReplacementPolicy, CONFIG_INT,
+                             objectReplacementPolicySetter,
+                             "Replacement policy "
+                             "(0 = LRU, 1 = segmented LRU, 2 = 2Q, "
+                             "3 = GDSF).");
     CONFIG_VARIABLE_SETTABLE(maxExpiresAge, CONFIG_TIME, configIntSetter,
                              "Max age for objects with Expires header.");
     CONFIG_VARIABLE_SETTABLE(maxAge, CONFIG_TIME, configIntSetter,
@@ -98,11 +166,12 @@ initObject()
                    "setting to %d.\n", publicObjectLowMark);
     }
 
+    /* The table is chained and grows as needed, so it can start small. */
     q = 1;
-    if(objectHashTableSize <= objectHighMark / 2 ||
+    if(objectHashTableSize < 16 ||
        objectHashTableSize > objectHighMark * 1024) {
         if(objectHashTableSize != 0) q = 0;
-        objectHashTableSize = objectHighMark * 16;
+        objectHashTableSize = MAX(objectHighMark / 4, 16);
     }
     log2ObjectHashTableSize = log2_ceil(objectHashTableSize);
     objectHashTableSize = 1 << log2ObjectHashTableSize;
@@ -110,8 +179,17 @@ initObject()
         do_log(L_WARN, "Suspicious objectHashTableSize value -- "
                "setting to %d.\n", objectHashTableSize);
 
+    if(objectReplacementPolicy < 0 ||
+       objectReplacementPolicy >= NUM_POLICIES) {
+        objectReplacementPolicy = POLICY_LRU;
+        do_log(L_WARN, "Unknown objectReplacementPolicy -- "
+               "using LRU.\n");
+    }
+
     object_list = NULL;
     object_list_end = NULL;
+    object_probation = NULL;
+    protectedObjectCount = 0;
     publicObjectCount = 0;
     privateObjectCount = 0;
     objectHashTable = calloc(1 << log2ObjectHashTableSize,
@@ -122,38 +200,444 @@ initObject()
     }
 }
 
-ObjectPtr
-findObject(int type, const void *key, int key_size)
+static unsigned int
+objectHash(int type, const void *key, int key_size)
 {
-    int h;
-    ObjectPtr object;
+    return hash(type, key, key_size, 32);
+}
 
-    if(key_size >= 50000)
-        return NULL;
+#define OBJECT_BUCKET(h) ((h) & ((1 << log2ObjectHashTableSize) - 1))
 
-    h = hash(type, key, key_size, log2ObjectHashTableSize);
-    object = objectHashTable[h];
-    if(!object)
-        return NULL;
-    if(object->type != type || object->key_size != key_size ||
-       memcmp(object->key, key, key_size) != 0) {
-        return NULL;
+/* Double the size of the hash table.  Objects remember their full hash
+   value, so this doesn't need to look at the keys. */
+static void
+growObjectHashTable()
+{
+    ObjectPtr *table, object, next;
+    int i, log2size = log2ObjectHashTableSize + 1;
+
+    if(log2size >= 30)
+        return;
+
+    table = calloc(1 << log2size, sizeof(ObjectPtr));
+    if(table == NULL) {
+        do_log(L_WARN, "Couldn't grow object hash table.\n");
+        return;
+    }
+
+    for(i = 0; i < objectHashTableSize; i++) {
+        object = objectHashTable[i];
+        while(object) {
+            int h = object->hash_value & ((1 << log2size) - 1);
+            next = object->hash_next;
+            object->hash_next = table[h];
+            table[h] = object;
+            object = next;
+        }
+    }
+
+    free(objectHashTable);
+    objectHashTable = table;
+    log2ObjectHashTableSize = log2size;
+    objectHashTableSize = 1 << log2size;
+    objectHashTableResizes++;
+}
+
+/* Object list maintenance */
+
+static void
+unlinkObject(ObjectPtr object)
+{
+    if(object_probation == object)
+        object_probation = object->next;
+    if(object->flags & OBJECT_PROTECTED) {
+        object->flags &= ~OBJECT_PROTECTED;
+        protectedObjectCount--;
     }
-    if(object->next)
-        object->next->previous = object->previous;
     if(object->previous)
         object->previous->next = object->next;
     if(object_list == object)
         object_list = object->next;
+    if(object->next)
+        object->next->previous = object->previous;
     if(object_list_end == object)
         object_list_end = object->previous;
     object->previous = NULL;
-    object->next = object_list;
-    if(object_list)
-        object_list->previous = object;
-    object_list = object;
-    if(!object_list_end)
+    object->next = NULL;
+}
+
+/* Link object just before other, or at the end if other is NULL. */
+static void
+linkObjectBefore(ObjectPtr object, ObjectPtr other)
+{
+    object->next = other;
+    object->previous = other ? other->previous : object_list_end;
+    if(object->previous)
+        object->previous->next = object;
+    else
+        object_list = object;
+    if(other)
+        other->previous = object;
+    else
         object_list_end = object;
+}
+
+static void
+linkObjectProtected(ObjectPtr object)
+{
+    linkObjectBefore(object, object_list);
+    object->flags |= OBJECT_PROTECTED;
+    protectedObjectCount++;
+}
+
+static void
+linkObjectProbation(ObjectPtr object)
+{
+    linkObjectBefore(object, object_probation);
+    object_probation = object;
+}
+
+/* Move the least recently used protected objects back to probation
+   until the protected segment is within bounds. */
+static void
+trimProtectedObjects()
+{
+    ObjectPtr object;
+    int limit = MAX(publicObjectLowMark * 3 / 4, 1);
+
+    while(protectedObjectCount > limit) {
+        object = object_probation ? object_probation->previous :
+            object_list_end;
+        assert(object && (object->flags & OBJECT_PROTECTED));
+        object->flags &= ~OBJECT_PROTECTED;
+        protectedObjectCount--;
+        object_probation = object;
+    }
+}
+
+static int
+ghostMember(unsigned int h)
+{
+    return ghostTable[h % GHOST_SLOTS] == h;
+}
+
+static void
+ghostInsert(unsigned int h)
+{
+    int size = MIN(MAX(publicObjectLowMark / 2, 1), GHOST_SLOTS / 2);
+    unsigned int old;
+
+    if(ghostRingNext >= size)
+        ghostRingNext = 0;
+    old = ghostRing[ghostRingNext];
+    if(ghostTable[old % GHOST_SLOTS] == old)
+        ghostTable[old % GHOST_SLOTS] = 0;
+    ghostRing[ghostRingNext++] = h;
+    ghostTable[h % GHOST_SLOTS] = h;
+}
+
+static void
+gdsfPlace(ObjectPtr object, int i)
+{
+    gdsfHeap[i] = object;
+    object->heap_index = i;
+}
+
+static void
+gdsfSiftUp(ObjectPtr object)
+{
+    int i = object->heap_index, parent;
+
+    while(i > 0) {
+        parent = (i - 1) / 2;
+        if(gdsfHeap[parent]->priority <= object->priority)
+            break;
+        gdsfPlace(gdsfHeap[parent], i);
+        i = parent;
+    }
+    gdsfPlace(object, i);
+}
+
+static void
+gdsfSiftDown(ObjectPtr object)
+{
+    int i = object->heap_index, child;
+
+    while((child = 2 * i + 1) < gdsfHeapCount) {
+        if(child + 1 < gdsfHeapCount &&
+           gdsfHeap[child + 1]->priority < gdsfHeap[child]->priority)
+            child++;
+        if(object->priority <= gdsfHeap[child]->priority)
+            break;
+        gdsfPlace(gdsfHeap[child], i);
+        i = child;
+    }
+    gdsfPlace(object, i);
+}
+
+static void
+gdsfInsert(ObjectPtr object)
+{
+    if(gdsfHeapCount >= gdsfHeapSize) {
+        ObjectPtr *heap;
+        int size = MAX(2 * gdsfHeapSize, 256);
+        heap = realloc(gdsfHeap, size * sizeof(ObjectPtr));
+        if(heap == NULL) {
+            do_log(L_ERROR, "Couldn't grow GDSF heap.\n");
+            return;
+        }
+        gdsfHeap = heap;
+        gdsfHeapSize = size;
+    }
+    gdsfPlace(object, gdsfHeapCount++);
+    gdsfSiftUp(object);
+}
+
+static void
+gdsfRemove(ObjectPtr object)
+{
+    ObjectPtr last;
+    int i = object->heap_index;
+
+    if(i >= 0) {
+        last = gdsfHeap[--gdsfHeapCount];
+        if(last != object) {
+            gdsfPlace(last, i);
+            gdsfSiftDown(last);
+            gdsfSiftUp(last);
+        }
+    } else if(i <= -2) {
+        last = gdsfAside[--gdsfAsideCount];
+        if(last != object) {
+            gdsfAside[-2 - i] = last;
+            last->heap_index = i;
+        }
+    }
+    object->heap_index = -1;
+}
+
+/* Move an object that cannot be evicted out of the way. */
+static int
+gdsfSetAside(ObjectPtr object)
+{
+    if(gdsfAsideCount >= gdsfAsideSize) {
+        ObjectPtr *aside;
+        int size = MAX(2 * gdsfAsideSize, 64);
+        aside = realloc(gdsfAside, size * sizeof(ObjectPtr));
+        if(aside == NULL) {
+            do_log(L_ERROR, "Couldn't allocate victim list.\n");
+            return -1;
+        }
+        gdsfAside = aside;
+        gdsfAsideSize = size;
+    }
+    gdsfRemove(object);
+    gdsfAside[gdsfAsideCount] = object;
+    object->heap_index = -2 - gdsfAsideCount;
+    gdsfAsideCount++;
+    return 1;
+}
+
+/* Put the objects set aside back into the heap.  The heap has room
+   for them, since that's where they came from. */
+static void
+gdsfRestore()
+{
+    ObjectPtr object;
+
+    while(gdsfAsideCount > 0) {
+        object = gdsfAside[--gdsfAsideCount];
+        gdsfPlace(object, gdsfHeapCount++);
+        gdsfSiftUp(object);
+    }
+}
+
+static void
+updatePriority(ObjectPtr object)
+{
+    int chunks = MAX((object->size + CHUNK_SIZE - 1) / CHUNK_SIZE, 1);
+    object->priority =
+        gdsfInflation + (double)object->hits * object->cost / chunks;
+    if(object->heap_index >= 0) {
+        gdsfSiftUp(object);
+        gdsfSiftDown(object);
+    }
+}
+
+/* Called on every hit. */
+static void
+objectTouched(ObjectPtr object)
+{
+    if(object->hits < USHRT_MAX)
+        object->hits++;
+    updatePriority(object);
+
+    switch(objectReplacementPolicy) {
+    case POLICY_SLRU:
+        unlinkObject(object);
+        linkObjectProtected(object);
+        trimProtectedObjects();
+        break;
+    case POLICY_2Q:
+        /* Hits in the probationary FIFO don't count; an object gets
+           promoted only when it is requested again after eviction. */
+        if(object->flags & OBJECT_PROTECTED) {
+            unlinkObject(object);
+            linkObjectProtected(object);
+        }
+        break;
+    default:
+        unlinkObject(object);
+        linkObjectProbation(object);
+        break;
+    }
+}
+
+static void
+objectInserted(ObjectPtr object)
+{
+    object->hits = 1;
+    object->cost = GDSF_DEFAULT_COST;
+    updatePriority(object);
+    if(objectReplacementPolicy == POLICY_GDSF)
+        gdsfInsert(object);
+    if(objectReplacementPolicy == POLICY_2Q && ghostMember(object->hash_value))
+        linkObjectProtected(object);
+    else
+        linkObjectProbation(object);
+}
+
+/* Called by the server code when a reply has been received. */
+void
+objectFetched(ObjectPtr object, int size, int rtt, int rate)
+{
+    double cost;
+
+    int length = object->length >= 0 ? object->length : size;
+
+    cost = rtt > 0 ? rtt : GDSF_DEFAULT_COST;
+    if(rate > 0 && length > 0)
+        cost += (double)length * 1000000.0 / rate;
+    object->cost = (int)MIN(cost, (double)INT_MAX);
+    if(size > 0)
+        policyFetchedBytes[objectReplacementPolicy] += size;
+    if(object->flags & OBJECT_PUBLIC)
+        updatePriority(object);
+}
+
+/* Called just before object is discarded from memory. */
+static void
+objectEvicted(ObjectPtr object)
+{
+    if(objectReplacementPolicy == POLICY_2Q &&
+       !(object->flags & OBJECT_PROTECTED))
+        ghostInsert(object->hash_value);
+    if(object->priority > gdsfInflation)
+        gdsfInflation = object->priority;
+}
+
+/* Eviction order.  This is the list order from the end, except that
+   2Q evicts from the protected segment while the probationary one is
+   small, and GDSF evicts in order of increasing priority. */
+
+static int evictProtectedFirst = 0;
+
+static ObjectPtr
+firstVictim()
+{
+    if(objectReplacementPolicy == POLICY_GDSF) {
+        gdsfRestore();
+        return gdsfHeapCount > 0 ? gdsfHeap[0] : NULL;
+    }
+    evictProtectedFirst =
+        objectReplacementPolicy == POLICY_2Q &&
+        publicObjectCount - protectedObjectCount <=
+        MAX(publicObjectLowMark / 4, 1) &&
+        protectedObjectCount > 0;
+    if(evictProtectedFirst)
+        return object_probation ? object_probation->previous : 
+            object_list_end;
+    return object_list_end;
+}
+
+static ObjectPtr
+nextVictim(ObjectPtr object)
+{
+    ObjectPtr previous = object->previous;
+    if(objectReplacementPolicy == POLICY_GDSF) {
+        /* object is the root of the heap.  If it gets evicted, it
+           will be dropped from the aside list. */
+        if(gdsfSetAside(object) < 0)
+            return NULL;
+        return gdsfHeapCount > 0 ? gdsfHeap[0] : NULL;
+    }
+    if(!evictProtectedFirst)
+        return previous;
+    if(object->flags & OBJECT_PROTECTED) {
+        if(previous)
+            return previous;
+        if(object_list_end &&
+           !(object_list_end->flags & OBJECT_PROTECTED))
+            return object_list_end;
+        return NULL;
+    }
+    if(previous && (previous->flags & OBJECT_PROTECTED))
+        return NULL;
+    return previous;
+}
+
+/* Changing the policy at runtime starts again from a single segment. */
+static int
+objectReplacementPolicySetter(ConfigVariablePtr var, void *value)
+{
+    ObjectPtr object;
+    int policy = *(int*)value;
+
+    if(policy < 0 || policy >= NUM_POLICIES)
+        return -1;
+
+    gdsfHeapCount = gdsfAsideCount = 0;
+    for(object = object_list; object; object = object->next) {
+        object->flags &= ~OBJECT_PROTECTED;
+        object->heap_index = -1;
+        if(policy == POLICY_GDSF)
+            gdsfInsert(object);
+    }
+    protectedObjectCount = 0;
+    object_probation = object_list;
+    memset(ghostTable, 0, sizeof(ghostTable));
+    memset(ghostRing, 0, sizeof(ghostRing));
+    ghostRingNext = 0;
+    return configIntSetter(var, value);
+}
+
+ObjectPtr
+findObject(int type, const void *key, int key_size)
+{
+    unsigned int h;
+    ObjectPtr object;
+
+    if(key_size >= 50000)
+        return NULL;
+
+    objectLookups++;
+    policyLookups[objectReplacementPolicy]++;
+    h = objectHash(type, key, key_size);
+    object = objectHashTable[OBJECT_BUCKET(h)];
+    while(object) {
+        if(object->hash_value == h && object->type == type &&
+           object->key_size == key_size &&
+           memcmp(object->key, key, key_size) == 0)
+            break;
+        objectProbes++;
+        object = object->hash_next;
+    }
+    if(!object)
+        return NULL;
+    objectHits++;
+    policyHits[objectReplacementPolicy]++;
+    policyHitBytes[objectReplacementPolicy] += object->size;
+    objectTouched(object);
     return retainObject(object);
 }
 
@@ -162,7 +646,7 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
            RequestFunction request, void* request_closure)
 {
     ObjectPtr object;
-    int h;
+    unsigned int h;
 
     object = findObject(type, key, key_size);
     if(object != NULL) {
@@ -181,14 +665,8 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     }
 
     if(publicObjectCount >= publicObjectLowMark && 
-       !objectExpiryScheduled) {
-        TimeEventHandlerPtr event;
-        event = scheduleTimeEvent(-1, discardObjectsHandler, 0, NULL);
-        if(event)
-            objectExpiryScheduled = 1;
-        else
-            do_log(L_ERROR, "Couldn't schedule object expiry.\n");
-    }
+       !objectExpiryScheduled)
+        scheduleDiscard(-1);
 
     object = malloc(sizeof(ObjectRec));
     if(object == NULL)
@@ -208,22 +686,24 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     object->key[key_size] = '\0';
     object->key_size = key_size;
     object->flags = (public?OBJECT_PUBLIC:0) | OBJECT_INITIAL;
+    object->hash_next = NULL;
+    object->hash_value = 0;
+    object->hits = 0;
+    object->cost = GDSF_DEFAULT_COST;
+    object->priority = 0.0;
+    object->heap_index = -1;
     if(public) {
-        h = hash(object->type, object->key, object->key_size, 
-                 log2ObjectHashTableSize);
-        if(objectHashTable[h]) {
-            writeoutToDisk(objectHashTable[h], objectHashTable[h]->size, -1);
-            privatiseObject(objectHashTable[h], 0);
-            assert(!objectHashTable[h]);
-        }
-        objectHashTable[h] = object;
-        object->next = object_list;
+        if(publicObjectCount >= objectHashTableSize)
+            growObjectHashTable();
+        h = objectHash(object->type, object->key, object->key_size);
+        object->hash_value = h;
+        if(objectHashTable[OBJECT_BUCKET(h)])
+            objectCollisions++;
+        object->hash_next = objectHashTable[OBJECT_BUCKET(h)];
+        objectHashTable[OBJECT_BUCKET(h)] = object;
+        object->next = NULL;
         object->previous = NULL;
-        if(object_list)
-            object_list->previous = object;
-        object_list = object;
-        if(!object_list_end)
-            object_list_end = object;
+        objectInserted(object);
     } else {
         object->next = NULL;
         object->previous = NULL;
@@ -552,6 +1032,51 @@ objectPrintf(ObjectPtr object, int offset, const char *format, ...)
         abortObject(object, 500, internAtom("Couldn't add data to object"));
 }
 
+void
+objectPrintStatistics(ObjectPtr object)
+{
+    static const char *policyNames[NUM_POLICIES] =
+        { "LRU", "Segmented LRU", "2Q", "GDSF" };
+    int i;
+
+    objectPrintf(object, object->size,
+                 "<p>The object hash table has %d buckets "
+                 "(grown %d times); "
+                 "%lu lookups, %lu hits (%.1f%%), "
+                 "%lu chain probes, %lu collisions on insertion.</p>\n",
+                 objectHashTableSize, objectHashTableResizes,
+                 objectLookups, objectHits,
+                 objectLookups ?
+                 100.0 * objectHits / objectLookups : 0.0,
+                 objectProbes, objectCollisions);
+    for(i = 0; i < NUM_POLICIES; i++) {
+        if(policyLookups[i] == 0)
+            continue;
+        objectPrintf(object, object->size,
+                     "<p>%s%s: %lu lookups, %lu hits "
+                     "(object hit ratio %.1f%%, byte hit ratio %.1f%%).</p>\n",
+                     policyNames[i],
+                     i == objectReplacementPolicy ? " (current policy)" : "",
+                     policyLookups[i], policyHits[i],
+                     100.0 * policyHits[i] / policyLookups[i],
+                     policyHitBytes[i] + policyFetchedBytes[i] > 0 ?
+                     100.0 * policyHitBytes[i] /
+                     (policyHitBytes[i] + policyFetchedBytes[i]) : 0.0);
+    }
+    objectPrintf(object, object->size,
+                 "<p>%d of %d public objects are protected.</p>\n",
+                 protectedObjectCount, publicObjectCount);
+    objectPrintf(object, object->size,
+                 "<p>Time spent discarding objects at a time: "
+                 "%lu under 0.1&nbsp;ms, %lu under 1&nbsp;ms, "
+                 "%lu under 5&nbsp;ms, %lu under 20&nbsp;ms, "
+                 "%lu under 100&nbsp;ms, %lu longer; "
+                 "longest %.3f&nbsp;ms.</p>\n",
+                 discardStalls[0], discardStalls[1], discardStalls[2],
+                 discardStalls[3], discardStalls[4], discardStalls[5],
+                 discardMaxStall / 1000.0);
+}
+
 int 
 objectHoleSize(ObjectPtr object, int offset)
 {
@@ -673,7 +1198,8 @@ destroyObject(ObjectPtr object)
 void
 privatiseObject(ObjectPtr object, int linear) 
 {
-    int i, h;
+    int i;
+    ObjectPtr *p;
     if(!(object->flags & OBJECT_PUBLIC)) {
         if(linear)
             object->flags |= OBJECT_LINEAR;
@@ -694,21 +1220,16 @@ privatiseObject(ObjectPtr object, int linear)
         }
     }
 
-    h = hash(object->type, object->key, object->key_size, 
-             log2ObjectHashTableSize);
-    assert(objectHashTable[h] == object);
-    objectHashTable[h] = NULL;
+    p = &objectHashTable[OBJECT_BUCKET(object->hash_value)];
+    while(*p != object) {
+        assert(*p != NULL);
+        p = &(*p)->hash_next;
+    }
+    *p = object->hash_next;
+    object->hash_next = NULL;
 
-    if(object->previous)
-        object->previous->next = object->next;
-    if(object_list == object)
-        object_list = object->next;
-    if(object->next)
-        object->next->previous = object->previous;
-    if(object_list_end == object)
-        object_list_end = object->previous;
-    object->previous = NULL;
-    object->next = NULL;
+    unlinkObject(object);
+    gdsfRemove(object);
 
     publicObjectCount--;
     privateObjectCount++;
@@ -774,6 +1295,7 @@ notifyObject(ObjectPtr object)
 int
 discardObjectsHandler(TimeEventHandlerPtr event)
 {
+    discardEventPending = 0;
     return discardObjects(0, 0);
 }
 
@@ -799,7 +1321,10 @@ writeoutObjects(int all)
                     bytes = 0;
                 }
             }
-            n = writeoutToDisk(object, -1, all ? -1 : maxWriteoutWhenIdle);
+            if(all)
+                n = writeoutToDisk(object, -1, -1);
+            else
+                n = writeoutToDiskAsync(object, -1, maxWriteoutWhenIdle);
             bytes += n;
         } while(!all && n == maxWriteoutWhenIdle);
         objects++;
@@ -808,25 +1333,123 @@ writeoutObjects(int all)
     diskIsClean = 1;
 }
 
+/* Unless it is asked to discard everything, discardObjects works in
+   slices bounded by maxDiscardObjects and maxDiscardTime, and schedules
+   itself to continue from where it left off on the next iteration of
+   the event loop.  The object where it stopped is retained, and
+   forgotten if it has been privatised in the meantime. */
+
+static ObjectPtr
+takeDiscardCursor()
+{
+    ObjectPtr object = discardCursor;
+
+    if(object == NULL)
+        return NULL;
+    discardCursor = NULL;
+    if(!(object->flags & OBJECT_PUBLIC)) {
+        releaseObject(object);
+        return NULL;
+    }
+    releaseObject(object);
+    return object;
+}
+
+static int
+discardOverBudget(int count, struct timeval *start)
+{
+    struct timeval now;
+
+    /* Never stop while our caller is unable to allocate anything. */
+    if(used_chunks >= CHUNKS(chunkHighMark) ||
+       publicObjectCount + privateObjectCount >= objectHighMark)
+        return 0;
+
+    if(maxDiscardObjects > 0 && count >= maxDiscardObjects)
+        return 1;
+    if(maxDiscardTime > 0) {
+        gettimeofday(&now, NULL);
+        if(timeval_minus_usec(&now, start) >= maxDiscardTime)
+            return 1;
+    }
+    return 0;
+}
+
+static void
+scheduleDiscard(int seconds)
+{
+    TimeEventHandlerPtr event;
+
+    if(discardEventPending) {
+        objectExpiryScheduled = 1;
+        return;
+    }
+    event = scheduleTimeEvent(seconds, discardObjectsHandler, 0, NULL);
+    if(event) {
+        discardEventPending = 1;
+        objectExpiryScheduled = 1;
+    } else {
+        objectExpiryScheduled = 0;
+        do_log(L_ERROR, "Couldn't schedule object expiry.\n");
+    }
+}
+
+static void
+recordDiscardStall(struct timeval *start)
+{
+    struct timeval now;
+    int usec, i;
+
+    gettimeofday(&now, NULL);
+    usec = timeval_minus_usec(&now, start);
+    for(i = 0; i < DISCARD_STALL_BUCKETS - 1; i++)
+        if(usec < discardStallLimits[i])
+            break;
+    discardStalls[i]++;
+    if(usec > discardMaxStall)
+        discardMaxStall = usec;
+}
+
 int
 discardObjects(int all, int force)
 {
-    ObjectPtr object;
-    int i;
+    ObjectPtr object, next_object;
+    int count = 0;
     static int in_discardObjects = 0;
-    TimeEventHandlerPtr event;
+    struct timeval start;
 
     if(in_discardObjects)
         return 0;
 
     in_discardObjects = 1;
-    
-    if(all || force || used_chunks >= CHUNKS(chunkHighMark) ||
-       publicObjectCount >= publicObjectLowMark ||
-       publicObjectCount + privateObjectCount >= objectHighMark) {
-        object = object_list_end;
+    gettimeofday(&start, NULL);
+
+    object = takeDiscardCursor();
+    if(all || force) {
+        object = NULL;
+        discardPhase = 0;
+    }
+
+    if(discardPhase == 0) {
+        if(all || force || used_chunks >= CHUNKS(chunkHighMark) ||
+           publicObjectCount >= publicObjectLowMark ||
+           publicObjectCount + privateObjectCount >= objectHighMark) {
+            discardPhase = 1;
+            discardFreed = 0;
+        } else {
+            objectExpiryScheduled = discardEventPending;
+            goto done;
+        }
+    }
+
+    /* Write out and free the full chunks of large objects. */
+    if(discardPhase == 1) {
+        if(object == NULL)
+            object = object_list_end;
         while(object && 
               (all || force || used_chunks >= CHUNKS(chunkLowMark))) {
+            if(!all && !force && discardOverBudget(count++, &start))
+                goto pause;
             if(force || ((object->flags & OBJECT_PUBLIC) &&
                          object->numchunks > CHUNKS(chunkLowMark) / 4)) {
                 int j;
@@ -845,18 +1468,30 @@ discardObjects(int all, int force)
             }
             object = object->previous;
         }
-        
-        i = 0;
-        object = object_list_end;
+        discardPhase = 2;
+        object = NULL;
+    }
+
+    /* Evict whole objects in replacement order. */
+    if(discardPhase == 2) {
+        if(object == NULL)
+            object = firstVictim();
+        else if(objectReplacementPolicy == POLICY_GDSF)
+            /* Priorities may have changed since the last slice; the
+               objects set aside stay aside until the pass is over. */
+            object = gdsfHeapCount > 0 ? gdsfHeap[0] : NULL;
         while(object && 
               (all || force ||
-               used_chunks - i > CHUNKS(chunkLowMark) ||
+               used_chunks - discardFreed > CHUNKS(chunkLowMark) ||
                used_chunks > CHUNKS(chunkCriticalMark) ||
                publicObjectCount > publicObjectLowMark)) {
-            ObjectPtr next_object = object->previous;
+            if(!all && !force && discardOverBudget(count++, &start))
+                goto pause;
+            next_object = nextVictim(object);
             if(object->refcount == 0) {
-                i += object->numchunks;
+                discardFreed += object->numchunks;
                 writeoutToDisk(object, object->size, -1);
+                objectEvicted(object);
                 privatiseObject(object, 0);
             } else if(all || force) {
                 writeoutToDisk(object, object->size, -1);
@@ -864,17 +1499,28 @@ discardObjects(int all, int force)
             }
             object = next_object;
         }
+        if(objectReplacementPolicy == POLICY_GDSF)
+            gdsfRestore();
+        discardPhase = 3;
+        object = NULL;
+    }
 
-        object = object_list_end;
+    /* If we're still short on memory, punch holes everywhere. */
+    if(discardPhase == 3) {
         if(force || used_chunks > CHUNKS(chunkCriticalMark)) {
-            if(used_chunks > CHUNKS(chunkCriticalMark)) {
-                do_log(L_WARN, 
-                       "Short on chunk memory -- "
-                       "attempting to punch holes "
-                       "in the middle of objects.\n");
+            if(object == NULL) {
+                if(used_chunks > CHUNKS(chunkCriticalMark)) {
+                    do_log(L_WARN, 
+                           "Short on chunk memory -- "
+                           "attempting to punch holes "
+                           "in the middle of objects.\n");
+                }
+                object = object_list_end;
             }
             while(object && 
                   (force || used_chunks > CHUNKS(chunkCriticalMark))) {
+                if(!all && !force && discardOverBudget(count++, &start))
+                    goto pause;
                 if(force || (object->flags & OBJECT_PUBLIC)) {
                     int j;
                     for(j = object->numchunks - 1; j >= 0; j--) {
@@ -891,17 +1537,18 @@ discardObjects(int all, int force)
                 object = object->previous;
             }
         }
-        event = scheduleTimeEvent(2, discardObjectsHandler, 0, NULL);
-        if(event) {
-            objectExpiryScheduled = 1;
-        } else {
-            objectExpiryScheduled = 0;
-            do_log(L_ERROR, "Couldn't schedule object expiry.\n");
-        }
-    } else {
-        objectExpiryScheduled = 0;
+        discardPhase = 0;
+        object = NULL;
     }
 
+    scheduleDiscard(2);
+    goto done;
+
+ pause:
+    discardCursor = retainObject(object);
+    scheduleDiscard(-1);
+
+ done:
     if(all) {
         if(privateObjectCount + publicObjectCount != 0) {
             do_log(L_WARN,
@@ -918,6 +1565,8 @@ discardObjects(int all, int force)
         diskIsClean = 1;
     }
 
+    if(!all)
+        recordDiscardStall(&start);
     in_discardObjects = 0;
     return 1;
 }
@@ -75,6 +75,12 @@ typedef struct _Object {
     struct _Condition condition;
     struct _DiskCacheEntry *disk_entry;
     struct _Object *next, *previous;
+    struct _Object *hash_next;
+    unsigned int hash_value;
+    unsigned short hits;
+    int cost;
+    double priority;
+    int heap_index;
 } ObjectRec, *ObjectPtr;
 
 typedef struct _CacheControl {
@@ -100,6 +106,15 @@ extern int publicObjectLowMark, objectHighMark;
 
 extern int log2ObjectHashTableSize;
 
+/* objectReplacementPolicy */
+#define POLICY_LRU 0
+#define POLICY_SLRU 1
+#define POLICY_2Q 2
+#define POLICY_GDSF 3
+#define NUM_POLICIES 4
+
+extern int objectReplacementPolicy;
+
 /* object->type */
 #define OBJECT_HTTP 1
 #define OBJECT_DNS 2
@@ -129,6 +144,10 @@ extern int log2ObjectHashTableSize;
 #define OBJECT_DYNAMIC 1024
 /* Used for synchronisation between client and server. */
 #define OBJECT_MUTATING 2048
+/* The object is in the protected segment of the object list */
+#define OBJECT_PROTECTED 4096
+/* A disk I/O thread is reading or writing the object's data */
+#define OBJECT_DISK_IO 8192
 
 /* object->cache_control and connection->cache_control */
 /* RFC 2616 14.9 */
@@ -169,6 +188,7 @@ ObjectPtr makeObject(int type, const void *key, int key_size,
                      int (*request)(ObjectPtr, int, int, int, 
                                     struct _HTTPRequest*, void*), void*);
 void objectMetadataChanged(ObjectPtr object, int dirty);
+void objectFetched(ObjectPtr object, int size, int rtt, int rate);
 ObjectPtr retainObject(ObjectPtr);
 void releaseObject(ObjectPtr);
 int objectSetChunks(ObjectPtr object, int numchunks);
@@ -188,6 +208,7 @@ int objectHasData(ObjectPtr object, int from, int to)
 int objectAddData(ObjectPtr object, const char *data, int offset, int len);
 void objectPrintf(ObjectPtr object, int offset, const char *format, ...)
      ATTRIBUTE ((format (printf, 3, 4)));
+void objectPrintStatistics(ObjectPtr object);
 int discardObjectsHandler(TimeEventHandlerPtr);
 void writeoutObjects(int);
 int discardObjects(int all, int force);
@@ -128,6 +128,78 @@ skip_separator(const char *buf, int i, int len)
     return i;
 }
 
+/* Days from 1970-01-01 to the given date in the proleptic Gregorian
+   calendar; month is 1-based. */
+static long
+days_from_civil(int year, int month, int day)
+{
+    int era, yoe, doy;
+    long doe;
+
+    year -= month <= 2;
+    era = year / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = (long)yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (long)era * 146097 + doe - 719468;
+}
+
+#define D2(p) (d2i((p)[0]) * 10 + d2i((p)[1]))
+/* Folding with 0x20 only turns upper-case letters into letters. */
+#define LETTER(c) (((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'z')
+
+/* The fixed-width RFC 1123 format, "Sun, 06 Nov 1994 08:49:37 GMT",
+   is what nearly every server sends.  Parse it without going through
+   mktime_gmt, which is slow on some systems.  Returns -2 if the string
+   doesn't look like a well-formed RFC 1123 date, in which case the
+   caller should use the general parser. */
+
+static int
+parse_time_rfc1123(const char *buf, int i, int len, time_t *time_return)
+{
+    const char *p = buf + i;
+    int k, day, month, year, hour, min, sec;
+    static const char digits[] = {5, 6, 12, 13, 14, 15, 17, 18,
+                                  20, 21, 23, 24};
+
+    if(len - i < 29 || (len - i > 29 && LETTER(p[29])))
+        return -2;
+    if(!LETTER(p[0]) || !LETTER(p[1]) || !LETTER(p[2]) ||
+       p[3] != ',' || p[4] != ' ' || p[7] != ' ' || p[11] != ' ' ||
+       p[16] != ' ' || p[19] != ':' || p[22] != ':' || p[25] != ' ' ||
+       p[26] != 'G' || p[27] != 'M' || p[28] != 'T')
+        return -2;
+    for(k = 0; k < (int)sizeof(digits); k++)
+        if(d2i(p[(int)digits[k]]) < 0)
+            return -2;
+    for(month = 0; month < 12; month++)
+        if(month_names[month][0] == (p[8] | 0x20) &&
+           month_names[month][1] == (p[9] | 0x20) &&
+           month_names[month][2] == (p[10] | 0x20))
+            break;
+    if(month >= 12)
+        return -2;
+
+    day = D2(p + 5);
+    year = D2(p + 12) * 100 + D2(p + 14);
+    hour = D2(p + 17);
+    min = D2(p + 20);
+    sec = D2(p + 23);
+    /* Leave anything unusual, including dates past 2037, to the
+       general code. */
+    if(day < 1 || day > 31 || year < 1970 || year >= 2038 ||
+       hour > 23 || min > 59 || sec > 60)
+        return -2;
+
+    *time_return =
+        ((days_from_civil(year, month + 1, day) * 24 + hour) * 60 + min) * 60
+        + sec;
+    return i + 29;
+}
+
+#undef D2
+#undef LETTER
+
 int
 parse_time(const char *buf, int offset, int len, time_t *time_return)
 {
@@ -135,6 +207,11 @@ parse_time(const char *buf, int offset, int len, time_t *time_return)
     time_t t;
     int i = offset;
 
+    i = parse_time_rfc1123(buf, offset, len, time_return);
+    if(i != -2)
+        return i;
+    i = offset;
+
     i = skip_word(buf, i, len); if(i < 0) return -1;
     i = skip_separator(buf, i, len); if(i < 0) return -1;
 
@@ -196,20 +273,44 @@ parse_time(const char *buf, int offset, int len, time_t *time_return)
     return i;
 }
 
+/* Most calls format the current time, or the dates of a few popular
+   objects, so remember the last few results. */
+#define FORMAT_CACHE_SIZE 8
+
+static struct {
+    time_t t;
+    int len;
+    char string[32];
+} format_cache[FORMAT_CACHE_SIZE];
+
 int
 format_time(char *buf, int i, int len, time_t t)
 {
     struct tm *tm;
-    int rc;
+    int rc, slot;
 
     if(i < 0 || i > len)
         return -1;
 
-    tm = gmtime(&t);
-    if(tm == NULL)
-        return -1;
-    rc = strftime(buf + i, len - i, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    if(rc <= 0)                 /* yes, that's <= */
+    slot = (unsigned long)t % FORMAT_CACHE_SIZE;
+    if(format_cache[slot].len == 0 || format_cache[slot].t != t) {
+        tm = gmtime(&t);
+        if(tm == NULL)
+            return -1;
+        rc = strftime(format_cache[slot].string,
+                      sizeof(format_cache[slot].string),
+                      "%a, %d %b %Y %H:%M:%S GMT", tm);
+        if(rc <= 0) {           /* yes, that's <= */
+            format_cache[slot].len = 0;
+            return -1;
+        }
+        format_cache[slot].t = t;
+        format_cache[slot].len = rc;
+    }
+
+    rc = format_cache[slot].len;
+    if(len - i <= rc)
         return -1;
+    memcpy(buf + i, format_cache[slot].string, rc + 1);
     return i + rc;
 }
@@ -103,6 +103,28 @@ THE SOFTWARE.
 #endif
 #endif
 
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define HAVE_EPOLL
+#endif
+
+/* io_uring is only used as a replacement for epoll. */
+#if defined(HAVE_IO_URING) && !defined(HAVE_EPOLL)
+#undef HAVE_IO_URING
+#endif
+
+#if defined(__linux__) && !defined(NO_SENDFILE)
+#define HAVE_SENDFILE
+#endif
+
+#if defined(__linux__) && !defined(NO_SPLICE)
+#define HAVE_SPLICE
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+    ((__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 10))
+#define HAVE_ACCEPT4
+#endif
+
 #if defined(__linux__) && (__GNU_LIBRARY__ == 1)
 /* Linux libc 5 */
 #define HAVE_TIMEGM
@@ -185,9 +207,20 @@ THE SOFTWARE.
 #endif
 #define HAVE_READV_WRITEV
 #define HAVE_FFS
+#ifndef NO_DISK_THREADS
+#define HAVE_DISK_THREADS
+#endif
+#if !defined(NO_DISK_THREADS) && !defined(NO_LOG_THREAD) && \
+    defined(__ATOMIC_SEQ_CST)
+#define HAVE_LOG_THREAD
+#endif
 #define READ(x, y, z) read(x, y, z)
 #define WRITE(x, y, z) write(x, y, z)
+#ifdef HAVE_EPOLL
+#define CLOSE(x) closeFd(x)
+#else
 #define CLOSE(x) close(x)
+#endif
 #else
 #ifndef HAVE_REGEX
 #define NO_FORBIDDEN
@@ -235,7 +268,9 @@ THE SOFTWARE.
 #include "log.h"
 #include "auth.h"
 #include "tunnel.h"
+#include "state.h"
 
 extern AtomPtr configFile;
 extern int daemonise;
+extern int workerProcesses;
 extern AtomPtr pidFile;
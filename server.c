@@ -35,13 +35,20 @@ int pmmFirstSize = 0, pmmSize = 0;
 int serverSlots = 2;
 int serverSlots1 = 4;
 int serverMaxSlots = 8;
+int adaptiveServerSlots = 1;
 int dontCacheRedirects = 0;
 int maxSideBuffering = 1500;
 int maxConnectionAge = 1260;
 int maxConnectionRequests = 400;
 int alwaysAddNoTransform = 0;
 
-static HTTPServerPtr servers = 0;
+/* Known servers are indexed by (name, port, isProxy), and also kept
+   on a list ordered by the time they were last used, most recent
+   first, so that expiry only needs to look at the tail. */
+static HTTPServerPtr servers = 0, serversLast = NULL;
+static HTTPServerPtr *serverTable = NULL;
+static int log2ServerTableSize = 8;
+static int numServers = 0;
 
 static int httpServerContinueConditionHandler(int, ConditionHandlerPtr);
 static int initParentProxy(void);
@@ -79,6 +86,10 @@ preinitServer(void)
                     "Maximum number of connections per HTTP/1.0 server.");
     CONFIG_VARIABLE(serverMaxSlots, CONFIG_INT,
                     "Maximum number of connections per broken server.");
+    CONFIG_VARIABLE_SETTABLE(adaptiveServerSlots, CONFIG_BOOLEAN,
+                             configIntSetter,
+                             "Adapt connections and pipelining "
+                             "to each server.");
     CONFIG_VARIABLE(dontCacheRedirects, CONFIG_BOOLEAN,
                     "If true, don't cache redirects.");
     CONFIG_VARIABLE_SETTABLE(allowUnalignedRangeRequests,
@@ -105,20 +116,83 @@ parentProxySetter(ConfigVariablePtr var, void *value)
     return 1;
 }
 
+static HTTPServerPtr *
+serverBucket(char *name, int port, int proxy)
+{
+    return &serverTable[hash(port * 2 + !!proxy, name, strlen(name),
+                             log2ServerTableSize)];
+}
+
+static void
+serverUnlink(HTTPServerPtr server)
+{
+    if(server->previous)
+        server->previous->next = server->next;
+    else
+        servers = server->next;
+    if(server->next)
+        server->next->previous = server->previous;
+    else
+        serversLast = server->previous;
+}
+
+static void
+serverLink(HTTPServerPtr server)
+{
+    server->previous = NULL;
+    server->next = servers;
+    if(servers)
+        servers->previous = server;
+    else
+        serversLast = server;
+    servers = server;
+}
+
+static void
+serverTouch(HTTPServerPtr server)
+{
+    server->time = current_time.tv_sec;
+    if(server != servers) {
+        serverUnlink(server);
+        serverLink(server);
+    }
+}
+
+static void
+growServerTable()
+{
+    HTTPServerPtr *table, *old = serverTable, server;
+    HTTPServerPtr *bucket;
+
+    if(log2ServerTableSize >= 20)
+        return;
+    table = calloc(1 << (log2ServerTableSize + 1), sizeof(HTTPServerPtr));
+    if(table == NULL)
+        return;
+    serverTable = table;
+    log2ServerTableSize++;
+    for(server = servers; server; server = server->next) {
+        bucket = serverBucket(server->name, server->port, server->isProxy);
+        server->hash_next = *bucket;
+        *bucket = server;
+    }
+    free(old);
+}
+
 static void
 discardServer(HTTPServerPtr server)
 {
-    HTTPServerPtr previous;
+    HTTPServerPtr *bucket;
     assert(!server->request);
 
-    if(server == servers)
-        servers = server->next;
-    else {
-        previous = servers;
-        while(previous->next != server)
-            previous = previous->next;
-        previous->next = server->next;
+    bucket = serverBucket(server->name, server->port, server->isProxy);
+    while(*bucket != server) {
+        assert(*bucket != NULL);
+        bucket = &(*bucket)->hash_next;
     }
+    *bucket = server->hash_next;
+    serverUnlink(server);
+    numServers--;
 
     if(server->connection)
         free(server->connection);
@@ -145,15 +219,14 @@ httpServerIdle(HTTPServerPtr server)
 static int
 expireServersHandler(TimeEventHandlerPtr event)
 {
-    HTTPServerPtr server, next;
+    HTTPServerPtr server, previous;
     TimeEventHandlerPtr e;
-    server = servers;
-    while(server) {
-        next = server->next;
-        if(httpServerIdle(server) &&
-           server->time + serverExpireTime < current_time.tv_sec)
+    server = serversLast;
+    while(server && server->time + serverExpireTime < current_time.tv_sec) {
+        previous = server->previous;
+        if(httpServerIdle(server))
             discardServer(server);
-        server = next;
+        server = previous;
     }
     e = scheduleTimeEvent(serverExpireTime / 60 + 60, 
                           expireServersHandler, 0, NULL);
@@ -219,6 +292,14 @@ initServer(void)
 {
     TimeEventHandlerPtr event;
     servers = NULL;
+    serversLast = NULL;
+    numServers = 0;
+
+    serverTable = calloc(1 << log2ServerTableSize, sizeof(HTTPServerPtr));
+    if(serverTable == NULL) {
+        do_log(L_ERROR, "Couldn't allocate server table.\n");
+        exit(1);
+    }
 
     if(pmmFirstSize || pmmSize) {
         if(pmmSize == 0) pmmSize = pmmFirstSize;
@@ -251,24 +332,24 @@ initServer(void)
 static HTTPServerPtr
 getServer(char *name, int port, int proxy)
 {
-    HTTPServerPtr server;
+    HTTPServerPtr server, *bucket;
     int i;
 
-    server = servers;
+    server = *serverBucket(name, port, proxy);
     while(server) {
-        if(strcmp(server->name, name) == 0 && server->port == port &&
-           server->isProxy == proxy) {
+        if(server->port == port && server->isProxy == proxy &&
+           strcmp(server->name, name) == 0) {
             if(httpServerIdle(server) &&
                server->time +  serverExpireTime < current_time.tv_sec) {
                 discardServer(server);
                 server = NULL;
                 break;
             } else {
-                server->time = current_time.tv_sec;
+                serverTouch(server);
                 return server;
             }
         }
-        server = server->next;
+        server = server->hash_next;
     }
     
     server = malloc(sizeof(HTTPServerRec));
@@ -311,6 +392,11 @@ getServer(char *name, int port, int proxy)
     server->rtt = -1;
     server->rate = -1;
     server->numslots = MIN(serverSlots, server->maxslots);
+    server->pipelinedepth = MIN(4, maxPipelineTrain);
+    server->slotstime = null_time;
+    server->slotsreplies = 0;
+    server->slotshold = 0;
+    server->slotsrate = -1;
     for(i = 0; i < server->maxslots; i++) {
         server->connection[i] = NULL;
         server->idleHandler[i] = NULL;
@@ -319,11 +405,80 @@ getServer(char *name, int port, int proxy)
     server->request_last = NULL;
     server->lies = 0;
 
-    server->next = servers;
-    servers = server;
+    bucket = serverBucket(name, port, proxy);
+    server->hash_next = *bucket;
+    *bucket = server;
+    serverLink(server);
+    numServers++;
+    if(numServers > (1 << log2ServerTableSize))
+        growServerTable();
     return server;
 }
 
+/* Server data is saved across restarts as one line per server:
+   name, port, isProxy, version, persistent, pipeline, lies, rtt,
+   rate, numslots and the time it was last used.  Servers are written
+   least recently used first, so that reading them back preserves the
+   order of the list. */
+
+int
+serverWriteState(FILE *out)
+{
+    HTTPServerPtr server;
+    int n = 0;
+
+    for(server = serversLast; server; server = server->previous) {
+        if(server->version == HTTP_UNKNOWN ||
+           server->time + serverExpireTime < current_time.tv_sec)
+            continue;
+        if(server->name[0] == '\0' || strpbrk(server->name, " \t\r\n"))
+            continue;
+        fprintf(out, "server %s %d %d %d %d %d %d %d %d %d %ld\n",
+                server->name, server->port, server->isProxy,
+                server->version, server->persistent,
+                /* Don't remember a pipelining probe in progress. */
+                server->pipeline == 2 || server->pipeline == 3 ?
+                1 : server->pipeline,
+                server->lies, server->rtt, server->rate,
+                server->numslots, (long)server->time);
+        n++;
+    }
+    return n;
+}
+
+int
+serverReadState(char *line)
+{
+    char name[256];
+    int port, proxy, version, persistent, pipeline, lies, rtt, rate;
+    int numslots;
+    long time;
+    HTTPServerPtr server;
+
+    if(sscanf(line, "%255s %d %d %d %d %d %d %d %d %d %ld",
+              name, &port, &proxy, &version, &persistent, &pipeline,
+              &lies, &rtt, &rate, &numslots, &time) < 11)
+        return -1;
+    if(port <= 0 || port >= 0x10000 ||
+       (version != HTTP_10 && version != HTTP_11))
+        return -1;
+    if(time + serverExpireTime < current_time.tv_sec)
+        return 0;
+
+    server = getServer(name, port, !!proxy);
+    if(server == NULL)
+        return -1;
+    server->version = version;
+    server->persistent = persistent;
+    server->pipeline = pipeline == 2 || pipeline == 3 ? 1 : pipeline;
+    server->lies = lies;
+    server->rtt = rtt;
+    server->rate = rate;
+    server->numslots = MAX(1, MIN(numslots, server->maxslots));
+    server->time = time;
+    return 1;
+}
+
 int
 httpServerQueueRequest(HTTPServerPtr server, HTTPRequestPtr request)
 {
@@ -575,6 +730,7 @@ httpServerConnectionDnsHandler(int status, GethostbynameRequestPtr request)
         return 1;
     }
 
+    connection->dns_time = current_time;
     connection->connecting = CONNECTING_CONNECT;
     httpSetTimeout(connection, serverTimeout);
     do_connect(retainAtom(request->addr), connection->server->addrindex,
@@ -642,6 +798,7 @@ httpServerConnectionHandlerCommon(int status, HTTPConnectionPtr connection)
     do_log(D_SERVER_CONN, "C    %s:%d.\n",
            scrub(connection->server->name), connection->server->port);
 
+    connection->connect_time = current_time;
     connection->connecting = 0;
     /* serverTrigger will take care of inserting any timeouts */
     httpServerTrigger(connection->server);
@@ -714,6 +871,104 @@ pipelineIsSmall(HTTPConnectionPtr connection)
     return 0;
 }
 
+/* Whether every slot in use holds an established, busy connection, so
+   that requests still queued have to wait for a pipeline to drain.
+   The connection done has just dequeued a reply, and hasn't been
+   refilled yet. */
+
+static int
+httpServerSaturated(HTTPServerPtr server, HTTPConnectionPtr done)
+{
+    HTTPConnectionPtr connection;
+    int i;
+
+    for(i = 0; i < server->numslots; i++) {
+        connection = server->connection[i];
+        if(connection == NULL || connection->connecting ||
+           connection->pipelined + (connection == done) <= 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Choose the number of connections to a server that talks persistent
+   connections.  Without adaptiveServerSlots, this is just serverSlots
+   or serverSlots1.  Otherwise, we count the replies that come back
+   during periods of at least one round-trip time.  At the end of a
+   period, if requests are still queued and every connection is
+   busy, open one more connection.  A connection is only kept
+   if it paid off: the rate of replies during the next period must
+   have grown by at least half of what it would with a server that
+   scales perfectly.  Otherwise it is given back, and we don't try
+   again for a while.  When the queue is empty, drift back towards the
+   configured value.
+
+   The depth of pipelines grows by one for each pipelined reply that
+   came back whole, and is halved whenever a pipeline breaks.  It
+   doesn't grow for servers that ignore conditional requests: we send
+   them a HEAD and then a GET instead, and those are better spread
+   over more connections than queued on one. */
+
+static void
+httpServerAdaptSlots(HTTPServerPtr server, HTTPConnectionPtr done)
+{
+    int base = MIN(server->maxslots,
+                   server->version == HTTP_10 ? serverSlots1 : serverSlots);
+    int rtt = server->rtt >= 0 ? MAX(server->rtt, 10000) : 100000;
+    int n = server->numslots, elapsed;
+    double rate;
+
+    if(!adaptiveServerSlots) {
+        server->numslots = base;
+        server->slotsrate = -1;
+        return;
+    }
+
+    server->slotsreplies++;
+    if(current_time.tv_sec - server->slotstime.tv_sec > 10)
+        elapsed = -1;
+    else
+        elapsed = timeval_minus_usec(&current_time, &server->slotstime);
+
+    if(!server->request || n < base) {
+        if(n < base)
+            server->numslots = base;
+        else if(n > base && (elapsed < 0 || elapsed >= rtt))
+            server->numslots--;
+        else
+            return;
+        server->slotsrate = -1;
+        server->slotstime = current_time;
+        server->slotsreplies = 0;
+        return;
+    }
+
+    /* A period must be long enough for every connection to deliver a
+       couple of replies, or the rate is just noise. */
+    if(elapsed >= 0 && (elapsed < rtt || server->slotsreplies < 2 * n))
+        return;
+
+    rate = elapsed > 0 ? server->slotsreplies * 1.0E6 / elapsed : -1;
+    if(server->slotshold > 0)
+        server->slotshold--;
+
+    if(rate > 0 && server->slotsrate > 0 && n > base &&
+       rate * (2 * n - 2) < server->slotsrate * (2 * n - 1)) {
+        /* The last connection didn't pay off. */
+        server->numslots--;
+        server->slotsrate = -1;
+        server->slotshold = 8;
+    } else if(rate > 0 && server->slotshold == 0 && n < server->maxslots &&
+              httpServerSaturated(server, done)) {
+        server->numslots++;
+        server->slotsrate = rate;
+    } else {
+        server->slotsrate = -1;
+    }
+    server->slotstime = current_time;
+    server->slotsreplies = 0;
+}
+
 static int
 numRequests(HTTPServerPtr server)
 {
@@ -783,6 +1038,22 @@ httpServerGetConnection(HTTPServerPtr server, int *idle_return)
     return NULL;
 }
 
+/* Charge the set-up of a fresh connection to the first client request
+   written on it, for the access log. */
+static void
+httpServerNoteConnectTimes(HTTPConnectionPtr connection,
+                           HTTPRequestPtr request)
+{
+    if(request->request) {
+        if(connection->dns_time.tv_sec != null_time.tv_sec)
+            request->request->time_dns = connection->dns_time;
+        if(connection->connect_time.tv_sec != null_time.tv_sec)
+            request->request->time_connect = connection->connect_time;
+    }
+    connection->dns_time = null_time;
+    connection->connect_time = null_time;
+}
+
 int
 httpServerTrigger(HTTPServerPtr server)
 {
@@ -828,6 +1099,8 @@ httpServerTrigger(HTTPServerPtr server)
                 n = MIN(2, maxPipelineTrain);
             else
                 n = 0;
+        } else if(adaptiveServerSlots) {
+            n = MAX(1, MIN(server->pipelinedepth, maxPipelineTrain));
         } else {
             n = maxPipelineTrain;
         }
@@ -858,6 +1131,7 @@ httpServerTrigger(HTTPServerPtr server)
             if(connection->pipelined > 0)
                 request->flags |= REQUEST_PIPELINED;
             request->time0 = current_time;
+            httpServerNoteConnectTimes(connection, request);
             i++;
             server->request = request->next;
             request->next = NULL;
@@ -970,6 +1244,7 @@ httpServerSideRequest(HTTPServerPtr server)
     httpQueueRequest(connection, request);
     connection->pipelined = 1;
     request->time0 = current_time;
+    httpServerNoteConnectTimes(connection, request);
     connection->reqoffset = 0;
     connection->bodylen = client->bodylen;
     httpServerDoSide(connection);
@@ -1222,6 +1497,15 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
             else
                 server->rate = rate;
         }
+        objectFetched(request->object, size, server->rtt, server->rate);
+
+        /* A pipelined reply came back whole; allow one more request
+           in the train next time, unless the server is known to
+           misbehave. */
+        if(!s && (request->flags & REQUEST_PIPELINED) &&
+           server->lies <= 0 &&
+           server->pipelinedepth < maxPipelineTrain)
+            server->pipelinedepth++;
 
         httpDequeueRequest(connection);
         connection->pipelined--;
@@ -1263,7 +1547,7 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
         }
     }
 
-    connection->server->time = current_time.tv_sec;
+    serverTouch(connection->server);
     connection->serviced++;
 
     if(s) {
@@ -1285,6 +1569,7 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
                 server->pipeline -= 20;
             else
                 server->pipeline -= 5;
+            server->pipelinedepth = MAX(1, server->pipelinedepth / 2);
             req = connection->request;
             while(req) {
                 req->connection = NULL;
@@ -1314,9 +1599,7 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
     } else {
         server->persistent += 1;
         if(server->persistent > 0)
-            server->numslots = MIN(server->maxslots,
-                                   server->version == HTTP_10 ?
-                                   serverSlots1 : serverSlots);
+            httpServerAdaptSlots(server, connection);
         httpSetTimeout(connection, serverTimeout);
         /* See httpServerTrigger */
         if(connection->pipelined ||
@@ -1383,6 +1666,7 @@ httpServerReply(HTTPConnectionPtr connection, int immediate)
     if(connection->len == 0)
         httpConnectionDestroyBuf(connection);
 
+    connection->scanned = 0;
     httpSetTimeout(connection, serverTimeout);
     do_stream_buf(IO_READ | (immediate ? IO_IMMEDIATE : 0) | IO_NOTNOW,
                   connection->fd, connection->len,
@@ -1503,7 +1787,7 @@ httpServerRequest(ObjectPtr object, int method, int from, int to,
     memcpy(name, ((char*)object->key) + x, y - x);
     name[y - x] = '\0';
 
-    requestor->flags |= REQUEST_REQUESTED;
+    requestor->flags |= REQUEST_REQUESTED | REQUEST_FETCHED;
     rc = httpMakeServerRequest(name, port, object, method, from, to,
                                requestor);
                                    
@@ -1800,7 +2084,13 @@ httpServerReplyHandler(int status,
         return 1;
     }
 
-    i = findEndOfHeaders(connection->buf, 0, srequest->offset, &body);
+    /* The access log reports when the first byte of the reply came in. */
+    if(srequest->offset > 0 && request->request &&
+       request->request->time1.tv_sec == null_time.tv_sec)
+        request->request->time1 = current_time;
+
+    i = findEndOfHeadersResume(connection->buf, &connection->scanned,
+                               srequest->offset, &body);
     connection->len = srequest->offset;
 
     if(i >= 0) {
@@ -2147,6 +2437,8 @@ httpServerHandlerHeaders(int eof,
             new_object->flags |= OBJECT_LOCAL;
     } else {
         new_object = object;
+        if(code == 304 && request->request)
+            request->request->flags |= REQUEST_REVALIDATED;
     }
 
     suspectDynamic =
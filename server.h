@@ -36,10 +36,16 @@ typedef struct _HTTPServer {
     time_t time;
     int numslots;
     int maxslots;
+    int pipelinedepth;
+    struct timeval slotstime;
+    int slotsreplies;
+    int slotshold;
+    double slotsrate;
     HTTPConnectionPtr *connection;
     FdEventHandlerPtr *idleHandler;
     HTTPRequestPtr request, request_last;
-    struct _HTTPServer *next;
+    struct _HTTPServer *next, *previous;
+    struct _HTTPServer *hash_next;
 } HTTPServerRec, *HTTPServerPtr;
 
 extern AtomPtr parentHost;
@@ -111,3 +117,5 @@ int
 httpWriteRequest(HTTPConnectionPtr connection, HTTPRequestPtr request, int);
 
 void listServers(FILE*);
+int serverWriteState(FILE *out);
+int serverReadState(char *line);
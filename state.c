@@ -0,0 +1,258 @@
+/*
+Copyright (c) 2026 by the Polipo contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "polipo.h"
+
+/* The DNS cache and the table of known servers take a while to fill
+   up again after a restart.  If stateFile is set, both are saved there
+   at exit and every stateSaveInterval, and read back at startup; stale
+   entries are dropped when the file is read. */
+
+AtomPtr stateFile = NULL;
+int stateSaveInterval = 600;
+
+static int stateSaveHandler(TimeEventHandlerPtr event);
+
+void
+preinitState()
+{
+    CONFIG_VARIABLE(stateFile, CONFIG_ATOM,
+                    "File where DNS and server data are kept "
+                    "across restarts.");
+    CONFIG_VARIABLE(stateSaveInterval, CONFIG_TIME,
+                    "Interval at which the state file is saved.");
+}
+
+static int
+readStateFile(char *name, int *names, int *known)
+{
+    FILE *f;
+    char buf[4096];
+    int n, rc, bad = 0;
+
+    f = fopen(name, "r");
+    if(f == NULL) {
+        if(errno != ENOENT)
+            do_log_error(L_ERROR, errno, "Couldn't open state file %s",
+                         name);
+        return -1;
+    }
+
+    if(fgets(buf, sizeof(buf), f) == NULL ||
+       strcmp(buf, "polipo-state 1\n") != 0) {
+        do_log(L_WARN, "Ignoring state file %s: unknown format.\n", name);
+        fclose(f);
+        return -1;
+    }
+
+    while(fgets(buf, sizeof(buf), f)) {
+        n = strlen(buf);
+        if(n == 0 || buf[n - 1] != '\n') {
+            bad++;
+            break;
+        }
+        if(strncmp(buf, "dns ", 4) == 0) {
+            rc = dnsReadState(buf + 4);
+            if(rc > 0)
+                (*names)++;
+        } else if(strncmp(buf, "server ", 7) == 0) {
+            rc = serverReadState(buf + 7);
+            if(rc > 0)
+                (*known)++;
+        } else {
+            rc = -1;
+        }
+        if(rc < 0)
+            bad++;
+    }
+    fclose(f);
+
+    if(bad > 0)
+        do_log(L_WARN, "%d bad lines in state file %s.\n", bad, name);
+    return 1;
+}
+
+/* Each worker process saves its own file, stateFile.<n>, since they
+   don't share their caches.  At startup, the files of all workers are
+   merged, along with stateFile itself, in the order in which they were
+   written, so that the most recent data wins. */
+
+static void
+readState()
+{
+    char **files;
+    time_t *mtimes;
+    struct stat st;
+    char *name;
+    int i, j, n = 0, count = 0, names = 0, known = 0, rc;
+
+    files = malloc((workerProcesses + 1) * sizeof(char*));
+    mtimes = malloc((workerProcesses + 1) * sizeof(time_t));
+    if(files == NULL || mtimes == NULL) {
+        do_log(L_ERROR, "Couldn't allocate state file list.\n");
+        goto done;
+    }
+
+    for(i = -1; i < workerProcesses; i++) {
+        if(i < 0)
+            name = strdup(stateFile->string);
+        else
+            name = sprintf_a("%s.%d", stateFile->string, i);
+        if(name == NULL) {
+            do_log(L_ERROR, "Couldn't allocate state file name.\n");
+            break;
+        }
+        rc = stat(name, &st);
+        if(rc < 0) {
+            if(errno != ENOENT)
+                do_log_error(L_ERROR, errno, "Couldn't stat state file %s",
+                             name);
+            free(name);
+            continue;
+        }
+        /* Insertion sort by modification time. */
+        for(j = n; j > 0 && mtimes[j - 1] > st.st_mtime; j--) {
+            files[j] = files[j - 1];
+            mtimes[j] = mtimes[j - 1];
+        }
+        files[j] = name;
+        mtimes[j] = st.st_mtime;
+        n++;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(readStateFile(files[i], &names, &known) > 0)
+            count++;
+        free(files[i]);
+    }
+    if(count > 0)
+        do_log(L_INFO, "Restored %d names and %d servers from %d file%s.\n",
+               names, known, count, count > 1 ? "s" : "");
+
+ done:
+    free(files);
+    free(mtimes);
+}
+
+void
+initState()
+{
+    TimeEventHandlerPtr event;
+
+    if(stateFile && stateFile->length == 0) {
+        releaseAtom(stateFile);
+        stateFile = NULL;
+    }
+    if(stateFile)
+        stateFile = expandTilde(stateFile);
+    if(stateFile == NULL)
+        return;
+
+    gettimeofday(&current_time, NULL);
+    readState();
+
+    if(stateSaveInterval > 0) {
+        event = scheduleTimeEvent(stateSaveInterval, stateSaveHandler,
+                                  0, NULL);
+        if(event == NULL)
+            do_log(L_ERROR, "Couldn't schedule state file writer.\n");
+    }
+}
+
+/* Write to a temporary file and rename it into place, so that a crash
+   never leaves a truncated file behind. */
+
+void
+writeState()
+{
+    FILE *f;
+    char *name, *tmp;
+    int fd, rc;
+
+    if(stateFile == NULL)
+        return;
+
+    if(workerIndex >= 0)
+        name = sprintf_a("%s.%d", stateFile->string, workerIndex);
+    else
+        name = strdup(stateFile->string);
+    tmp = name ? sprintf_a("%s.tmp", name) : NULL;
+    if(tmp == NULL) {
+        do_log(L_ERROR, "Couldn't allocate state file name.\n");
+        free(name);
+        return;
+    }
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", tmp);
+        goto done;
+    }
+    f = fdopen(fd, "w");
+    if(f == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", tmp);
+        close(fd);
+        goto fail;
+    }
+
+    fprintf(f, "polipo-state 1\n");
+    dnsWriteState(f);
+    serverWriteState(f);
+
+    rc = fflush(f);
+    if(rc == 0)
+        rc = ferror(f) ? -1 : 0;
+    if(fclose(f) != 0)
+        rc = -1;
+    if(rc != 0) {
+        do_log_error(L_ERROR, errno, "Couldn't write %s", tmp);
+        goto fail;
+    }
+
+#ifdef WIN32
+    unlink(name);
+#endif
+    rc = rename(tmp, name);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't rename %s", tmp);
+        goto fail;
+    }
+    goto done;
+
+ fail:
+    unlink(tmp);
+ done:
+    free(tmp);
+    free(name);
+}
+
+static int
+stateSaveHandler(TimeEventHandlerPtr event)
+{
+    TimeEventHandlerPtr e;
+
+    writeState();
+    e = scheduleTimeEvent(stateSaveInterval, stateSaveHandler, 0, NULL);
+    if(e == NULL)
+        do_log(L_ERROR, "Couldn't schedule state file writer.\n");
+    return 1;
+}
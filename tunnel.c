@@ -58,6 +58,10 @@ static int tunnelConnectionHandler(int, FdEventHandlerPtr, ConnectRequestPtr);
 static int tunnelSocksHandler(int, SocksRequestPtr);
 static int tunnelHandlerCommon(int, TunnelPtr);
 static int tunnelError(TunnelPtr, int, AtomPtr);
+#ifdef HAVE_SPLICE
+static void tunnelSpliceStart(TunnelPtr);
+static void tunnelSpliceSchedule(TunnelPtr, int);
+#endif
 
 static int
 circularBufferFull(CircularBufferPtr buf)
@@ -108,6 +112,10 @@ makeTunnel(int fd, char *buf, int offset, int len)
     tunnel->buf2.buf = NULL;
     tunnel->buf2.tail = 0;
     tunnel->buf2.head = 0;
+    tunnel->pipe1[0] = tunnel->pipe1[1] = -1;
+    tunnel->pipe2[0] = tunnel->pipe2[1] = -1;
+    tunnel->pipelen1 = tunnel->pipelen2 = 0;
+    tunnel->pipesize = 0;
     return tunnel;
 }
 
@@ -120,6 +128,14 @@ destroyTunnel(TunnelPtr tunnel)
         dispose_chunk(tunnel->buf1.buf);
     if(tunnel->buf2.buf)
         dispose_chunk(tunnel->buf2.buf);
+    if(tunnel->pipe1[0] >= 0) {
+        close(tunnel->pipe1[0]);
+        close(tunnel->pipe1[1]);
+    }
+    if(tunnel->pipe2[0] >= 0) {
+        close(tunnel->pipe2[0]);
+        close(tunnel->pipe2[1]);
+    }
     free(tunnel);
 }
 
@@ -284,6 +300,9 @@ tunnelHandlerParent(int fd, TunnelPtr tunnel)
         goto fail;
     }
     tunnel->buf1.head = n;
+#ifdef HAVE_SPLICE
+    tunnelSpliceStart(tunnel);
+#endif
     tunnelDispatch(tunnel);
     return 1;
 
@@ -315,6 +334,9 @@ tunnelHandlerCommon(int fd, TunnelPtr tunnel)
     memcpy(tunnel->buf2.buf, message, MIN(CHUNK_SIZE - 1, strlen(message)));
     tunnel->buf2.head = MIN(CHUNK_SIZE - 1, strlen(message));
 
+#ifdef HAVE_SPLICE
+    tunnelSpliceStart(tunnel);
+#endif
     tunnelDispatch(tunnel);
     return 1;
 }
@@ -336,7 +358,7 @@ bufRead(int fd, CircularBufferPtr buf,
                       fd, 0,
                       &buf->buf, tail,
                       handler, data);
-    else if(buf->tail > buf->head)
+    else if(tail > buf->head)
         do_stream(IO_READ | IO_NOTNOW,
                   fd, buf->head,
                   buf->buf, tail,
@@ -366,7 +388,63 @@ bufWrite(int fd, CircularBufferPtr buf,
                     buf->buf, buf->head,
                     handler, data);
 }
-                    
+
+/* Direction 1 is from the client to the server, and is carried by buf1
+   or pipe1; direction 2 is the reverse. */
+
+static int
+tunnelEmpty(TunnelPtr tunnel, int direction)
+{
+#ifdef HAVE_SPLICE
+    if(tunnel->flags & TUNNEL_SPLICE)
+        return (direction == 1 ? tunnel->pipelen1 : tunnel->pipelen2) == 0;
+#endif
+    return circularBufferEmpty(direction == 1 ? &tunnel->buf1 : &tunnel->buf2);
+}
+
+static int
+tunnelFull(TunnelPtr tunnel, int direction)
+{
+#ifdef HAVE_SPLICE
+    if(tunnel->flags & TUNNEL_SPLICE)
+        return !!(tunnel->flags &
+                  (direction == 1 ? TUNNEL_FULL1 : TUNNEL_FULL2));
+#endif
+    return circularBufferFull(direction == 1 ? &tunnel->buf1 : &tunnel->buf2);
+}
+
+static void
+tunnelRead(TunnelPtr tunnel, int direction)
+{
+#ifdef HAVE_SPLICE
+    if(tunnel->flags & TUNNEL_SPLICE) {
+        tunnelSpliceSchedule(tunnel,
+                             direction == 1 ? TUNNEL_READER1 : TUNNEL_READER2);
+        return;
+    }
+#endif
+    if(direction == 1)
+        bufRead(tunnel->fd1, &tunnel->buf1, tunnelRead1Handler, tunnel);
+    else
+        bufRead(tunnel->fd2, &tunnel->buf2, tunnelRead2Handler, tunnel);
+}
+
+static void
+tunnelWrite(TunnelPtr tunnel, int direction)
+{
+#ifdef HAVE_SPLICE
+    if(tunnel->flags & TUNNEL_SPLICE) {
+        tunnelSpliceSchedule(tunnel,
+                             direction == 1 ? TUNNEL_WRITER2 : TUNNEL_WRITER1);
+        return;
+    }
+#endif
+    if(direction == 1)
+        bufWrite(tunnel->fd2, &tunnel->buf1, tunnelWrite2Handler, tunnel);
+    else
+        bufWrite(tunnel->fd1, &tunnel->buf2, tunnelWrite1Handler, tunnel);
+}
+
 static void
 tunnelDispatch(TunnelPtr tunnel)
 {
@@ -390,20 +468,23 @@ tunnelDispatch(TunnelPtr tunnel)
 
     if(tunnel->fd1 >= 0) {
         if(!(tunnel->flags & (TUNNEL_READER1 | TUNNEL_EOF1)) && 
-           !circularBufferFull(&tunnel->buf1)) {
+           !tunnelFull(tunnel, 1)) {
             tunnel->flags |= TUNNEL_READER1;
-            bufRead(tunnel->fd1, &tunnel->buf1, tunnelRead1Handler, tunnel);
+            tunnelRead(tunnel, 1);
         }
         if(!(tunnel->flags & (TUNNEL_WRITER1 | TUNNEL_EPIPE1)) &&
-           !circularBufferEmpty(&tunnel->buf2)) {
+           !tunnelEmpty(tunnel, 2)) {
             tunnel->flags |= TUNNEL_WRITER1;
             /* There's no IO_NOTNOW in bufWrite, so it might close the
                file descriptor straight away.  Wait until we're
                rescheduled. */
-            bufWrite(tunnel->fd1, &tunnel->buf2, tunnelWrite1Handler, tunnel);
+            tunnelWrite(tunnel, 2);
             return;
         }
-        if(tunnel->fd2 < 0 || (tunnel->flags & TUNNEL_EOF2)) {
+        /* Don't shut down the writing side while there is still data
+           in flight towards it. */
+        if((tunnel->fd2 < 0 || (tunnel->flags & TUNNEL_EOF2)) &&
+           !(tunnel->flags & TUNNEL_WRITER1) && tunnelEmpty(tunnel, 2)) {
             if(!(tunnel->flags & TUNNEL_EPIPE1))
                 shutdown(tunnel->fd1, 1);
             tunnel->flags |= TUNNEL_EPIPE1;
@@ -422,17 +503,18 @@ tunnelDispatch(TunnelPtr tunnel)
 
     if(tunnel->fd2 >= 0) {
         if(!(tunnel->flags & (TUNNEL_READER2 | TUNNEL_EOF2)) && 
-           !circularBufferFull(&tunnel->buf2)) {
+           !tunnelFull(tunnel, 2)) {
             tunnel->flags |= TUNNEL_READER2;
-            bufRead(tunnel->fd2, &tunnel->buf2, tunnelRead2Handler, tunnel);
+            tunnelRead(tunnel, 2);
         }
         if(!(tunnel->flags & (TUNNEL_WRITER2 | TUNNEL_EPIPE2)) &&
-           !circularBufferEmpty(&tunnel->buf1)) {
+           !tunnelEmpty(tunnel, 1)) {
             tunnel->flags |= TUNNEL_WRITER2;
-            bufWrite(tunnel->fd2, &tunnel->buf1, tunnelWrite2Handler, tunnel);
+            tunnelWrite(tunnel, 1);
             return;
         }
-        if(tunnel->fd1 < 0 || (tunnel->flags & TUNNEL_EOF1)) {
+        if((tunnel->fd1 < 0 || (tunnel->flags & TUNNEL_EOF1)) &&
+           !(tunnel->flags & TUNNEL_WRITER2) && tunnelEmpty(tunnel, 1)) {
             if(!(tunnel->flags & TUNNEL_EPIPE2))
                 shutdown(tunnel->fd2, 1);
             tunnel->flags |= TUNNEL_EPIPE2;
@@ -537,7 +619,272 @@ tunnelWrite2Handler(int status,
     tunnelDispatch(tunnel);
     return 1;
 }
-        
+
+#ifdef HAVE_SPLICE
+
+/* On Linux, once both ends of a tunnel are connected, data is moved
+   between the two sockets through a pair of pipes with splice, which
+   avoids copying it through user space and holding chunks. */
+
+typedef struct _SpliceRequest {
+    TunnelPtr tunnel;
+    int flag;
+} SpliceRequestRec, *SpliceRequestPtr;
+
+static int
+pipeFill(int fd, CircularBufferPtr buf)
+{
+    int rc, n = 0;
+
+    if(buf->buf == NULL || circularBufferEmpty(buf))
+        return 0;
+
+    if(buf->head > buf->tail) {
+        rc = write(fd, buf->buf + buf->tail, buf->head - buf->tail);
+        if(rc != buf->head - buf->tail)
+            return -1;
+        return rc;
+    }
+
+    rc = write(fd, buf->buf + buf->tail, CHUNK_SIZE - buf->tail);
+    if(rc != CHUNK_SIZE - buf->tail)
+        return -1;
+    n = rc;
+    if(buf->head > 0) {
+        rc = write(fd, buf->buf, buf->head);
+        if(rc != buf->head)
+            return -1;
+        n += rc;
+    }
+    return n;
+}
+
+static void
+pipeDrain(int fd, int *len)
+{
+    char buf[512];
+    int rc;
+
+    do {
+        rc = read(fd, buf, 512);
+    } while(rc > 0);
+    *len = 0;
+}
+
+static void
+tunnelSpliceStart(TunnelPtr tunnel)
+{
+    int rc, size;
+
+    if(!tunnelSplice)
+        return;
+
+    assert(!(tunnel->flags & (TUNNEL_READER1 | TUNNEL_WRITER1 |
+                              TUNNEL_READER2 | TUNNEL_WRITER2)));
+
+    rc = pipe2(tunnel->pipe1, O_NONBLOCK);
+    if(rc < 0) {
+        do_log_error(L_WARN, errno, "Couldn't create pipe for tunnel");
+        return;
+    }
+    rc = pipe2(tunnel->pipe2, O_NONBLOCK);
+    if(rc < 0) {
+        do_log_error(L_WARN, errno, "Couldn't create pipe for tunnel");
+        goto fail;
+    }
+
+    size = fcntl(tunnel->pipe1[1], F_GETPIPE_SZ);
+    rc = fcntl(tunnel->pipe2[1], F_GETPIPE_SZ);
+    if(size < 0 || rc < 0 || MIN(size, rc) < CHUNK_SIZE) {
+        do_log(L_WARN, "Tunnel pipes too small, not using splice.\n");
+        goto fail;
+    }
+    tunnel->pipesize = MIN(size, rc);
+
+    /* Anything still buffered (a pipelined request, or the reply
+       we generated ourselves) goes into the pipes first.  The pipes
+       are empty and larger than a chunk, so this cannot block. */
+    tunnel->pipelen1 = pipeFill(tunnel->pipe1[1], &tunnel->buf1);
+    tunnel->pipelen2 = pipeFill(tunnel->pipe2[1], &tunnel->buf2);
+    if(tunnel->pipelen1 < 0 || tunnel->pipelen2 < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't fill tunnel pipe");
+        CLOSE(tunnel->fd1);
+        tunnel->fd1 = -1;
+        CLOSE(tunnel->fd2);
+        tunnel->fd2 = -1;
+        tunnel->pipelen1 = tunnel->pipelen2 = 0;
+        return;
+    }
+
+    if(tunnel->buf1.buf)
+        dispose_chunk(tunnel->buf1.buf);
+    tunnel->buf1.buf = NULL;
+    tunnel->buf1.head = tunnel->buf1.tail = 0;
+    if(tunnel->buf2.buf)
+        dispose_chunk(tunnel->buf2.buf);
+    tunnel->buf2.buf = NULL;
+    tunnel->buf2.head = tunnel->buf2.tail = 0;
+
+    tunnel->flags |= TUNNEL_SPLICE;
+    return;
+
+ fail:
+    close(tunnel->pipe1[0]);
+    close(tunnel->pipe1[1]);
+    tunnel->pipe1[0] = tunnel->pipe1[1] = -1;
+    if(tunnel->pipe2[0] >= 0) {
+        close(tunnel->pipe2[0]);
+        close(tunnel->pipe2[1]);
+        tunnel->pipe2[0] = tunnel->pipe2[1] = -1;
+    }
+}
+
+static void
+tunnelSpliceDone(TunnelPtr tunnel, int flag, int status, int n)
+{
+    switch(flag) {
+    case TUNNEL_READER1:
+        if(status) {
+            if(status < 0 && status != -EPIPE && status != -ECONNRESET)
+                do_log_error(L_ERROR, -status, "Couldn't read from client");
+            tunnel->flags |= TUNNEL_EOF1;
+        } else {
+            tunnel->pipelen1 += n;
+        }
+        /* Keep pipe empty to avoid a deadlock */
+        if((tunnel->flags & TUNNEL_EPIPE2)) {
+            pipeDrain(tunnel->pipe1[0], &tunnel->pipelen1);
+            tunnel->flags &= ~TUNNEL_FULL1;
+        }
+        break;
+    case TUNNEL_READER2:
+        if(status) {
+            if(status < 0 && status != -EPIPE && status != -ECONNRESET)
+                do_log_error(L_ERROR, -status, "Couldn't read from server");
+            tunnel->flags |= TUNNEL_EOF2;
+        } else {
+            tunnel->pipelen2 += n;
+        }
+        if((tunnel->flags & TUNNEL_EPIPE1)) {
+            pipeDrain(tunnel->pipe2[0], &tunnel->pipelen2);
+            tunnel->flags &= ~TUNNEL_FULL2;
+        }
+        break;
+    case TUNNEL_WRITER1:
+        if(status || (tunnel->flags & TUNNEL_EPIPE1)) {
+            tunnel->flags |= TUNNEL_EPIPE1;
+            if(status < 0 && status != -EPIPE)
+                do_log_error(L_ERROR, -status, "Couldn't write to client");
+            pipeDrain(tunnel->pipe2[0], &tunnel->pipelen2);
+        } else {
+            tunnel->pipelen2 -= n;
+        }
+        tunnel->flags &= ~TUNNEL_FULL2;
+        break;
+    case TUNNEL_WRITER2:
+        if(status || (tunnel->flags & TUNNEL_EPIPE2)) {
+            tunnel->flags |= TUNNEL_EPIPE2;
+            if(status < 0 && status != -EPIPE)
+                do_log_error(L_ERROR, -status, "Couldn't write to server");
+            pipeDrain(tunnel->pipe1[0], &tunnel->pipelen1);
+        } else {
+            tunnel->pipelen1 -= n;
+        }
+        tunnel->flags &= ~TUNNEL_FULL1;
+        break;
+    default:
+        abort();
+    }
+    tunnel->flags &= ~flag;
+    tunnelDispatch(tunnel);
+}
+
+static int
+tunnelSpliceHandler(int status, FdEventHandlerPtr event)
+{
+    SpliceRequestPtr request = (SpliceRequestPtr)&event->data;
+    TunnelPtr tunnel = request->tunnel;
+    int from, to, len, full = 0;
+    ssize_t rc = 0;
+
+    /* A pipe's capacity is counted in pages rather than bytes, so
+       readers ask for as much as the pipe could hold, and find out that
+       it is full when splice fails. */
+    switch(request->flag) {
+    case TUNNEL_READER1:
+        from = tunnel->fd1; to = tunnel->pipe1[1];
+        len = tunnel->pipesize;
+        if(tunnel->pipelen1 > 0)
+            full = TUNNEL_FULL1;
+        break;
+    case TUNNEL_READER2:
+        from = tunnel->fd2; to = tunnel->pipe2[1];
+        len = tunnel->pipesize;
+        if(tunnel->pipelen2 > 0)
+            full = TUNNEL_FULL2;
+        break;
+    case TUNNEL_WRITER1:
+        from = tunnel->pipe2[0]; to = tunnel->fd1;
+        len = tunnel->pipelen2;
+        break;
+    case TUNNEL_WRITER2:
+        from = tunnel->pipe1[0]; to = tunnel->fd2;
+        len = tunnel->pipelen1;
+        break;
+    default:
+        abort();
+    }
+
+    if(status == 0) {
+        rc = splice(from, NULL, to, NULL, len,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(rc < 0) {
+            if(errno == EAGAIN && full) {
+                /* The socket is readable, so it's the pipe that is
+                   full.  Stop reading until the writer has drained
+                   some of it. */
+                tunnel->flags |= full;
+                rc = 0;
+            } else if(errno == EAGAIN || errno == EINTR) {
+                return 0;
+            } else {
+                status = -errno;
+            }
+        } else if(rc == 0) {
+            status = 1;
+        }
+    }
+
+    tunnelSpliceDone(tunnel, request->flag, status, rc);
+    return 1;
+}
+
+static void
+tunnelSpliceSchedule(TunnelPtr tunnel, int flag)
+{
+    SpliceRequestRec request;
+    FdEventHandlerPtr event;
+    int fd, poll_events;
+
+    if(flag & (TUNNEL_READER1 | TUNNEL_WRITER1))
+        fd = tunnel->fd1;
+    else
+        fd = tunnel->fd2;
+    if(flag & (TUNNEL_READER1 | TUNNEL_READER2))
+        poll_events = POLLIN;
+    else
+        poll_events = POLLOUT;
+
+    request.tunnel = tunnel;
+    request.flag = flag;
+    event = registerFdEvent(fd, poll_events, tunnelSpliceHandler,
+                            sizeof(SpliceRequestRec), &request);
+    if(event == NULL)
+        tunnelSpliceDone(tunnel, flag, -ENOMEM, 0);
+}
+
+#endif
+
 static int
 tunnelError(TunnelPtr tunnel, int code, AtomPtr message)
 {
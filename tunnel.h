@@ -34,6 +34,10 @@ typedef struct _CircularBuffer {
 #define TUNNEL_WRITER2 32
 #define TUNNEL_EOF2 64
 #define TUNNEL_EPIPE2 128
+#define TUNNEL_SPLICE 256
+/* The pipe is full; the reader waits until the writer has drained it. */
+#define TUNNEL_FULL1 512
+#define TUNNEL_FULL2 1024
 
 typedef struct _Tunnel {
     AtomPtr hostname;
@@ -43,6 +47,11 @@ typedef struct _Tunnel {
     CircularBufferRec buf1;
     int fd2;
     CircularBufferRec buf2;
+    int pipe1[2];
+    int pipe2[2];
+    int pipelen1;
+    int pipelen2;
+    int pipesize;
 } TunnelRec, *TunnelPtr;
 
 void do_tunnel(int fd, char *buf, int offset, int len, AtomPtr url);
@@ -337,17 +337,89 @@ sprintf_a(const char *f, ...)
     return s;
 }    
 
+/* Per-process key for hash.  Hashed strings come from the network, and
+   hash is a keyed pseudo-random function, so without the key there is
+   no way to choose strings that collide. */
+static unsigned int hashKey[2] = {0, 0};
+
+void
+initHashSeed()
+{
+    unsigned int key[2];
+    int fd, rc = -1;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if(fd >= 0) {
+        rc = read(fd, key, sizeof(key));
+        close(fd);
+    }
+    if(rc != sizeof(key)) {
+        struct timeval tv;
+        do_log(L_WARN, "Couldn't read /dev/urandom, "
+               "hash key is guessable.\n");
+        gettimeofday(&tv, NULL);
+        key[0] = (unsigned int)tv.tv_sec ^ ((unsigned int)getpid() << 16);
+        key[1] = (unsigned int)tv.tv_usec ^ (unsigned int)(size_t)key;
+    }
+    hashKey[0] = key[0];
+    hashKey[1] = key[1];
+}
+
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+#define SIPROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = ROTL32(v1, 5); v1 ^= v0; v0 = ROTL32(v0, 16); \
+        v2 += v3; v3 = ROTL32(v3, 8); v3 ^= v2; \
+        v0 += v3; v3 = ROTL32(v3, 7); v3 ^= v0; \
+        v2 += v1; v1 = ROTL32(v1, 13); v1 ^= v2; v2 = ROTL32(v2, 16); \
+    } while(0)
+
+/* HalfSipHash-1-3 keyed with hashKey; seed selects one of a family of
+   independent functions.  Words are read in host byte order, which
+   doesn't matter since hashes never leave the process. */
+
 unsigned int
 hash(unsigned int seed, const void *restrict key, int key_size,
      unsigned int hash_size)
 {
-    int i;
-    unsigned int h;
+    const unsigned char *p = key;
+    unsigned int v0, v1, v2, v3, m, h;
+    int i, n = key_size / 4;
+
+    v0 = hashKey[0];
+    v1 = hashKey[1] ^ seed;
+    v2 = 0x6C796765U ^ hashKey[0];
+    v3 = 0x74656462U ^ hashKey[1] ^ seed;
+
+    for(i = 0; i < n; i++) {
+        memcpy(&m, p + 4 * i, 4);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
 
-    h = seed;
-    for(i = 0; i < key_size; i++)
-        h = (h << 5) + (h >> (hash_size - 5)) +
-            ((unsigned char*)key)[i];
+    p += 4 * n;
+    m = (unsigned int)key_size << 24;
+    switch(key_size & 3) {
+    case 3: m |= p[2] << 16;
+        /* fall through */
+    case 2: m |= p[1] << 8;
+        /* fall through */
+    case 1: m |= p[0];
+    }
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xFF;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    h = v1 ^ v3;
+
+    if(hash_size >= 32)
+        return h;
     return h & ((1 << hash_size) - 1);
 }
 
@@ -593,6 +665,200 @@ do_daemonise(int noclose)
 }
 #endif
 
+#ifdef HAVE_FORK
+
+static volatile sig_atomic_t workerSignals = 0;
+
+static const int workerSignalList[] =
+    { SIGTERM, SIGINT, SIGHUP, SIGUSR1, SIGUSR2, SIGCHLD, SIGALRM };
+#define NUM_WORKER_SIGNALS \
+    ((int)(sizeof(workerSignalList) / sizeof(workerSignalList[0])))
+
+static void
+workerSignalHandler(int signo)
+{
+    int i;
+    for(i = 0; i < NUM_WORKER_SIGNALS; i++)
+        if(workerSignalList[i] == signo)
+            workerSignals |= (1 << i);
+}
+
+/* The number of this worker process, or -1 if we didn't fork any. */
+int workerIndex = -1;
+
+/* A worker that crashes within WORKER_QUICK_DEATH seconds of being
+   started is restarted after a delay that doubles every time, and
+   abandoned after WORKER_MAX_QUICK_DEATHS such crashes in a row. */
+#define WORKER_QUICK_DEATH 10
+#define WORKER_MAX_QUICK_DEATHS 5
+
+/* Fork n worker processes sharing the listening port.  This returns
+   1 in the workers and 0 if no workers were forked; the parent process
+   stays behind, forwards signals to the workers, restarts any worker
+   that crashes, and exits when all the workers are gone. */
+
+int
+runWorkers(int n, char *pidfile)
+{
+    pid_t *pids;
+    /* When each worker was started, and when it may be restarted */
+    time_t *started, *restart;
+    int *quick;
+    struct sigaction sa, old_sa[NUM_WORKER_SIGNALS];
+    sigset_t ss, old_ss;
+    int i, j, alive, pending, exiting, status;
+    pid_t pid;
+    time_t now, next;
+
+    if(n <= 0)
+        return 0;
+
+#ifndef SO_REUSEPORT
+    do_log(L_WARN, "SO_REUSEPORT not available, "
+           "not forking worker processes.\n");
+    return 0;
+#endif
+
+    pids = calloc(n, sizeof(pid_t));
+    started = calloc(n, sizeof(time_t));
+    restart = calloc(n, sizeof(time_t));
+    quick = calloc(n, sizeof(int));
+    if(pids == NULL || started == NULL || restart == NULL || quick == NULL) {
+        do_log(L_ERROR, "Couldn't allocate worker table.\n");
+        exit(1);
+    }
+
+    sigemptyset(&ss);
+    for(i = 0; i < NUM_WORKER_SIGNALS; i++)
+        sigaddset(&ss, workerSignalList[i]);
+    sigprocmask(SIG_BLOCK, &ss, &old_ss);
+
+    for(i = 0; i < NUM_WORKER_SIGNALS; i++) {
+        sigemptyset(&sa.sa_mask);
+        sa.sa_handler = workerSignalHandler;
+        sa.sa_flags = 0;
+        sigaction(workerSignalList[i], &sa, &old_sa[i]);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    alive = 0;
+    exiting = 0;
+    while(1) {
+        now = time(NULL);
+        pending = 0;
+        next = 0;
+        for(i = 0; i < n && !exiting; i++) {
+            if(pids[i] != 0)
+                continue;
+            if(restart[i] > now) {
+                if(pending == 0 || restart[i] < next)
+                    next = restart[i];
+                pending++;
+                continue;
+            }
+            pid = fork();
+            if(pid < 0) {
+                do_log_error(L_ERROR, errno, "Couldn't fork worker");
+                pids[i] = -1;
+                continue;
+            }
+            if(pid == 0) {
+                for(j = 0; j < NUM_WORKER_SIGNALS; j++)
+                    sigaction(workerSignalList[j], &old_sa[j], NULL);
+                sigprocmask(SIG_SETMASK, &old_ss, NULL);
+                free(pids);
+                free(started);
+                free(restart);
+                free(quick);
+                workerIndex = i;
+                return 1;
+            }
+            pids[i] = pid;
+            started[i] = now;
+            alive++;
+        }
+
+        if(alive == 0 && pending == 0)
+            break;
+
+        /* SIGALRM wakes us up when a delayed restart is due. */
+        if(pending > 0)
+            alarm(next - now);
+        sigsuspend(&old_ss);
+        now = time(NULL);
+
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(i = 0; i < n; i++)
+                if(pids[i] == pid)
+                    break;
+            if(i >= n)
+                continue;
+            alive--;
+            if(!exiting && WIFSIGNALED(status)) {
+                if(now - started[i] < WORKER_QUICK_DEATH)
+                    quick[i]++;
+                else
+                    quick[i] = 0;
+                if(quick[i] >= WORKER_MAX_QUICK_DEATHS) {
+                    do_log(L_ERROR, "Worker %ld died with signal %d, "
+                           "giving up after %d quick deaths.\n",
+                           (long)pid, WTERMSIG(status), quick[i]);
+                    pids[i] = -1;
+                } else if(quick[i] > 0) {
+                    restart[i] = now + (1 << quick[i]);
+                    do_log(L_ERROR, "Worker %ld died with signal %d, "
+                           "restarting in %d seconds.\n",
+                           (long)pid, WTERMSIG(status), 1 << quick[i]);
+                    pids[i] = 0;
+                } else {
+                    do_log(L_ERROR, "Worker %ld died with signal %d, "
+                           "restarting.\n", (long)pid, WTERMSIG(status));
+                    restart[i] = now;
+                    pids[i] = 0;
+                }
+            } else {
+                if(!exiting)
+                    do_log(L_ERROR, "Worker %ld exited with status %d.\n",
+                           (long)pid, WEXITSTATUS(status));
+                pids[i] = -1;
+            }
+        }
+
+        if(workerSignals) {
+            int signals = workerSignals;
+            workerSignals = 0;
+            for(j = 0; j < NUM_WORKER_SIGNALS; j++) {
+                int signo = workerSignalList[j];
+                if(!(signals & (1 << j)) ||
+                   signo == SIGCHLD || signo == SIGALRM)
+                    continue;
+                if(signo != SIGUSR1 && signo != SIGUSR2)
+                    exiting = 1;
+                for(i = 0; i < n; i++)
+                    if(pids[i] > 0)
+                        kill(pids[i], signo);
+            }
+        }
+    }
+
+    if(pidfile)
+        unlink(pidfile);
+    exit(0);
+}
+
+#else
+
+int
+runWorkers(int n, char *pidfile)
+{
+    if(n > 0)
+        do_log(L_WARN, "Cannot fork worker processes on this platform.\n");
+    return 0;
+}
+
+#endif
 
 void
 writePid(char *pidfile)
@@ -90,6 +90,7 @@ char* vsprintf_a(const char *f, va_list args)
     ATTRIBUTE ((malloc, format (printf, 1, 0)));
 char* sprintf_a(const char *f, ...)
     ATTRIBUTE ((malloc, format (printf, 1, 2)));
+void initHashSeed(void);
 unsigned int hash(unsigned seed, const void *restrict key, int key_size, 
                   unsigned int hash_size)
      ATTRIBUTE ((pure));
@@ -97,6 +98,8 @@ char *pstrerror(int e);
 time_t mktime_gmt(struct tm *tm) ATTRIBUTE ((pure));
 AtomPtr expandTilde(AtomPtr filename);
 void do_daemonise(int noclose);
+extern int workerIndex;
+int runWorkers(int n, char *pidfile);
 void writePid(char *pidfile);
 int b64cpy(char *restrict dst, const char *restrict src, int n, int fss);
 int b64cmp(const char *restrict a, int an, const char *restrict b, int bn)